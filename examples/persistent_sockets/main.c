@@ -49,7 +49,7 @@ struct httpd_uri adder_handler = {
 int main()
 {
      /* Start the web server */
-     httpd_start();
+     httpd_start(NULL);
      httpd_register_uri_handler(&adder_handler);
 
      /* The httpd_start(), starts a new thread. Make sure the process doesn't
@@ -44,7 +44,7 @@ struct httpd_uri post_handler = {
 int main()
 {
      /* Start the web server */
-     httpd_start();
+     httpd_start(NULL);
      httpd_register_uri_handler(&get_handler);
      httpd_register_uri_handler(&post_handler);
 
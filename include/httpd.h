@@ -7,6 +7,13 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /* Logging management */
 #define HTTPD_DEBUG
@@ -24,13 +31,203 @@
  */
 
 
+/* Defaults of the configuration, see HTTPD_DEFAULT_CONFIG() */
+#ifndef HTTPD_PORT
+#define HTTPD_PORT               80
+#endif
+#ifndef HTTPD_BACKLOG
+#define HTTPD_BACKLOG            5
+#endif
+#ifndef HTTPD_STACK_SIZE
+#define HTTPD_STACK_SIZE         (12 * 1024)
+#endif
+#ifndef HTTPD_MAX_OPEN_SOCKETS
+#define HTTPD_MAX_OPEN_SOCKETS   8
+#endif
+#ifndef HTTPD_MAX_URI_HANDLERS
+#define HTTPD_MAX_URI_HANDLERS   8
+#endif
+#ifndef HTTPD_ARENA_BLOCK
+#define HTTPD_ARENA_BLOCK        2048
+#endif
+#ifndef HTTPD_RECV_BUF
+#define HTTPD_RECV_BUF           1024
+#endif
+#ifndef HTTPD_WORKERS
+#define HTTPD_WORKERS            2
+#endif
+#ifndef HTTPD_WORKER_QUEUE_LEN
+#define HTTPD_WORKER_QUEUE_LEN   16
+#endif
+#ifndef HTTPD_WORKER_STACK_SIZE
+#define HTTPD_WORKER_STACK_SIZE  (12 * 1024)
+#endif
+#ifndef HTTPD_IDLE_TIMEOUT_MS
+#define HTTPD_IDLE_TIMEOUT_MS    60000
+#endif
+#ifndef HTTPD_HDR_TIMEOUT_MS
+#define HTTPD_HDR_TIMEOUT_MS     10000
+#endif
+#ifndef HTTPD_BODY_TIMEOUT_MS
+#define HTTPD_BODY_TIMEOUT_MS    10000
+#endif
+#ifndef HTTPD_SEND_TIMEOUT_MS
+#define HTTPD_SEND_TIMEOUT_MS    10000
+#endif
+#ifndef HTTPD_ACCEPT_BUDGET
+#define HTTPD_ACCEPT_BUDGET      16
+#endif
+#ifndef HTTPD_RETRY_AFTER_S
+#define HTTPD_RETRY_AFTER_S      1
+#endif
+#ifndef HTTPD_BATCH_SIZE
+#define HTTPD_BATCH_SIZE         16384
+#endif
+
+/** Configuration of the web server, see httpd_start()
+ *
+ * Start with HTTPD_DEFAULT_CONFIG(), and change what is needed.
+ */
+typedef struct httpd_config {
+	/** The TCP port to listen on */
+	unsigned short port;
+	/** Length of the queue of connections that are yet to be accepted */
+	int            backlog;
+	/** Stack size of the event loop threads */
+	unsigned       stack_size;
+	/** Number of event loop threads, see httpd_start_reactors() */
+	unsigned       reactors;
+	/** If non-NULL, the CPU of each reactor, see httpd_start_reactors() */
+	const int     *cpus;
+	/** Maximum number of open sockets, for each reactor */
+	unsigned       max_open_sockets;
+	/** Maximum number of URI handlers that can be registered. Before the
+	 * web server is started, the limit is HTTPD_MAX_URI_HANDLERS. */
+	unsigned       max_uri_handlers;
+	/** Size of the blocks of memory that a request's URI, its decoded
+	 * query string, its response's status line and httpd_req_alloc() are
+	 * served from. A request that needs more gets more blocks. */
+	unsigned       arena_block_size;
+	/** Size of the receive buffer of each socket. A complete request
+	 * header has to fit in here. At most 65535. */
+	unsigned       recv_buf_size;
+	/** Number of threads that execute the offloaded URI handlers, the
+	 * length of their queue, and their stack size, see struct httpd_uri */
+	unsigned       workers;
+	unsigned       worker_queue_len;
+	unsigned       worker_stack_size;
+	/** Timeouts of the sessions in milliseconds, 0 disables a timeout:
+	 * - idle: a keep-alive session without any request
+	 * - header: from the connection being accepted, or the first byte of
+	 *   a request, till the end of its header
+	 * - body: from the end of a request header till the end of its body,
+	 *   however slowly the body trickles in
+	 * - send: a response that is waiting to go out, without the client
+	 *   taking any of it */
+	unsigned       idle_timeout_ms;
+	unsigned       hdr_timeout_ms;
+	unsigned       body_timeout_ms;
+	unsigned       send_timeout_ms;
+	/** With the sessions all in use, close the idle session that was used
+	 * the longest time ago to make room for a new connection, instead of
+	 * turning the new connection away */
+	bool           lru_purge;
+	/** Maximum number of connections that a reactor accepts in one go,
+	 * before it gets back to its sessions */
+	unsigned       accept_budget;
+	/** Seconds that a connection turned away with a 503, for all the
+	 * sessions being in use, is asked to wait before retrying
+	 * (Retry-After) */
+	unsigned       retry_after_s;
+	/** The responses to pipelined requests that are in already are held
+	 * back, and sent together once the pipeline is served, or once this
+	 * many bytes are held. 0 sends each response on its own. */
+	unsigned       batch_size;
+	/** Disable Nagle's algorithm on the connections (TCP_NODELAY) */
+	bool           tcp_nodelay;
+	/** Seconds that a connection may wait for its first data before it is
+	 * accepted (TCP_DEFER_ACCEPT), 0 to accept right away */
+	int            defer_accept_s;
+	/** Length of the queue of TCP Fast Open connections (TCP_FASTOPEN), 0
+	 * disables Fast Open */
+	int            fastopen_qlen;
+	/** Let other sockets listen on the port too (SO_REUSEPORT). This is
+	 * always set with multiple reactors. */
+	bool           reuse_port;
+	/** Send and receive buffer sizes of the connections (SO_SNDBUF,
+	 * SO_RCVBUF), 0 for the system's default */
+	int            sndbuf;
+	int            rcvbuf;
+} httpd_config_t;
+
+/** The default configuration */
+#define HTTPD_DEFAULT_CONFIG() {                        \
+	.port             = HTTPD_PORT,                 \
+	.backlog          = HTTPD_BACKLOG,              \
+	.stack_size       = HTTPD_STACK_SIZE,           \
+	.reactors         = 1,                          \
+	.cpus             = NULL,                       \
+	.max_open_sockets = HTTPD_MAX_OPEN_SOCKETS,     \
+	.max_uri_handlers = HTTPD_MAX_URI_HANDLERS,     \
+	.arena_block_size = HTTPD_ARENA_BLOCK,          \
+	.recv_buf_size    = HTTPD_RECV_BUF,             \
+	.workers          = HTTPD_WORKERS,              \
+	.worker_queue_len = HTTPD_WORKER_QUEUE_LEN,     \
+	.worker_stack_size = HTTPD_WORKER_STACK_SIZE,   \
+	.idle_timeout_ms  = HTTPD_IDLE_TIMEOUT_MS,      \
+	.hdr_timeout_ms   = HTTPD_HDR_TIMEOUT_MS,       \
+	.body_timeout_ms  = HTTPD_BODY_TIMEOUT_MS,      \
+	.send_timeout_ms  = HTTPD_SEND_TIMEOUT_MS,      \
+	.lru_purge        = false,                      \
+	.accept_budget    = HTTPD_ACCEPT_BUDGET,        \
+	.retry_after_s    = HTTPD_RETRY_AFTER_S,        \
+	.batch_size       = HTTPD_BATCH_SIZE,           \
+	.tcp_nodelay      = false,                      \
+	.defer_accept_s   = 0,                          \
+	.fastopen_qlen    = 0,                          \
+	.reuse_port       = false,                      \
+	.sndbuf           = 0,                          \
+	.rcvbuf           = 0,                          \
+}
+
 /** Start the Web Server
  *
- * This function starts the web server
+ * This function starts the web server. The per-session state and buffers
+ * are all allocated here, as sized by the configuration. Socket options that
+ * the port doesn't support are ignored. Where files are sent with sendfile(),
+ * SIGPIPE is ignored, unless the application has a handler for it already.
+ *
+ * \param[in] config The configuration, NULL for the default one. It isn't
+ * referred to once this returns.
  *
  * \return 0 on success, error otherwise
+ * \return -EINVAL if the configuration isn't valid
+ * \return -ENOSPC if more than max_uri_handlers are registered already
  */
-int httpd_start();
+int httpd_start(const httpd_config_t *config);
+
+/** Start the Web Server with multiple event loop threads
+ *
+ * This function starts the web server with 'count' event loop threads
+ * (reactors). Each reactor listens on the web server's port with a socket of
+ * its own (using SO_REUSEPORT), so that the incoming connections are spread
+ * across the reactors. A connection is then served by the reactor that
+ * accepted it, with its own sessions and request state.
+ *
+ * The URI handlers are shared by all the reactors. This implies that handlers
+ * may be executed concurrently from multiple threads.
+ *
+ * This is httpd_start() with the default configuration, other than the
+ * reactors.
+ *
+ * \param[in] count Number of reactors to start
+ * \param[in] cpus If non-NULL, an array of 'count' entries with the CPU that
+ * each reactor's thread should be pinned to, or -1 for no pinning. This is
+ * ignored on ports that don't support CPU affinity.
+ *
+ * \return 0 on success, error otherwise
+ */
+int httpd_start_reactors(unsigned count, const int *cpus);
 
 
 /** Stop the Web Server
@@ -63,14 +260,16 @@ typedef enum {
 
 typedef void (*httpd_free_sess_ctx_fn_t)(void *sess_ctx);
 
-/** Maximum supported URI length by our HTTPD server */
+/** The receive buffer has to be larger than this, see recv_buf_size. A URI
+ * may be as long as the request line that it is on fits in the receive
+ * buffer. */
 #define HTTPD_MAX_URI_LEN 256
 /** A single HTTPD request */
 typedef struct httpd_req {
 	/** The type of HTTP request */
 	httpd_req_type_t type;
-	/** The URI of this request */
-	const char       uri[HTTPD_MAX_URI_LEN];
+	/** The URI of this request, it lasts as long as the request */
+	const char      *uri;
 	/** Length of the request body */
 	size_t           content_len;
 	/** Internally used members */
@@ -94,12 +293,21 @@ typedef struct httpd_req {
 	 * function for freeing the session context, please specify that here.
 	 */
 	httpd_free_sess_ctx_fn_t free_ctx;
+	/** The user context of the URI handler serving this request, see
+	 * struct httpd_uri */
+	void            *user_ctx;
 } httpd_req_t;
 
 
 /** Structure for a URI handler */
 struct httpd_uri {
-	/** The URI to handle */
+	/** The URI to handle
+	 *
+	 * A request is served by the handler with the longest URI that the
+	 * request's path (the part before any '?') begins with. A '{name}' in
+	 * the URI is a parameter that matches one or more characters up to the
+	 * next '/', see httpd_req_get_uri_param(). The URI string must stay
+	 * around while the handler is registered. */
 	const char *uri;
 	/** Handler to call for a GET request. This must return
 	 * OS_SUCCESS, or else the underlying socket will be closed. */
@@ -110,16 +318,92 @@ struct httpd_uri {
 	/** Handler to call for a PUT request. This must return OS_SUCCESS, or
 	 * else the underlying socket will be closed. */
 	int (*put)(httpd_req_t *req);
+	/** Execute the handlers of this URI in the worker pool, instead of the
+	 * web server's thread. Set this for handlers that may block for long.
+	 *
+	 * The request's body is gathered as it arrives, without holding up
+	 * the other connections, and has body_timeout_ms to arrive in all.
+	 * The handler is called once it is in, and the response is sent out
+	 * by the web server once the handler returns.
+	 * Requests with a body larger than HTTPD_OFFLOAD_MAX_BODY are executed
+	 * in the web server's thread as usual. If the worker pool's queue is
+	 * full, the request is responded to with a 503. */
+	bool offload;
+	/** Any context that the handlers need, it is available to them as
+	 * the request's user_ctx */
+	void *user_ctx;
 };
 
+/** Largest request body for which a request is offloaded to the worker pool */
+#define HTTPD_OFFLOAD_MAX_BODY   (16 * 1024)
 
-#define HTTPD_MAX_URI_HANDLERS   8
-/** Register a URI handler */
+
+/** Register a URI handler
+ *
+ * The handlers are kept in a radix tree, so finding the handler of a request
+ * costs the same however many of them there are. Raise max_uri_handlers in
+ * the configuration for more of them.
+ *
+ * Handlers can be registered and unregistered from any thread (including
+ * from handlers), while the web server is running. The web server looks them
+ * up without taking any locks.
+ *
+ * \return OS_SUCCESS on success
+ * \return -ENOSPC if max_uri_handlers are already registered
+ * \return -EINVAL if the URI has an unterminated '{'
+ */
 int httpd_register_uri_handler(struct httpd_uri *handler);
 
-/** Unregister a URI handler */
+/** Unregister a URI handler
+ *
+ * Once this returns, the handler isn't executing anywhere, and won't be
+ * called again. The exceptions are the handler that this is called from, if
+ * any, and requests that were detached by the handler.
+ *
+ * \return OS_SUCCESS on success
+ * \return -EINVAL if the handler isn't registered
+ */
 int httpd_unregister_uri_handler(struct httpd_uri *handler);
 
+/** Function that finds the URI handler for a request's path and type, see
+ * httpd_set_route_lookup() */
+typedef const struct httpd_uri *(*httpd_route_lookup_t)(const char *path, size_t len,
+							httpd_req_type_t type);
+
+/** Serve a fixed set of routes
+ *
+ * The lookup is consulted first for every request, with the request's path
+ * (without any query string). If it has no URI handler for that path and
+ * request type, the registered URI handlers are looked at as usual.
+ *
+ * This is meant for routes that are fixed at build time. The C++ header
+ * httpd_routes.hpp builds such a lookup at compile time, as a perfect hash,
+ * without any registration or memory at runtime.
+ *
+ * \param[in] lookup The lookup, or NULL to stop using it
+ */
+void httpd_set_route_lookup(httpd_route_lookup_t lookup);
+
+/** Most parameters that are captured from a request's URI */
+#define HTTPD_MAX_URI_PARAMS     4
+
+/** Get a parameter of the request's URI
+ *
+ * For a handler registered for "/users/{id}", the request "/users/42" has the
+ * parameter "id" set to "42". The value isn't copied, it points into the
+ * request's URI and isn't NUL terminated.
+ *
+ * \param[in] r The request
+ * \param[in] name Name of the parameter
+ * \param[out] val The parameter's value
+ * \param[out] val_len Length of the parameter's value
+ *
+ * \return OS_SUCCESS on success
+ * \return -ENOENT if the handler's URI doesn't have such a parameter
+ */
+int httpd_req_get_uri_param(httpd_req_t *r, const char *name,
+			    const char **val, size_t *val_len);
+
 /** End of URI Handlers
  * @}
  */
@@ -138,6 +422,9 @@ int httpd_unregister_uri_handler(struct httpd_uri *handler);
  * single buffer. If you wish to send response in incremental segments
  * use httpd_resp_send_chunk() instead.
  *
+ * The headers and the data are sent out together, with a single vectored
+ * send.
+ *
  * If no status code and content-type were already sent, this will
  * send a 200 OK status code and a content type as text/html. You may
  * call the following functions before this API to configure the
@@ -160,6 +447,88 @@ int httpd_unregister_uri_handler(struct httpd_uri *handler);
  */
 int httpd_resp_send(httpd_req_t *r, const char *buf, unsigned buf_len);
 
+/** API to send a response whose body doesn't change
+ *
+ * This is httpd_resp_send(), except that the body isn't copied if the client
+ * can't take all of it right away. The response refers to the body till it
+ * has gone out, which may be well after this returns.
+ *
+ * \param[in] r The request being responded to
+ * \param[in] buf The body, which must remain valid and unchanged while the web
+ * server is running (a constant, for instance)
+ * \param[in] buf_len Length of the body
+ *
+ * \returns OS_SUCCESS on success. Negative error otherwise.
+ */
+int httpd_resp_send_static(httpd_req_t *r, const char *buf, unsigned buf_len);
+
+/** Prototype of a function that produces the body of a response, a piece at
+ * a time, see httpd_resp_send_provider()
+ *
+ * \param[in] ctx The context that was passed to httpd_resp_send_provider()
+ * \param[out] buf The next piece of the body goes in here
+ * \param[in] buf_len Size of buf
+ *
+ * \return the number of bytes put in buf
+ * \return 0 once the body is complete
+ * \return negative on error, which closes the connection
+ */
+typedef int (*httpd_body_provider_t)(void *ctx, char *buf, unsigned buf_len);
+
+/** Prototype of a function that frees the context of a body provider */
+typedef void (*httpd_free_provider_ctx_fn_t)(void *ctx);
+
+/** API to send a response whose body is produced as the client takes it
+ *
+ * This sends the response header, set up the same way as httpd_resp_send()
+ * does. The body is then pulled from 'provider', a piece at a time, whenever
+ * the client has taken the previous pieces. So a large response that is
+ * generated on the fly takes up no more than a piece's worth of memory, and
+ * takes none of the web server's time while the client is slow.
+ *
+ * The provider is executed by the web server's thread: first from within this
+ * call, for as much as the socket takes right away, and then as the client
+ * reads. It may be called after the URI handler has returned, so ctx must
+ * not point to the handler's stack. For requests that are served by the worker
+ * pool, the body is all produced upfront instead.
+ *
+ * \param[in] r The request being responded to
+ * \param[in] len The length of the body, or -1 if that isn't known. The body
+ * is then sent with chunked encoding, each piece as a chunk.
+ * \param[in] provider The function that produces the body
+ * \param[in] free_ctx If non-NULL, this is called with ctx once the provider
+ * is done with, including when the connection is closed before that
+ * \param[in] ctx The context that the provider is called with
+ *
+ * \returns OS_SUCCESS on success. Negative error otherwise, ctx is freed
+ * then too.
+ */
+int httpd_resp_send_provider(httpd_req_t *r, long len, httpd_body_provider_t provider,
+			     httpd_free_provider_ctx_fn_t free_ctx, void *ctx);
+
+/** API to send a file as the HTTP response
+ *
+ * This API sends 'len' bytes of the file, starting at 'offset', as the
+ * response to the request. The header is set up the same way as
+ * httpd_resp_send() does.
+ *
+ * Where the port supports it, the file's data is handed to the socket by the
+ * kernel (sendfile), without being copied into the web server. With send
+ * overrides, or for requests served by the worker pool, the data is read in
+ * and sent out in pieces instead.
+ *
+ * \note The file descriptor isn't closed. It can be closed once this returns,
+ * the web server keeps a duplicate of it for whatever hasn't gone out yet.
+ *
+ * \param[in] r The request being responded to
+ * \param[in] fd The file to be sent, opened for reading
+ * \param[in] offset Offset in the file to start at
+ * \param[in] len Number of bytes to send
+ *
+ * \returns OS_SUCCESS on success. Negative error otherwise.
+ */
+int httpd_resp_send_file(httpd_req_t *r, int fd, off_t offset, size_t len);
+
 /** API to send one HTTP chunk
  *
  * This API will send the data as an HTTP response to the
@@ -177,6 +546,11 @@ int httpd_resp_send(httpd_req_t *r, const char *buf, unsigned buf_len);
  * - httpd_resp_set_hdr() - for appending any additional field-value
  *                         entries in the response header
  *
+ * Small pieces of data are coalesced in a per-request buffer (of
+ * HTTPD_CHUNK_BUF bytes), which is sent out as one chunk when it fills up,
+ * or with the final call. Data larger than that buffer is sent out as a
+ * chunk of its own.
+ *
  * \note When you are finished sending all your chunks, you must call
  * this function with buf_len as 0.
  *
@@ -198,6 +572,8 @@ int httpd_resp_send_chunk(httpd_req_t *r, const char *buf, unsigned buf_len);
 #define HTTPD_404      "404 Not Found"
 /** HTTP Response 500 */
 #define HTTPD_500      "500 Internal Server Error"
+/** HTTP Response 503 */
+#define HTTPD_503      "503 Service Unavailable"
 
 /** API to set the HTTP status code
  *
@@ -236,10 +612,16 @@ void httpd_resp_set_status(httpd_req_t *r, const char *status);
  */
 void httpd_resp_set_type(httpd_req_t *r, const char *type);
 
+/** Maximum number of additional headers in a response */
+#define HTTPD_MAX_RESP_HDRS   8
+
 /** API to set any additional headers
  *
  * This API sets any additional header fields that should be sent in
- * the response.
+ * the response. Up to HTTPD_MAX_RESP_HDRS headers can be set.
+ *
+ * \note The field and value strings aren't copied. They must remain valid
+ * until the response is sent out.
  *
  * \param[in] r The request being responded to
  * \param[in] field The field name of the HTTP header
@@ -266,6 +648,27 @@ int httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value);
  */
 int httpd_req_recv(httpd_req_t *r, char *buf, unsigned buf_len);
 
+/** API to allocate memory that lasts as long as the request
+ *
+ * The memory comes out of the request's arena, which is emptied in one go
+ * once the request is done with, so there is no freeing it. This is far
+ * cheaper than malloc() for the temporaries of a URI handler, say a buffer to
+ * build the response in, or the value of a header set with
+ * httpd_resp_set_hdr().
+ *
+ * \note The memory is gone once the URI handler returns, or for a request
+ * detached with httpd_req_async_handler_begin(), once it is completed. It
+ * mustn't be used for anything that outlives that, like the context of a
+ * body provider.
+ *
+ * \param[in] r The request being responded to
+ * \param[in] size The number of bytes needed
+ *
+ * \return The memory, aligned for any type
+ * \return NULL if out of memory
+ */
+void *httpd_req_alloc(httpd_req_t *r, size_t size);
+
 /** Get the Socket Descriptor from the HTTP request
  *
  * This API will return the socket descriptor from the HTTP request. You should
@@ -305,6 +708,11 @@ static inline int httpd_resp_send_404(httpd_req_t *r)
  * If the send override function is set, this API will end up
  * calling that send override function eventually to send data out.
  *
+ * The sockets are non-blocking. Whatever the client can't take right away is
+ * copied into the session's output queue, and sent out as the client takes
+ * it, without holding up the other sessions. The requests that are pipelined
+ * behind this one are served after that.
+ *
  * \param[in] r The request being responded to
  * \param[in] buf Pointer to a buffer that stores the data
  * \param[in] buf_len Length of the data from the buffer that should
@@ -315,6 +723,10 @@ static inline int httpd_resp_send_404(httpd_req_t *r)
 int httpd_send(httpd_req_t *r, const char *buf, unsigned buf_len);
 
 /** Prototype for HTTPDs low-level send function
+ *
+ * Data is sent with MSG_DONTWAIT and MSG_NOSIGNAL in flags. If none of it can
+ * be sent right away, the function should return -1 with errno set to EAGAIN,
+ * instead of waiting. It is called again once the socket is writable.
  *
  * \return the number of bytes sent
  */
@@ -326,11 +738,22 @@ typedef int (*httpd_send_func_t)(int sockfd, const char *buf, unsigned buf_len,
  */
 typedef int (*httpd_recv_func_t)(int sockfd, char *buf, unsigned buf_len, int flags);
 
+/** Prototype for HTTPDs low-level vectored send function
+ *
+ * This is called the same way as the send function, see httpd_send_func_t.
+ *
+ * \return the number of bytes sent
+ */
+typedef int (*httpd_sendv_func_t)(int sockfd, const struct iovec *iov, int iovcnt, int flags);
+
 /** Override web server's send function
  *
  * This function overrides the web server's send function. This same function is
  * used to send out any response to any HTTP request.
  *
+ * Unless a vectored send override is also set, responses are then sent out
+ * by calling this for each of their pieces.
+ *
  * \param[in] r The request being responded to
  * \param[in] send_func The send function to be set for this request
  *
@@ -338,11 +761,29 @@ typedef int (*httpd_recv_func_t)(int sockfd, char *buf, unsigned buf_len, int fl
  */
 int httpd_set_send_override(httpd_req_t *r, httpd_send_func_t send_func);
 
+/** Override web server's vectored send function
+ *
+ * This function overrides the function that the web server uses for sending
+ * out a response's headers and data in one go. Set this along with the send
+ * override, if the underlying transport can gather multiple buffers into a
+ * single write.
+ *
+ * \param[in] r The request being responded to
+ * \param[in] sendv_func The vectored send function to be set for this request
+ *
+ * \returns OS_SUCCESS on success. Negative error otherwise.
+ */
+int httpd_set_sendv_override(httpd_req_t *r, httpd_sendv_func_t sendv_func);
+
 /** Override web server's receive function
  *
  * This function overrides the web server's receive function. This same function is
  * used to read and parse HTTP headers as well as body.
  *
+ * The sockets are non-blocking. The function should return -1 with errno set
+ * to EAGAIN if there is no data, instead of waiting for it. For the request
+ * body, the web server then waits for the socket to be readable.
+ *
  * \param[in] r The request being responded to
  * \param[in] recv_func The receive function to be set for this request
  *
@@ -383,7 +824,8 @@ void httpd_trigger_sess_close(int sockfd);
 /** Get the query paramaters from URL
  *
  * This API can be used to get the various paramaters (name=value pairs)
- * in the received URL.
+ * in the received URL. The value is percent-decoded, and copied into val.
+ * Use httpd_req_get_query() to get at it without the copy.
  *
  * \param[in] r The httpd query structure
  * \param[in] key The key to be searched in the query string
@@ -396,6 +838,151 @@ void httpd_trigger_sess_close(int sockfd);
  */
 int httpd_req_get_url_param(httpd_req_t *r, char *key, char *val, int val_size);
 
+/** Request headers that are recognised by the parser, so that they can be
+ * looked up without comparing their names */
+typedef enum {
+	/** Any other header */
+	HTTPD_HDR_OTHER,
+	HTTPD_HDR_HOST,
+	HTTPD_HDR_CONTENT_LENGTH,
+	HTTPD_HDR_CONTENT_TYPE,
+	HTTPD_HDR_CONNECTION,
+	HTTPD_HDR_ACCEPT,
+	HTTPD_HDR_ACCEPT_ENCODING,
+	HTTPD_HDR_AUTHORIZATION,
+	HTTPD_HDR_COOKIE,
+	HTTPD_HDR_IF_NONE_MATCH,
+	HTTPD_HDR_USER_AGENT,
+	HTTPD_HDR_TRANSFER_ENCODING,
+	HTTPD_HDR_MAX,
+} httpd_hdr_t;
+
+/** Most headers of a request that are kept, the rest are ignored */
+#ifndef HTTPD_MAX_REQ_HDRS
+#define HTTPD_MAX_REQ_HDRS 24
+#endif
+
+/** Get the value of a request header
+ *
+ * The parser only notes down where each header is, the value is neither
+ * copied nor looked at till it is asked for. The value points into the
+ * session's receive buffer, and stays valid till the handler returns (or,
+ * for a detached request, till it is completed). Leading and trailing white
+ * space is left out, and the value is NUL terminated.
+ *
+ * \param[in] r The request
+ * \param[in] field The header's name, matched regardless of case
+ * \param[out] val The header's value
+ * \param[out] val_len Length of the value, may be NULL
+ *
+ * \return OS_SUCCESS on success
+ * \return -ENOENT if the request doesn't have the header
+ */
+int httpd_req_get_hdr_value(httpd_req_t *r, const char *field,
+			    const char **val, size_t *val_len);
+
+/** Get the value of a common request header
+ *
+ * This is the same as httpd_req_get_hdr_value(), for the headers that the
+ * parser recognises. It finds the header without any string comparisons.
+ *
+ * \param[in] r The request
+ * \param[in] hdr The header
+ * \param[out] val The header's value
+ * \param[out] val_len Length of the value, may be NULL
+ *
+ * \return OS_SUCCESS on success
+ * \return -ENOENT if the request doesn't have the header
+ */
+int httpd_req_get_hdr(httpd_req_t *r, httpd_hdr_t hdr, const char **val,
+		      size_t *val_len);
+
+/** Most parameters that are looked at in a request's query string, the rest
+ * are ignored */
+#ifndef HTTPD_MAX_QUERY_PARAMS
+#define HTTPD_MAX_QUERY_PARAMS 16
+#endif
+
+/** Get a parameter of the request's query string
+ *
+ * The query string is split up and percent-decoded once, the first time that
+ * any of its parameters is asked for, and the parameters are kept in a small
+ * index. After that, a parameter is found without any parsing or copying.
+ * The key must match exactly. A parameter without an '=' has an empty value.
+ *
+ * \param[in] r The request
+ * \param[in] key The parameter's name
+ * \param[out] val The parameter's value, NUL terminated. It is valid till the
+ * request is responded to.
+ * \param[out] val_len Length of the value, may be NULL
+ *
+ * \return OS_SUCCESS on success
+ * \return -ENOENT if there is no such parameter
+ */
+int httpd_req_get_query(httpd_req_t *r, const char *key, const char **val,
+			size_t *val_len);
+
+/** Iterate over the parameters of the request's query string
+ *
+ * \code{.c}
+ * unsigned it = 0;
+ * const char *key, *val;
+ * while (httpd_req_query_next(r, &it, &key, &val) == OS_SUCCESS)
+ *	printf("%s = %s\n", key, val);
+ * \endcode
+ *
+ * \param[in] r The request
+ * \param[in,out] it The iterator, which starts at 0
+ * \param[out] key The parameter's name, percent-decoded and NUL terminated
+ * \param[out] val The parameter's value, percent-decoded and NUL terminated
+ *
+ * \return OS_SUCCESS on success
+ * \return -ENOENT once there are no more parameters
+ */
+int httpd_req_query_next(httpd_req_t *r, unsigned *it, const char **key,
+			 const char **val);
+
+/** Detach a request from the web server, to be completed later
+ *
+ * A URI handler that has to wait for something (for example, device I/O) can
+ * call this, and return right away. The web server then goes on serving the
+ * other connections, while the detached request is responded to later, from
+ * any thread, using the request/response APIs on the returned request. Once
+ * the response is complete, call httpd_req_async_handler_complete().
+ *
+ * The request's body is read before this returns, so it must not be larger
+ * than HTTPD_OFFLOAD_MAX_BODY. The response is collected, and sent out by the
+ * web server on completion. The requests pipelined behind this one on the
+ * same connection are served only after that, so the responses go out in
+ * order.
+ *
+ * \note The original request must not be used after this call. All
+ * detached requests must be completed before httpd_stop() is called.
+ *
+ * \param[in] r The request that the URI handler was called with
+ * \param[out] out The detached request
+ *
+ * \return OS_SUCCESS on success
+ * \return error otherwise, the request stays with the URI handler
+ */
+int httpd_req_async_handler_begin(httpd_req_t *r, httpd_req_t **out);
+
+/** Complete a detached request
+ *
+ * The response that was generated on the detached request is sent out, and
+ * the request is freed. This can be called from any thread. If the web
+ * server's control channel is full, this waits for room, except on the
+ * web server's own threads.
+ *
+ * \param[in] r The request returned by httpd_req_async_handler_begin()
+ *
+ * \return OS_SUCCESS on success
+ * \return -ENOSPC if called on a web server's thread, with the control
+ * channel full. The request stays detached, call this again later.
+ * \return error otherwise
+ */
+int httpd_req_async_handler_complete(httpd_req_t *r);
+
 /** End of Request / Response
  * @}
  */
@@ -415,6 +1002,10 @@ int httpd_req_get_url_param(httpd_req_t *r, char *key, char *val, int val_size);
 typedef void (*httpd_work_fn_t)(void *arg);
 
 /** Execute function in HTTPD's context
+ *
+ * When called from a URI handler, the work is executed by the reactor
+ * serving that handler's request. Otherwise it is executed by the first
+ * reactor.
  *
  * \note For the most part you shouldn't have to use this function. Some
  * protocols require that the web server generate some asynchronous data and
@@ -434,4 +1025,166 @@ int httpd_queue_work(httpd_work_fn_t work, void *arg);
  * @}
  */
 
+/* ************** Group: Connections ************** */
+/** @name Connections
+ * APIs related to the connections that the web server accepts
+ * @{
+ */
+
+/** Statistics of the connections, of all the reactors together */
+struct httpd_conn_stats {
+	/** Number of connections that were accepted, and given a session */
+	unsigned long accepted;
+	/** Number of connections that were turned away with a 503, since all
+	 * the sessions were in use */
+	unsigned long shed;
+	/** Number of connections that were closed right away, since they
+	 * couldn't be set up, or the 503 couldn't be sent */
+	unsigned long rejected;
+};
+
+/** Get the statistics of the connections
+ *
+ * A growing count of shed connections means that the web server is
+ * overloaded, see max_open_sockets and lru_purge of httpd_config_t.
+ *
+ * \param[out] stats The statistics are copied here
+ *
+ * \return OS_SUCCESS on success
+ * \return error if the web server isn't running
+ */
+int httpd_get_conn_stats(struct httpd_conn_stats *stats);
+
+/** End of Group Connections
+ * @}
+ */
+
+/* ************** Group: Worker Pool ************** */
+/** @name Worker Pool
+ * APIs related to the pool of threads that execute offloaded URI handlers
+ * @{
+ */
+
+/** Statistics of the worker pool */
+struct httpd_worker_stats {
+	/** Number of requests waiting in the queue */
+	unsigned      queued;
+	/** The largest number of requests that were waiting in the queue */
+	unsigned      max_queued;
+	/** Number of requests that were executed by the workers */
+	unsigned long executed;
+	/** Number of requests that were rejected since the queue was full */
+	unsigned long rejected;
+};
+
+/** Get the statistics of the worker pool
+ *
+ * These are useful for sizing the pool, see the workers and
+ * worker_queue_len of httpd_config_t.
+ *
+ * \param[out] stats The statistics are copied here
+ *
+ * \return OS_SUCCESS on success
+ * \return error if the worker pool isn't running
+ */
+int httpd_get_worker_stats(struct httpd_worker_stats *stats);
+
+/** End of Group Worker Pool
+ * @}
+ */
+
+/* ************** Group: Static Assets ************** */
+/** @name Static Assets
+ * APIs related to serving a bundle of static assets
+ * @{
+ */
+
+/** A bundle of static assets
+ *
+ * A bundle is made from a directory of assets with util/mkbundle.py (see the
+ * 'bundle' target of the Makefile). The bundle carries each asset's complete
+ * response headers, and a gzipped variant for the compressible ones, with an
+ * ETag for each variant. An asset is then served by looking it up in the
+ * bundle's hash table, and sending out its header and data straight from the
+ * bundle, with a single vectored send. Requests that accept gzip get the
+ * gzipped variant, and those whose If-None-Match matches the variant they
+ * would get are responded to with a 304.
+ *
+ * The members are for internal use.
+ */
+struct httpd_bundle {
+	const unsigned char *image;
+	size_t               len;
+	bool                 mapped;
+	struct httpd_uri     uri;
+};
+
+/** Open a bundle that is in memory
+ *
+ * Use this for a bundle that is linked into the program (made with
+ * 'mkbundle.py -c'). The image must stay around till the bundle is closed.
+ *
+ * \param[out] b The bundle to be set up
+ * \param[in] image The bundle's image, aligned to 4 bytes
+ * \param[in] len Length of the image
+ *
+ * \return OS_SUCCESS on success
+ * \return error if this isn't a valid bundle
+ */
+int httpd_bundle_open(struct httpd_bundle *b, const void *image, size_t len);
+
+/** Open a bundle from a file
+ *
+ * The file is mapped into memory, rather than being read in. This isn't
+ * available on ports without mmap().
+ *
+ * \param[out] b The bundle to be set up
+ * \param[in] path The bundle's file
+ *
+ * \return OS_SUCCESS on success
+ * \return error otherwise
+ */
+int httpd_bundle_map(struct httpd_bundle *b, const char *path);
+
+/** Close a bundle
+ *
+ * The bundle must be unregistered first. Responses out of a bundle refer to
+ * its assets till they have gone out, so close it only once the web server is
+ * stopped.
+ *
+ * \param[in] b The bundle
+ */
+void httpd_bundle_close(struct httpd_bundle *b);
+
+/** Serve the assets of a bundle
+ *
+ * This registers a single URI handler for the URI prefix that the bundle
+ * was made with (--prefix of mkbundle.py), which serves GET requests for all
+ * of the bundle's assets. Requests for anything else under the prefix get a
+ * 404. Handlers for longer URIs under the same prefix take precedence.
+ *
+ * \param[in] b The bundle
+ *
+ * \return OS_SUCCESS on success
+ * \return error otherwise
+ */
+int httpd_bundle_register(struct httpd_bundle *b);
+
+/** Stop serving the assets of a bundle
+ *
+ * \param[in] b The bundle
+ *
+ * \return OS_SUCCESS on success
+ * \return error otherwise
+ */
+int httpd_bundle_unregister(struct httpd_bundle *b);
+
+/** End of Group Static Assets
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* ! _HTTPD_H_ */
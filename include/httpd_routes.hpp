@@ -0,0 +1,268 @@
+/**
+ * \file httpd_routes.hpp
+ * \brief Routes that are fixed at compile time (C++17)
+ *
+ * For a set of routes that never changes, the route table can be built by the
+ * compiler, instead of registering URI handlers at runtime. The table is a
+ * perfect hash of the paths and request types (hash and displace, CHD), so a
+ * lookup is a hash of the path and a single comparison, and the table takes no
+ * memory besides what the compiler lays out.
+ *
+ * \code{.cpp}
+ * static constexpr httpd::route routes[] = {
+ *	{ "/hello", HTTPD_RQTYPE_GET,  hello_get_handler },
+ *	{ "/echo",  HTTPD_RQTYPE_POST, echo_post_handler },
+ * };
+ * static constexpr auto table = httpd::make_routes(routes);
+ *
+ * httpd_set_route_lookup(httpd::route_lookup<table>);
+ * \endcode
+ *
+ * The paths are matched exactly. Anything that isn't in the table is looked
+ * up among the URI handlers registered with httpd_register_uri_handler().
+ */
+#ifndef _HTTPD_ROUTES_HPP_
+#define _HTTPD_ROUTES_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <httpd.h>
+
+namespace httpd {
+
+/** A route: the handler for requests of a type, for a path */
+struct route {
+	/** The path, without any query string */
+	const char *path;
+	/** The request type that the handler is for */
+	httpd_req_type_t type;
+	/** The handler */
+	int (*handler)(httpd_req_t *req);
+	/** Execute the handler in the worker pool, see struct httpd_uri */
+	bool offload = false;
+};
+
+namespace detail {
+
+constexpr size_t strlen(const char *s)
+{
+	size_t len = 0;
+	while (s[len])
+		len++;
+	return len;
+}
+
+constexpr bool equal(const char *a, const char *b, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		if (a[i] != b[i])
+			return false;
+	return true;
+}
+
+/* FNV-1a of the path and type, varied by the seed, with its bits mixed
+ * (the finaliser of splitmix64) so that all of them are good to use */
+constexpr uint64_t hash(uint32_t seed, const char *path, size_t len,
+			httpd_req_type_t type)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)path[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= (uint64_t)type;
+	h *= 0x100000001b3ULL;
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+/* What a route's hash is split up into: its bucket, and the two values that
+ * the displacement of the bucket is applied to. The step is odd, so that with
+ * a power of 2 slots, stepping by it goes through all of them. */
+constexpr uint32_t bucket(uint64_t h, size_t buckets)
+{
+	return (uint32_t)(h >> 32) % buckets;
+}
+
+constexpr uint32_t base(uint64_t h)
+{
+	return (uint32_t)h;
+}
+
+constexpr uint32_t step(uint64_t h)
+{
+	return (uint32_t)((h * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+}
+
+/* At most half full, so that the buckets are placed quickly */
+constexpr size_t slots(size_t n)
+{
+	size_t s = 1;
+	while (s < 2 * n)
+		s *= 2;
+	return s;
+}
+
+/* Not constexpr, so that reaching these fails the compilation */
+inline void duplicate_route() {}
+inline void no_perfect_hash() {}
+
+} /* namespace detail */
+
+/** A route table, made with make_routes()
+ *
+ * The routes are hashed into buckets, about one route each. Every bucket gets
+ * a displacement (d0, d1) that puts its routes in free slots, at
+ * (base + d0 * step + d1) of their hash. The buckets are placed largest first,
+ * while there is the most room. A bucket of one route always finds a slot, as
+ * d1 goes through all of them. The seed only changes if the routes of a bucket
+ * can't be kept apart, which takes them to agree on their hash in the bits
+ * that are used.
+ */
+template <size_t N>
+class route_table {
+public:
+	static constexpr size_t slots = detail::slots(N);
+	static constexpr size_t buckets = N;
+	/* Seeds to try before giving up */
+	static constexpr uint32_t max_seed = 64;
+
+	constexpr explicit route_table(const route (&routes)[N])
+	{
+		for (size_t i = 0; i < N; i++) {
+			uris_[i].uri = routes[i].path;
+			uris_[i].offload = routes[i].offload;
+			switch (routes[i].type) {
+			case HTTPD_RQTYPE_GET:
+				uris_[i].get = routes[i].handler;
+				break;
+			case HTTPD_RQTYPE_POST:
+				uris_[i].post = routes[i].handler;
+				break;
+			case HTTPD_RQTYPE_PUT:
+				uris_[i].put = routes[i].handler;
+				break;
+			}
+			types_[i] = routes[i].type;
+			lens_[i] = detail::strlen(routes[i].path);
+			for (size_t j = 0; j < i; j++)
+				if (types_[j] == types_[i] && lens_[j] == lens_[i] &&
+				    detail::equal(routes[j].path, routes[i].path, lens_[i]))
+					detail::duplicate_route();
+		}
+
+		for (seed_ = 0; seed_ < max_seed; seed_++)
+			if (place())
+				return;
+		detail::no_perfect_hash();
+	}
+
+	/** Find the URI handler for a path and request type, NULL if there
+	 * is none */
+	constexpr const struct httpd_uri *find(const char *path, size_t len,
+					       httpd_req_type_t type) const
+	{
+		uint64_t h = detail::hash(seed_, path, len, type);
+		uint32_t b = detail::bucket(h, buckets);
+		int i = slots_[slot(h, d0_[b], d1_[b])];
+		if (i < 0 || types_[i] != type || lens_[i] != len ||
+		    ! detail::equal(uris_[i].uri, path, len))
+			return nullptr;
+		return &uris_[i];
+	}
+
+private:
+	static constexpr size_t slot(uint64_t h, uint32_t d0, uint32_t d1)
+	{
+		return (detail::base(h) + d0 * detail::step(h) + d1) & (slots - 1);
+	}
+
+	/* Place the routes of every bucket in slots of their own, with the
+	 * current seed */
+	constexpr bool place()
+	{
+		uint64_t hashes[N] = {};
+		size_t sizes[buckets] = {};
+		bool placed[buckets] = {};
+
+		for (size_t s = 0; s < slots; s++)
+			slots_[s] = -1;
+		for (size_t i = 0; i < N; i++) {
+			hashes[i] = detail::hash(seed_, uris_[i].uri, lens_[i], types_[i]);
+			sizes[detail::bucket(hashes[i], buckets)]++;
+		}
+		for (size_t n = 0; n < buckets; n++) {
+			size_t b = buckets;
+			for (size_t c = 0; c < buckets; c++)
+				if (! placed[c] && (b == buckets || sizes[c] > sizes[b]))
+					b = c;
+			placed[b] = true;
+			if (sizes[b] && ! place_bucket(b, hashes))
+				return false;
+		}
+		return true;
+	}
+
+	/* Find the first displacement that puts all the routes of bucket b in
+	 * free slots, and take those */
+	constexpr bool place_bucket(size_t b, const uint64_t (&hashes)[N])
+	{
+		size_t routes[N] = {};
+		size_t n = 0;
+
+		for (size_t i = 0; i < N; i++)
+			if (detail::bucket(hashes[i], buckets) == b)
+				routes[n++] = i;
+		for (uint32_t d0 = 0; d0 < slots; d0++) {
+			for (uint32_t d1 = 0; d1 < slots; d1++) {
+				size_t k = 0;
+				for (; k < n; k++) {
+					size_t s = slot(hashes[routes[k]], d0, d1);
+					if (slots_[s] >= 0)
+						break;
+					slots_[s] = (int)routes[k];
+				}
+				if (k == n) {
+					d0_[b] = d0;
+					d1_[b] = d1;
+					return true;
+				}
+				/* Two of them clashed, or a slot was taken */
+				while (k--)
+					slots_[slot(hashes[routes[k]], d0, d1)] = -1;
+			}
+		}
+		return false;
+	}
+
+	struct httpd_uri uris_[N] = {};
+	httpd_req_type_t types_[N] = {};
+	size_t           lens_[N] = {};
+	int              slots_[slots] = {};
+	uint32_t         d0_[buckets] = {};
+	uint32_t         d1_[buckets] = {};
+	uint32_t         seed_ = 0;
+};
+
+/** Build a route table, at compile time when it is constexpr */
+template <size_t N>
+constexpr route_table<N> make_routes(const route (&routes)[N])
+{
+	return route_table<N>(routes);
+}
+
+/** The lookup of a route table, for httpd_set_route_lookup() */
+template <const auto &Table>
+const struct httpd_uri *route_lookup(const char *path, size_t len,
+				     httpd_req_type_t type)
+{
+	return Table.find(path, len, type);
+}
+
+} /* namespace httpd */
+
+#endif /* ! _HTTPD_ROUTES_HPP_ */
@@ -8,6 +8,8 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
 #include <unistd.h>
 #include <stdint.h>
 
@@ -21,7 +23,10 @@ typedef TaskHandle_t othread_t;
 
 #define OS_DEFAULT_PRIORITY 0
 
-static inline int othread_create(othread_t *thread, const char *name, uint16_t stacksize, int prio,
+/* Storage that is private to each thread */
+#define OS_THREAD_LOCAL __thread
+
+static inline int othread_create(othread_t *thread, const char *name, unsigned stacksize, int prio,
 				 void (*thread_routine)(void *arg), void *arg)
 {
      int ret = xTaskCreate(thread_routine, name, stacksize, arg, prio, thread);
@@ -41,6 +46,60 @@ static inline void othread_sleep(int msecs)
      vTaskDelay(msecs/portTICK_RATE_MS);
 }
 
+/* Milliseconds since some point in the past. This never goes back. */
+static inline uint64_t otime_ms()
+{
+     return esp_timer_get_time() / 1000;
+}
+
+/* Mutex */
+typedef SemaphoreHandle_t omutex_t;
+
+static inline int omutex_init(omutex_t *m)
+{
+     *m = xSemaphoreCreateMutex();
+     return *m ? OS_SUCCESS : OS_FAIL;
+}
+
+static inline void omutex_lock(omutex_t *m)
+{
+     xSemaphoreTake(*m, portMAX_DELAY);
+}
+
+static inline void omutex_unlock(omutex_t *m)
+{
+     xSemaphoreGive(*m);
+}
+
+static inline void omutex_delete(omutex_t *m)
+{
+     vSemaphoreDelete(*m);
+}
+
+/* Counting semaphore */
+typedef SemaphoreHandle_t osem_t;
+
+static inline int osem_init(osem_t *s, unsigned count)
+{
+     *s = xSemaphoreCreateCounting(0xffff, count);
+     return *s ? OS_SUCCESS : OS_FAIL;
+}
+
+static inline void osem_wait(osem_t *s)
+{
+     xSemaphoreTake(*s, portMAX_DELAY);
+}
+
+static inline void osem_post(osem_t *s)
+{
+     xSemaphoreGive(*s);
+}
+
+static inline void osem_delete(osem_t *s)
+{
+     vSemaphoreDelete(*s);
+}
+
 
 /* Memory Management */
 static inline size_t os_get_current_free_mem()
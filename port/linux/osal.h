@@ -0,0 +1,53 @@
+/*! \file osal.h
+ * OS Abstration Layer
+ *
+ * Linux is a Unix, with a few additional facilities that the web server can
+ * make use of.
+ */
+/* All Rights Reserved */
+#ifndef _FL_LINUX_OSAL_H_
+#define _FL_LINUX_OSAL_H_
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "../unix/osal.h"
+
+/* Use epoll for waiting on the sockets instead of select */
+#define OS_HAVE_EPOLL
+
+/* Wake up the reactors through an eventfd, instead of a loopback socket */
+#define OS_HAVE_EVENTFD
+
+/* Files can be sent out on sockets without copying (sendfile) */
+#define OS_HAVE_SENDFILE
+
+/* Connections can be accepted with the flags of the new socket set in the same
+ * call, see oaccept4() */
+#define OS_HAVE_ACCEPT4
+
+/* Threads can be pinned to a CPU */
+#define OS_HAVE_CPU_AFFINITY
+
+/* Pin the calling thread to a CPU */
+static inline int othread_set_cpu(int cpu)
+{
+	unsigned long mask[cpu / (8 * sizeof(unsigned long)) + 1];
+	memset(mask, 0, sizeof(mask));
+	mask[cpu / (8 * sizeof(unsigned long))] = 1UL << (cpu % (8 * sizeof(unsigned long)));
+	/* The glibc wrappers for this need _GNU_SOURCE */
+	if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0)
+		return OS_FAIL;
+	return OS_SUCCESS;
+}
+
+/* Accept a connection, with SOCK_* flags for the new socket */
+static inline int oaccept4(int fd, struct sockaddr *addr, socklen_t *addr_len,
+			   int flags)
+{
+	/* The glibc wrapper for this needs _GNU_SOURCE */
+	return syscall(SYS_accept4, fd, addr, addr_len, flags);
+}
+
+#endif /* ! _FL_LINUX_OSAL_H_ */
@@ -0,0 +1,16 @@
+/*! \file osal.h
+ * OS Abstration Layer
+ *
+ * Linux, with the web server's I/O performed through io_uring. This needs
+ * Linux 5.19 or later.
+ */
+/* All Rights Reserved */
+#ifndef _FL_LINUX_URING_OSAL_H_
+#define _FL_LINUX_URING_OSAL_H_
+
+#include "../linux/osal.h"
+
+/* Perform accept, recv and send through an io_uring */
+#define OS_HAVE_IO_URING
+
+#endif /* ! _FL_LINUX_URING_OSAL_H_ */
@@ -9,6 +9,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
 
 /* Too many abstraction layer APIs start with os_, causing conflicts. We will
  * prefix the API with 'o'
@@ -20,7 +21,13 @@ typedef pthread_t othread_t;
 
 #define OS_DEFAULT_PRIORITY 0
 
-static inline int othread_create(othread_t *thread, const char *name, uint16_t stacksize, int prio,
+/* Storage that is private to each thread */
+#define OS_THREAD_LOCAL __thread
+
+/* Files can be mapped into memory */
+#define OS_HAVE_MMAP
+
+static inline int othread_create(othread_t *thread, const char *name, unsigned stacksize, int prio,
 				 void (*thread_routine)(void *arg), void *arg)
 {
 	pthread_attr_t thread_attr;
@@ -43,6 +50,80 @@ static inline void othread_sleep(int msecs)
 	usleep(msecs * 1000);
 }
 
+/* Milliseconds since some point in the past. This never goes back. */
+static inline uint64_t otime_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Mutex */
+typedef pthread_mutex_t omutex_t;
+
+static inline int omutex_init(omutex_t *m)
+{
+	return pthread_mutex_init(m, NULL) ? OS_FAIL : OS_SUCCESS;
+}
+
+static inline void omutex_lock(omutex_t *m)
+{
+	pthread_mutex_lock(m);
+}
+
+static inline void omutex_unlock(omutex_t *m)
+{
+	pthread_mutex_unlock(m);
+}
+
+static inline void omutex_delete(omutex_t *m)
+{
+	pthread_mutex_destroy(m);
+}
+
+/* Counting semaphore. Unnamed POSIX semaphores aren't available everywhere
+ * (Mac), so this is built with a condition variable */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	unsigned        count;
+} osem_t;
+
+static inline int osem_init(osem_t *s, unsigned count)
+{
+	s->count = count;
+	if (pthread_mutex_init(&s->lock, NULL))
+		return OS_FAIL;
+	if (pthread_cond_init(&s->cond, NULL)) {
+		pthread_mutex_destroy(&s->lock);
+		return OS_FAIL;
+	}
+	return OS_SUCCESS;
+}
+
+static inline void osem_wait(osem_t *s)
+{
+	pthread_mutex_lock(&s->lock);
+	while (! s->count)
+		pthread_cond_wait(&s->cond, &s->lock);
+	s->count--;
+	pthread_mutex_unlock(&s->lock);
+}
+
+static inline void osem_post(osem_t *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->count++;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static inline void osem_delete(osem_t *s)
+{
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+}
+
 
 /* Memory Management */
 static inline size_t os_get_current_free_mem()
@@ -0,0 +1,153 @@
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <httpd.h>
+
+#include "httpd_priv.h"
+
+/* The memory of a request, that is all given back together once the request
+ * is done with. An arena hands out its block piece by piece, and chains on
+ * more blocks as it runs out. The blocks come off a free list that all the
+ * threads share, so that a request that needs more than the one block doesn't
+ * take it from malloc() either, once the web server has warmed up. Anything
+ * larger than a block gets a block of its own, which is freed with the
+ * request.
+ */
+
+struct httpd_arena_blk {
+	/* The block chained on before this one */
+	struct httpd_arena_blk *next;
+	/* The size of data, and how much of it is handed out */
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+#define HTTPD_ARENA_ALIGN  sizeof(max_align_t)
+
+int httpd_arena_pool_init(unsigned block_size)
+{
+	struct httpd_arena_pool *p = &hd.hd_arena_pool;
+
+	if (omutex_init(&p->lock) != OS_SUCCESS)
+		return -OS_FAIL;
+	p->block_size = (block_size + HTTPD_ARENA_ALIGN - 1) & ~(HTTPD_ARENA_ALIGN - 1);
+	p->free = NULL;
+	p->free_cnt = 0;
+	return OS_SUCCESS;
+}
+
+void httpd_arena_pool_deinit()
+{
+	struct httpd_arena_pool *p = &hd.hd_arena_pool;
+
+	while (p->free) {
+		struct httpd_arena_blk *b = p->free;
+		p->free = b->next;
+		free(b);
+	}
+	p->free_cnt = 0;
+	omutex_delete(&p->lock);
+}
+
+static struct httpd_arena_blk *httpd_arena_blk_get(size_t size)
+{
+	struct httpd_arena_pool *p = &hd.hd_arena_pool;
+	struct httpd_arena_blk *b = NULL;
+
+	if (size <= p->block_size) {
+		size = p->block_size;
+		omutex_lock(&p->lock);
+		if (p->free) {
+			b = p->free;
+			p->free = b->next;
+			p->free_cnt--;
+		}
+		omutex_unlock(&p->lock);
+	}
+	if (! b) {
+		b = malloc(sizeof(*b) + size);
+		if (! b)
+			return NULL;
+		b->size = size;
+	}
+	b->used = 0;
+	return b;
+}
+
+static void httpd_arena_blk_put(struct httpd_arena_blk *b)
+{
+	struct httpd_arena_pool *p = &hd.hd_arena_pool;
+
+	if (b->size == p->block_size) {
+		omutex_lock(&p->lock);
+		if (p->free_cnt < HTTPD_ARENA_POOL_MAX) {
+			b->next = p->free;
+			p->free = b;
+			p->free_cnt++;
+			b = NULL;
+		}
+		omutex_unlock(&p->lock);
+	}
+	free(b);
+}
+
+int httpd_arena_init(struct httpd_arena *a)
+{
+	a->first = a->cur = httpd_arena_blk_get(0);
+	return a->first ? OS_SUCCESS : -OS_FAIL;
+}
+
+void *httpd_arena_alloc(struct httpd_arena *a, size_t size)
+{
+	struct httpd_arena_blk *b = a->cur;
+
+	size = (size + HTTPD_ARENA_ALIGN - 1) & ~(HTTPD_ARENA_ALIGN - 1);
+	if (! b || b->size - b->used < size) {
+		b = httpd_arena_blk_get(size);
+		if (! b)
+			return NULL;
+		b->next = a->cur;
+		a->cur = b;
+		if (! a->first)
+			a->first = b;
+	}
+	void *p = (char *)b->data + b->used;
+	b->used += size;
+	return p;
+}
+
+char *httpd_arena_strndup(struct httpd_arena *a, const char *s, size_t len)
+{
+	char *d = httpd_arena_alloc(a, len + 1);
+	if (! d)
+		return NULL;
+	memcpy(d, s, len);
+	d[len] = '\0';
+	return d;
+}
+
+void httpd_arena_reset(struct httpd_arena *a)
+{
+	while (a->cur != a->first) {
+		struct httpd_arena_blk *b = a->cur;
+		a->cur = b->next;
+		httpd_arena_blk_put(b);
+	}
+	if (a->first)
+		a->first->used = 0;
+}
+
+void httpd_arena_deinit(struct httpd_arena *a)
+{
+	httpd_arena_reset(a);
+	if (a->first)
+		httpd_arena_blk_put(a->first);
+	a->first = a->cur = NULL;
+}
+
+void *httpd_req_alloc(httpd_req_t *r, size_t size)
+{
+	struct httpd_req_aux *ra = r->aux;
+	return httpd_arena_alloc(ra->arena, size);
+}
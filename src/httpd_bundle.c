@@ -0,0 +1,279 @@
+/**
+ * Static assets, served out of a bundle made by util/mkbundle.py.
+ *
+ * The bundle has everything precomputed: the response headers of each asset,
+ * for the plain and the gzipped variant, which have ETags of their own, and
+ * for a 304 of each. Serving an asset is a hash table lookup, and a single
+ * vectored send of the header and the data that are both in the bundle.
+ * Whatever the socket doesn't take right away is sent out of the bundle
+ * later, rather than copied.
+ *
+ * The image is little-endian, and the offsets in it are from its start.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <httpd.h>
+
+#include "httpd_priv.h"
+
+#ifdef OS_HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#define HTTPD_BUNDLE_MAGIC    "FLKB"
+#define HTTPD_BUNDLE_VERSION  2
+
+struct httpd_bundle_ref {
+	uint32_t off;
+	uint32_t len;
+};
+
+struct httpd_bundle_hdr {
+	char                    magic[4];
+	uint32_t                version;
+	uint32_t                n_entries;
+	/* Always a power of 2 */
+	uint32_t                n_slots;
+	struct httpd_bundle_ref prefix;
+	uint32_t                entries_off;
+	uint32_t                slots_off;
+};
+
+struct httpd_bundle_entry {
+	uint32_t                hash;
+	struct httpd_bundle_ref path;
+	struct httpd_bundle_ref hdr;
+	struct httpd_bundle_ref body;
+	/* Empty if there is no gzipped variant */
+	struct httpd_bundle_ref gz_hdr;
+	struct httpd_bundle_ref gz_body;
+	/* The header of a 304 */
+	struct httpd_bundle_ref nm_hdr;
+	struct httpd_bundle_ref etag;
+	/* The same for the gzipped variant, or the above if there is none */
+	struct httpd_bundle_ref gz_nm_hdr;
+	struct httpd_bundle_ref gz_etag;
+};
+
+/* FNV-1a, as in mkbundle.py */
+static uint32_t httpd_bundle_hash(const char *s, size_t len)
+{
+	uint32_t h = 0x811c9dc5;
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+static inline const struct httpd_bundle_hdr *httpd_bundle_hdr(const struct httpd_bundle *b)
+{
+	return (const struct httpd_bundle_hdr *)b->image;
+}
+
+static inline const struct httpd_bundle_entry *httpd_bundle_entries(const struct httpd_bundle *b)
+{
+	return (const struct httpd_bundle_entry *)(b->image + httpd_bundle_hdr(b)->entries_off);
+}
+
+static inline const uint32_t *httpd_bundle_slots(const struct httpd_bundle *b)
+{
+	return (const uint32_t *)(b->image + httpd_bundle_hdr(b)->slots_off);
+}
+
+static inline const char *httpd_bundle_str(const struct httpd_bundle *b,
+					   const struct httpd_bundle_ref *ref)
+{
+	return (const char *)b->image + ref->off;
+}
+
+static bool httpd_bundle_ref_ok(const struct httpd_bundle_ref *ref, size_t len)
+{
+	return ref->off <= len && ref->len <= len - ref->off;
+}
+
+/* Everything is checked upfront, so that serving doesn't have to */
+static int httpd_bundle_validate(const unsigned char *image, size_t len)
+{
+	const struct httpd_bundle_hdr *h = (const struct httpd_bundle_hdr *)image;
+	const struct httpd_bundle_entry *e;
+	const uint32_t *slots;
+	uint32_t i;
+
+	if (((uintptr_t)image & 3) || len < sizeof(*h) ||
+	    memcmp(h->magic, HTTPD_BUNDLE_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != HTTPD_BUNDLE_VERSION)
+		return -EINVAL;
+	if (! h->n_slots || (h->n_slots & (h->n_slots - 1)) ||
+	    h->n_entries >= h->n_slots ||
+	    (h->entries_off & 3) || (h->slots_off & 3) ||
+	    h->entries_off > len ||
+	    (len - h->entries_off) / sizeof(*e) < h->n_entries ||
+	    h->slots_off > len ||
+	    (len - h->slots_off) / sizeof(*slots) < h->n_slots ||
+	    ! httpd_bundle_ref_ok(&h->prefix, len - 1) ||
+	    image[h->prefix.off + h->prefix.len] != '\0')
+		return -EINVAL;
+
+	slots = (const uint32_t *)(image + h->slots_off);
+	for (i = 0; i < h->n_slots; i++)
+		if (slots[i] > h->n_entries)
+			return -EINVAL;
+
+	e = (const struct httpd_bundle_entry *)(image + h->entries_off);
+	for (i = 0; i < h->n_entries; i++, e++) {
+		/* The strings are NUL terminated, past their length */
+		if (! httpd_bundle_ref_ok(&e->path, len - 1) ||
+		    ! httpd_bundle_ref_ok(&e->etag, len - 1) ||
+		    ! httpd_bundle_ref_ok(&e->gz_etag, len - 1) ||
+		    image[e->path.off + e->path.len] != '\0' ||
+		    image[e->etag.off + e->etag.len] != '\0' ||
+		    image[e->gz_etag.off + e->gz_etag.len] != '\0' ||
+		    ! httpd_bundle_ref_ok(&e->hdr, len) ||
+		    ! httpd_bundle_ref_ok(&e->body, len) ||
+		    ! httpd_bundle_ref_ok(&e->gz_hdr, len) ||
+		    ! httpd_bundle_ref_ok(&e->gz_body, len) ||
+		    ! httpd_bundle_ref_ok(&e->nm_hdr, len) ||
+		    ! httpd_bundle_ref_ok(&e->gz_nm_hdr, len))
+			return -EINVAL;
+	}
+	return OS_SUCCESS;
+}
+
+static const struct httpd_bundle_entry *httpd_bundle_lookup(const struct httpd_bundle *b,
+							    const char *path, size_t len)
+{
+	const struct httpd_bundle_hdr *h = httpd_bundle_hdr(b);
+	const struct httpd_bundle_entry *entries = httpd_bundle_entries(b);
+	const uint32_t *slots = httpd_bundle_slots(b);
+	uint32_t hash = httpd_bundle_hash(path, len);
+	uint32_t mask = h->n_slots - 1;
+	uint32_t s;
+
+	/* The table is never full, so there is always an empty slot to stop
+	 * at */
+	for (s = hash & mask; slots[s]; s = (s + 1) & mask) {
+		const struct httpd_bundle_entry *e = &entries[slots[s] - 1];
+		if (e->hash == hash && e->path.len == len &&
+		    memcmp(httpd_bundle_str(b, &e->path), path, len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static int httpd_bundle_get(httpd_req_t *r)
+{
+	struct httpd_bundle *b = r->user_ctx;
+	const struct httpd_bundle_entry *e;
+	const struct httpd_bundle_ref *hdr, *body, *nm_hdr, *etag;
+	struct iovec iov[2];
+	const char *val;
+	size_t len = strcspn(r->uri, "?");
+
+	e = httpd_bundle_lookup(b, r->uri, len);
+	if (! e)
+		return httpd_resp_send_404(r);
+
+	if (e->gz_hdr.len &&
+	    httpd_req_get_hdr(r, HTTPD_HDR_ACCEPT_ENCODING, &val, NULL) == OS_SUCCESS &&
+	    strstr(val, "gzip")) {
+		hdr = &e->gz_hdr;
+		body = &e->gz_body;
+		nm_hdr = &e->gz_nm_hdr;
+		etag = &e->gz_etag;
+	} else {
+		hdr = &e->hdr;
+		body = &e->body;
+		nm_hdr = &e->nm_hdr;
+		etag = &e->etag;
+	}
+	/* Only the ETag of the variant that would be sent is a match */
+	if (httpd_req_get_hdr(r, HTTPD_HDR_IF_NONE_MATCH, &val, NULL) == OS_SUCCESS &&
+	    (strstr(val, httpd_bundle_str(b, etag)) || strchr(val, '*'))) {
+		hdr = nm_hdr;
+		body = NULL;
+	}
+
+	iov[0].iov_base = (void *)(b->image + hdr->off);
+	iov[0].iov_len = hdr->len;
+	if (body) {
+		iov[1].iov_base = (void *)(b->image + body->off);
+		iov[1].iov_len = body->len;
+	}
+	/* Both are in the bundle, which stays put */
+	return httpd_sendv_static(r, iov, body ? 2 : 1, 0);
+}
+
+int httpd_bundle_open(struct httpd_bundle *b, const void *image, size_t len)
+{
+	int ret = httpd_bundle_validate(image, len);
+	if (ret != OS_SUCCESS) {
+		httpd_d("Not a valid bundle\n");
+		return ret;
+	}
+
+	memset(b, 0, sizeof(*b));
+	b->image = image;
+	b->len = len;
+	b->uri.uri = httpd_bundle_str(b, &httpd_bundle_hdr(b)->prefix);
+	b->uri.get = httpd_bundle_get;
+	b->uri.user_ctx = b;
+	return OS_SUCCESS;
+}
+
+#ifdef OS_HAVE_MMAP
+int httpd_bundle_map(struct httpd_bundle *b, const char *path)
+{
+	struct stat st;
+	void *image;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -OS_FAIL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -OS_FAIL;
+	}
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return -OS_FAIL;
+
+	ret = httpd_bundle_open(b, image, st.st_size);
+	if (ret != OS_SUCCESS) {
+		munmap(image, st.st_size);
+		return ret;
+	}
+	b->mapped = true;
+	return OS_SUCCESS;
+}
+#else
+int httpd_bundle_map(struct httpd_bundle *b, const char *path)
+{
+	return -OS_FAIL;
+}
+#endif /* ! OS_HAVE_MMAP */
+
+void httpd_bundle_close(struct httpd_bundle *b)
+{
+#ifdef OS_HAVE_MMAP
+	if (b->mapped)
+		munmap((void *)b->image, b->len);
+#endif
+	memset(b, 0, sizeof(*b));
+}
+
+int httpd_bundle_register(struct httpd_bundle *b)
+{
+	return httpd_register_uri_handler(&b->uri);
+}
+
+int httpd_bundle_unregister(struct httpd_bundle *b)
+{
+	return httpd_unregister_uri_handler(&b->uri);
+}
@@ -0,0 +1,173 @@
+/**
+ * The control channel of the reactors.
+ *
+ * Messages (work, shutdown) are sent to a reactor from any thread, and wake
+ * up its poll. On ports with eventfd, the messages go through a bounded
+ * lock-free queue, and the eventfd is a doorbell that is rung only if the
+ * reactor hasn't been woken up already. The reactor then executes every
+ * message in the queue in one go. Everywhere else, each message is a datagram
+ * to a loopback UDP socket.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <httpd.h>
+
+#include "httpd_priv.h"
+
+#ifdef OS_HAVE_EVENTFD
+
+#include <sys/eventfd.h>
+
+/* Must be a power of 2 */
+#ifndef HTTPD_CTRL_Q_LEN
+#define HTTPD_CTRL_Q_LEN    1024
+#endif
+
+/* Each cell's sequence number tells whose turn it is. It is the position
+ * that a producer can fill the cell at, position + 1 once it is filled, and
+ * goes round to position + HTTPD_CTRL_Q_LEN once the reactor is done with
+ * it. */
+struct httpd_ctrl_cell {
+	unsigned               seq;
+	struct httpd_ctrl_data msg;
+};
+
+struct httpd_ctrl_q {
+	/* The next position for the producers to claim */
+	unsigned               enq;
+	/* The next position for the reactor to execute, only the reactor
+	 * touches this */
+	unsigned               deq;
+	/* Set when the doorbell is rung, cleared by the reactor on answering
+	 * it */
+	int                    rung;
+	struct httpd_ctrl_cell cells[HTTPD_CTRL_Q_LEN];
+};
+
+int httpd_ctrl_init(struct httpd_reactor *rt)
+{
+	struct httpd_ctrl_q *q = calloc(1, sizeof(*q));
+	unsigned i;
+
+	if (! q)
+		return -OS_FAIL;
+	for (i = 0; i < HTTPD_CTRL_Q_LEN; i++)
+		q->cells[i].seq = i;
+	rt->rt_ctrl_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rt->rt_ctrl_fd < 0) {
+		free(q);
+		return -OS_FAIL;
+	}
+	rt->rt_ctrl_q = q;
+	return OS_SUCCESS;
+}
+
+void httpd_ctrl_deinit(struct httpd_reactor *rt)
+{
+	if (! rt->rt_ctrl_q)
+		return;
+	close(rt->rt_ctrl_fd);
+	free(rt->rt_ctrl_q);
+	rt->rt_ctrl_q = NULL;
+}
+
+int httpd_ctrl_send(struct httpd_reactor *rt, const struct httpd_ctrl_data *msg)
+{
+	struct httpd_ctrl_q *q = rt->rt_ctrl_q;
+	struct httpd_ctrl_cell *c;
+	unsigned pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+
+	/* Claim a cell */
+	while (1) {
+		c = &q->cells[pos & (HTTPD_CTRL_Q_LEN - 1)];
+		int diff = (int)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->enq, &pos, pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* The reactor hasn't caught up */
+			return -ENOSPC;
+		} else {
+			pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+		}
+	}
+	c->msg = *msg;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* The reactor is already on its way, if someone rang before us */
+	if (! __atomic_exchange_n(&q->rung, 1, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(rt->rt_ctrl_fd, &one, sizeof(one)) != sizeof(one))
+			httpd_d("ctrl doorbell failed\n");
+	}
+	return OS_SUCCESS;
+}
+
+void httpd_ctrl_recv(struct httpd_reactor *rt)
+{
+	struct httpd_ctrl_q *q = rt->rt_ctrl_q;
+	uint64_t cnt;
+
+	if (read(rt->rt_ctrl_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		return;
+	/* From here on, anything that we miss rings the doorbell again */
+	__atomic_exchange_n(&q->rung, 0, __ATOMIC_SEQ_CST);
+
+	while (1) {
+		struct httpd_ctrl_cell *c = &q->cells[q->deq & (HTTPD_CTRL_Q_LEN - 1)];
+		if (__atomic_load_n(&c->seq, __ATOMIC_SEQ_CST) != q->deq + 1)
+			break;
+		struct httpd_ctrl_data msg = c->msg;
+		__atomic_store_n(&c->seq, q->deq + HTTPD_CTRL_Q_LEN, __ATOMIC_RELEASE);
+		q->deq++;
+		httpd_process_ctrl_msg(&msg);
+	}
+}
+
+#else /* ! OS_HAVE_EVENTFD */
+
+#include <ctrl_sock.h>
+
+#define HTTPD_CTRL_SOCK_PORT  54321
+
+int httpd_ctrl_init(struct httpd_reactor *rt)
+{
+	/* Each reactor has a port of its own */
+	rt->rt_ctrl_port = HTTPD_CTRL_SOCK_PORT + rt->rt_id;
+	rt->rt_ctrl_fd = cs_create_ctrl_sock(rt->rt_ctrl_port);
+	if (rt->rt_ctrl_fd < 0)
+		return -OS_FAIL;
+	return OS_SUCCESS;
+}
+
+void httpd_ctrl_deinit(struct httpd_reactor *rt)
+{
+	if (rt->rt_ctrl_fd < 0)
+		return;
+	cs_free_ctrl_sock(rt->rt_ctrl_fd);
+	rt->rt_ctrl_fd = -1;
+}
+
+int httpd_ctrl_send(struct httpd_reactor *rt, const struct httpd_ctrl_data *msg)
+{
+	int ret = cs_send_to_ctrl_sock(rt->rt_ctrl_port, (void *)msg, sizeof(*msg));
+	if (ret < 0)
+		return ret;
+	return OS_SUCCESS;
+}
+
+void httpd_ctrl_recv(struct httpd_reactor *rt)
+{
+	struct httpd_ctrl_data msg;
+	int ret = cs_recv_from_ctrl_sock(rt->rt_ctrl_fd, &msg, sizeof(msg));
+	if (ret != sizeof(msg))
+		return;
+	httpd_process_ctrl_msg(&msg);
+}
+
+#endif /* ! OS_HAVE_EVENTFD */
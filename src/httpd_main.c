@@ -2,7 +2,9 @@
  * This is the web server.
  *
  * Requirements:
- * - Single-threaded web server that can serve one client at a time
+ * - Single-threaded web server that can serve one client at a time. For
+ *   scaling across cores, multiple such event loop threads (reactors) can
+ *   be started, each serving its own set of connections
  * - Should support HTTP pipelining (multiple requests on the same
  *   socket)
  * - Should support multiple open connections at the same time (only
@@ -15,72 +17,135 @@
  *
  */
 
-#include <ctrl_sock.h>
 #include <httpd.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <netinet/tcp.h>
 #include "httpd_priv.h"
 
-#define HTTPD_STACK_SIZE   (12 * 1024)
-#define HTTPD_PORT         80
-#define HTTPD_BACKLOG      5
-#define HTTPD_CTRL_SOCK_PORT  54321
-
 struct httpd_data hd;
+OS_THREAD_LOCAL struct httpd_reactor *httpd_rt;
 
-static void httpd_accept_conn(int listen_fd)
+/* The socket options of a new connection, from the configuration */
+static void httpd_set_conn_opts(int fd)
 {
-	struct sockaddr_in addr_from;
-	socklen_t addr_from_len = sizeof(addr_from);
-	int new_fd = accept(listen_fd, (struct sockaddr *)&addr_from, &addr_from_len);
-	if (new_fd < 0) {
-		httpd_d("Error in accept, what to do?\n");
-		return;
+	const httpd_config_t *c = &hd.hd_config;
+
+	if (c->tcp_nodelay) {
+		int enable = 1;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)))
+			httpd_d("TCP_NODELAY failed\n");
 	}
-	httpd_d("accept_conn: newfd = %d\n", new_fd);
+	if (c->sndbuf > 0 &&
+	    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &c->sndbuf, sizeof(c->sndbuf)))
+		httpd_d("SO_SNDBUF failed\n");
+	if (c->rcvbuf > 0 &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &c->rcvbuf, sizeof(c->rcvbuf)))
+		httpd_d("SO_RCVBUF failed\n");
+#ifdef SO_NOSIGPIPE
+	/* A client that is gone is an error to the send, not a signal */
+	int enable = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable)))
+		httpd_d("SO_NOSIGPIPE failed\n");
+#endif
+}
+
+static inline void httpd_conn_count(unsigned long *cnt)
+{
+	__atomic_store_n(cnt, *cnt + 1, __ATOMIC_RELAXED);
+}
+
+void httpd_conn_shed(int fd)
+{
+	/* Best effort, the socket's send buffer is empty anyway */
+	if (send(fd, hd.hd_busy_resp, hd.hd_busy_resp_len,
+		 MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)hd.hd_busy_resp_len)
+		httpd_conn_count(&httpd_rt->rt_conn.shed);
+	else
+		httpd_conn_count(&httpd_rt->rt_conn.rejected);
+	close(fd);
+}
+
+/* Drain the pending connections, up to the budget. What is left is reported
+ * again by the next wait. */
+static void httpd_accept_conns(int listen_fd)
+{
+	unsigned n;
+	int new_fd, ret;
+
+	for (n = 0; n < hd.hd_config.accept_budget; n++) {
+		new_fd = httpd_poll_accept(listen_fd);
+		if (new_fd == -ECONNABORTED)
+			continue;
+		if (new_fd < 0) {
+			if (new_fd != -EAGAIN)
+				httpd_d("Error in accept: %d\n", new_fd);
+			return;
+		}
+		httpd_d("accept_conn: newfd = %d\n", new_fd);
+		httpd_set_conn_opts(new_fd);
 
-	if (httpd_sess_new(new_fd)) {
-		httpd_d("Warn: No more space for new sessions\n");
-		close(new_fd);
+		ret = httpd_sess_new(new_fd);
+		if (ret == OS_SUCCESS) {
+			httpd_conn_count(&httpd_rt->rt_conn.accepted);
+		} else if (ret == -ENOSPC) {
+			httpd_d("Warn: No more space for new sessions\n");
+			httpd_conn_shed(new_fd);
+		} else {
+			httpd_conn_count(&httpd_rt->rt_conn.rejected);
+			close(new_fd);
+		}
 	}
-	httpd_d("after sess_new\n");
-	return;
 }
 
-struct httpd_ctrl_data {
-	enum httpd_ctrl_msg {
-		HTTPD_CTRL_SHUTDOWN,
-		HTTPD_CTRL_WORK,
-	} hc_msg;
-	httpd_work_fn_t hc_work;
-	void *hc_work_arg;
-};
+int httpd_get_conn_stats(struct httpd_conn_stats *stats)
+{
+	int i;
 
-int httpd_queue_work(httpd_work_fn_t work, void *arg)
+	if (! hd.hd_rt)
+		return -OS_FAIL;
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < hd.hd_rt_cnt; i++) {
+		struct httpd_conn_stats *c = &hd.hd_rt[i].rt_conn;
+		stats->accepted += __atomic_load_n(&c->accepted, __ATOMIC_RELAXED);
+		stats->shed += __atomic_load_n(&c->shed, __ATOMIC_RELAXED);
+		stats->rejected += __atomic_load_n(&c->rejected, __ATOMIC_RELAXED);
+	}
+	return OS_SUCCESS;
+}
+
+int httpd_queue_work_rt(struct httpd_reactor *rt, httpd_work_fn_t work, void *arg)
 {
 	struct httpd_ctrl_data msg;
 	memset(&msg, 0, sizeof(msg));
 	msg.hc_msg = HTTPD_CTRL_WORK;
 	msg.hc_work = work;
 	msg.hc_work_arg = arg;
-	int ret = cs_send_to_ctrl_sock(HTTPD_CTRL_SOCK_PORT, &msg, sizeof(msg));
-	if (ret < 0)
-		return ret;
-	return OS_SUCCESS;
+	return httpd_ctrl_send(rt, &msg);
 }
 
-void httpd_process_ctrl_msg(int ctrl_fd)
+int httpd_queue_work(httpd_work_fn_t work, void *arg)
 {
-	struct httpd_ctrl_data msg;
-	int ret = recv(ctrl_fd, &msg, sizeof(msg), 0);
-	if (ret <= 0)
-		return;
-	if (ret != sizeof(msg))
-		return;
+	/* Work queued from a URI handler stays with that handler's reactor */
+	struct httpd_reactor *rt = httpd_rt;
+	if (! rt && httpd_cur_job)
+		rt = httpd_cur_job->rt;
+	if (! rt) {
+		if (! hd.hd_rt_cnt)
+			return -OS_FAIL;
+		rt = &hd.hd_rt[0];
+	}
+	return httpd_queue_work_rt(rt, work, arg);
+}
 
-	switch (msg.hc_msg) {
+void httpd_process_ctrl_msg(const struct httpd_ctrl_data *msg)
+{
+	switch (msg->hc_msg) {
 	case HTTPD_CTRL_WORK:
-		if (msg.hc_work)
-			(*msg.hc_work)(msg.hc_work_arg);
+		if (msg->hc_work)
+			(*msg->hc_work)(msg->hc_work_arg);
 		break;
 	case HTTPD_CTRL_SHUTDOWN:
 	        {
@@ -88,7 +153,7 @@ void httpd_process_ctrl_msg(int ctrl_fd)
 			while( (fd = httpd_sess_iterate(fd)) != -1) {
 				httpd_d("cleaning up socket %d\n", fd);
 				httpd_sess_delete(fd);
-				close(fd);
+				httpd_poll_close(fd);
 			}
 		}
 		break;
@@ -98,116 +163,336 @@ void httpd_process_ctrl_msg(int ctrl_fd)
 /* Manage in-coming connection or data requests */
 static void httpd_server(int listen_fd, int ctrl_fd)
 {
-	fd_set read_set;
-	FD_ZERO(&read_set);
-	FD_SET(listen_fd, &read_set);
-	FD_SET(ctrl_fd, &read_set);
+	int ready_fds[HTTPD_POLL_MAX_EVENTS];
+	bool accept_pending = false;
+	int i;
 
-	int tmp_max_fd;
-	httpd_sess_set_descriptors(&read_set, &tmp_max_fd);
-	int maxfd = (listen_fd > tmp_max_fd) ? listen_fd : tmp_max_fd;
-	tmp_max_fd = maxfd;
-	maxfd = (ctrl_fd > tmp_max_fd) ? ctrl_fd : tmp_max_fd;
-
-	//       	httpd_d("doing select maxfd+1 = %d\n", maxfd +1);
-	int active_cnt = select(maxfd + 1, &read_set, NULL, NULL, NULL);
+	/* Sleep no longer than till the next timeout */
+	int active_cnt = httpd_poll_wait(ready_fds, HTTPD_POLL_MAX_EVENTS,
+					 httpd_timer_next_ms());
 	if (active_cnt < 0) {
-		httpd_d("Error in select, what to do? %d\n", active_cnt);
+		httpd_d("Error in poll, what to do? %d\n", active_cnt);
 		return;
 	}
 
-	/* Case0: Do we have a control message? */
-	if (FD_ISSET(ctrl_fd, &read_set)) {
-		httpd_process_ctrl_msg(ctrl_fd);
-	}
+	for (i = 0; i < active_cnt; i++) {
+		int fd = ready_fds[i];
 
-	/* Case1: Do we have any activity on the current data
-	 * sessions? */
-	int fd = -1;
-	while( (fd = httpd_sess_iterate(fd)) != -1) {
-		if (FD_ISSET(fd, &read_set)) {
-			httpd_d("processing socket %d\n", fd);
-			if (httpd_sess_process(fd) != OS_SUCCESS) {
-				httpd_d("cleaning up socket %d\n", fd);
-				httpd_sess_delete(fd);
-				close(fd);
-			}
+		/* Case0: Do we have a control message? */
+		if (fd == ctrl_fd) {
+			httpd_ctrl_recv(httpd_rt);
+			continue;
+		}
+
+		/* Case2: Incoming connection requests are processed
+		 * after the data sessions */
+		if (fd == listen_fd) {
+			accept_pending = true;
+			continue;
+		}
+
+		/* Case1: Do we have any activity on the current data
+		 * sessions? The session may have been closed by an earlier
+		 * control message in this same wakeup. */
+		if (! httpd_sess_get(fd))
+			continue;
+		httpd_d("processing socket %d\n", fd);
+		if (httpd_sess_process(fd) != OS_SUCCESS) {
+			httpd_d("cleaning up socket %d\n", fd);
+			httpd_sess_delete(fd);
+			httpd_poll_close(fd);
 		}
 	}
 
-	/* Case2: Do we have any incoming connection requests to
-	 * process? */
-	if (FD_ISSET(listen_fd, &read_set)) {
+	/* The sessions that were just served have their timeouts pushed out
+	 * by now */
+	httpd_timer_expire();
+
+	if (accept_pending) {
 		httpd_d("processing listen socket %d\n", listen_fd);
-		httpd_accept_conn(listen_fd);
+		httpd_accept_conns(listen_fd);
 	}
 }
 
-/* The main HTTPD thread */
-static void httpd_thread(void *arg)
+static int httpd_create_listen_sock(bool reuse_port)
 {
-	hd.hd_td.status = THREAD_RUNNING;
-
+	const httpd_config_t *c = &hd.hd_config;
 	int fd;
 	fd = socket(PF_INET6, SOCK_STREAM, 0);
+	if (fd < 0)
+		return fd;
+
+	/* Sessions that timed out were closed from this end, and linger on in
+	 * TIME_WAIT. They mustn't keep a restarted server off the port. */
+	int reuse = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)))
+		httpd_d("SO_REUSEADDR failed\n");
+
+	if (reuse_port) {
+#ifdef SO_REUSEPORT
+		/* Every reactor listens on the same port */
+		int enable = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)))
+			httpd_d("SO_REUSEPORT failed\n");
+#else
+		httpd_d("SO_REUSEPORT not supported\n");
+#endif
+	}
 
 	struct sockaddr_in6 serv_addr;
 	struct in6_addr inaddr_any = IN6ADDR_ANY_INIT;
 	memset(&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin6_family  = PF_INET6;
 	serv_addr.sin6_addr    = inaddr_any;
-	serv_addr.sin6_port    = htons(HTTPD_PORT);
+	serv_addr.sin6_port    = htons(c->port);
 	int ret = bind(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
 	if (ret)
 	     httpd_d("bind failed: %d\n", ret);
 
-	ret = listen(fd, HTTPD_BACKLOG);
+	if (c->defer_accept_s > 0) {
+#ifdef TCP_DEFER_ACCEPT
+		if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &c->defer_accept_s,
+			       sizeof(c->defer_accept_s)))
+			httpd_d("TCP_DEFER_ACCEPT failed\n");
+#else
+		httpd_d("TCP_DEFER_ACCEPT not supported\n");
+#endif
+	}
+	if (c->fastopen_qlen > 0) {
+#ifdef TCP_FASTOPEN
+		if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &c->fastopen_qlen,
+			       sizeof(c->fastopen_qlen)))
+			httpd_d("TCP_FASTOPEN failed\n");
+#else
+		httpd_d("TCP_FASTOPEN not supported\n");
+#endif
+	}
+
+	ret = listen(fd, c->backlog);
 	if (ret)
 	     httpd_d("listen failed: %d\n", ret);
+	return fd;
+}
+
+/* The main HTTPD thread, one per reactor */
+static void httpd_thread(void *arg)
+{
+	struct httpd_reactor *rt = arg;
+	httpd_rt = rt;
+	rt->rt_td.status = THREAD_RUNNING;
+	httpd_reader_add();
+
+	if (rt->rt_cpu >= 0) {
+#ifdef OS_HAVE_CPU_AFFINITY
+		if (othread_set_cpu(rt->rt_cpu) != OS_SUCCESS)
+			httpd_d("Pinning reactor %d to CPU %d failed\n",
+				rt->rt_id, rt->rt_cpu);
+#else
+		httpd_d("CPU pinning not supported\n");
+#endif
+	}
 
-	int ctrl_fd = cs_create_ctrl_sock(HTTPD_CTRL_SOCK_PORT);
+	int fd = httpd_create_listen_sock(hd.hd_rt_cnt > 1 || hd.hd_config.reuse_port);
+	rt->rt_listen_fd = fd;
 
-	httpd_d("Web server started\n");
+	int ctrl_fd = rt->rt_ctrl_fd;
+
+	if (httpd_poll_init() != OS_SUCCESS)
+		httpd_d("poll init failed\n");
+	httpd_timer_init(&rt->rt_timers);
+	httpd_poll_add_listener(fd);
+	httpd_poll_add(ctrl_fd);
+
+	httpd_d("Web server started (reactor %d)\n", rt->rt_id);
 	while (1) {
 		httpd_server(fd, ctrl_fd);
 
 		/* We were asked to be halted, perform cleanup and
 		 * exit */
-		if (hd.hd_td.halt) {
-			hd.hd_td.status = THREAD_STOPPING;
+		if (rt->rt_td.halt) {
+			rt->rt_td.status = THREAD_STOPPING;
 			break;
 		}
 	}
-	httpd_d("Web server exiting\n");
-	cs_free_ctrl_sock(ctrl_fd);
+	httpd_d("Web server exiting (reactor %d)\n", rt->rt_id);
+	httpd_poll_deinit();
 	close(fd);
-	hd.hd_td.status = THREAD_STOPPED;
+	httpd_reader_del();
+	rt->rt_td.status = THREAD_STOPPED;
 	othread_delete();
 }
 
-int httpd_start()
+static int httpd_reactor_init(struct httpd_reactor *rt, int id, int cpu)
 {
-	int ret;
+	rt->rt_id = id;
+	rt->rt_cpu = cpu;
+	if (httpd_sess_init(&rt->rt_sess, hd.hd_config.max_open_sockets,
+			    hd.hd_config.recv_buf_size) != OS_SUCCESS)
+		return -OS_FAIL;
+	if (httpd_arena_init(&rt->rt_arena) != OS_SUCCESS) {
+		httpd_sess_deinit(&rt->rt_sess);
+		return -OS_FAIL;
+	}
+	/* Work can be queued before the thread gets going */
+	if (httpd_ctrl_init(rt) != OS_SUCCESS) {
+		httpd_arena_deinit(&rt->rt_arena);
+		httpd_sess_deinit(&rt->rt_sess);
+		return -OS_FAIL;
+	}
+	return OS_SUCCESS;
+}
 
-	httpd_sess_init();
-	ret = othread_create(&hd.hd_td.handle, "httpd", HTTPD_STACK_SIZE,
-			     OS_DEFAULT_PRIORITY, httpd_thread, NULL);
-	return ret;
+static void httpd_reactor_deinit(struct httpd_reactor *rt)
+{
+	httpd_ctrl_deinit(rt);
+	httpd_arena_deinit(&rt->rt_arena);
+	httpd_sess_deinit(&rt->rt_sess);
 }
 
-void httpd_stop()
+static void httpd_stop_reactors()
 {
-	hd.hd_td.halt = true;
-	struct httpd_ctrl_data msg;
-	memset(&msg, 0, sizeof(msg));
-	msg.hc_msg = HTTPD_CTRL_SHUTDOWN;
-	cs_send_to_ctrl_sock(HTTPD_CTRL_SOCK_PORT, &msg, sizeof(msg));
+	int i;
+	for (i = 0; i < hd.hd_rt_cnt; i++) {
+		struct httpd_reactor *rt = &hd.hd_rt[i];
+		rt->rt_td.halt = true;
+		struct httpd_ctrl_data msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.hc_msg = HTTPD_CTRL_SHUTDOWN;
+		/* Wait for room, if the reactor is still catching up */
+		while (httpd_ctrl_send(rt, &msg) == -ENOSPC)
+			othread_sleep(10);
+	}
 
 	/* This isn't the most efficient, eg can use semaphore too,
 	 * but should be ok for most cases where the 'stop' is rare.
 	 */
-	while (hd.hd_td.status != THREAD_STOPPED)
-		othread_sleep(1000);
+	for (i = 0; i < hd.hd_rt_cnt; i++) {
+		while (hd.hd_rt[i].rt_td.status != THREAD_STOPPED)
+			othread_sleep(1000);
+		httpd_reactor_deinit(&hd.hd_rt[i]);
+	}
+
+	free(hd.hd_rt);
+	hd.hd_rt = NULL;
+	hd.hd_rt_cnt = 0;
+}
 
+static bool httpd_config_valid(const httpd_config_t *c)
+{
+	return c->reactors && c->max_open_sockets && c->max_uri_handlers &&
+		c->backlog > 0 && c->stack_size &&
+		/* A block is good for a few allocations at least */
+		c->arena_block_size >= 64 &&
+		/* A request line has to fit, and the offsets are 16 bits */
+		c->recv_buf_size > HTTPD_MAX_URI_LEN &&
+		c->recv_buf_size <= UINT16_MAX &&
+		c->workers && c->worker_queue_len && c->worker_stack_size &&
+		c->accept_budget;
+}
+
+int httpd_start(const httpd_config_t *config)
+{
+	const httpd_config_t defaults = HTTPD_DEFAULT_CONFIG();
+	unsigned i, j, count;
+	int ret;
+
+	if (hd.hd_rt)
+		return -OS_FAIL;
+	if (! config)
+		config = &defaults;
+	if (! httpd_config_valid(config))
+		return -EINVAL;
+	hd.hd_config = *config;
+	/* It is copied into the reactors */
+	hd.hd_config.cpus = NULL;
+	hd.hd_busy_resp_len = snprintf(hd.hd_busy_resp, sizeof(hd.hd_busy_resp),
+				       "HTTP/1.1 " HTTPD_503 "\r\n"
+				       "Retry-After: %u\r\n"
+				       "Content-Length: 0\r\n"
+				       "Connection: close\r\n\r\n",
+				       config->retry_after_s);
+	count = config->reactors;
+#if defined(OS_HAVE_SENDFILE) && ! defined(SO_NOSIGPIPE)
+	/* Unlike send(), sendfile() can't be asked not to raise SIGPIPE for a
+	 * client that is gone. Leave it to the application, if it handles the
+	 * signal. */
+	struct sigaction sa;
+	if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+		sa.sa_handler = SIG_IGN;
+		sigaction(SIGPIPE, &sa, NULL);
+	}
+#endif
+
+	ret = httpd_uri_init(config->max_uri_handlers);
+	if (ret != OS_SUCCESS)
+		goto err_config;
+	ret = -OS_FAIL;
+	if (httpd_arena_pool_init(config->arena_block_size) != OS_SUCCESS)
+		goto err_config;
+	if (httpd_pool_init(config->workers, config->worker_queue_len,
+			    config->worker_stack_size) != OS_SUCCESS)
+		goto err_arena;
+	hd.hd_rt = calloc(count, sizeof(*hd.hd_rt));
+	if (! hd.hd_rt) {
+		httpd_pool_deinit();
+		goto err_arena;
+	}
+
+	for (i = 0; i < count; i++) {
+		ret = httpd_reactor_init(&hd.hd_rt[i], i,
+					 config->cpus ? config->cpus[i] : -1);
+		if (ret != OS_SUCCESS) {
+			while (i--)
+				httpd_reactor_deinit(&hd.hd_rt[i]);
+			free(hd.hd_rt);
+			hd.hd_rt = NULL;
+			httpd_pool_deinit();
+			goto err_arena;
+		}
+	}
+	/* The reactors look at this to know if the port is shared */
+	hd.hd_rt_cnt = count;
+
+	for (i = 0; i < count; i++) {
+		struct httpd_reactor *rt = &hd.hd_rt[i];
+		ret = othread_create(&rt->rt_td.handle, "httpd", hd.hd_config.stack_size,
+				     OS_DEFAULT_PRIORITY, httpd_thread, rt);
+		if (ret != OS_SUCCESS)
+			goto err_threads;
+	}
+	return OS_SUCCESS;
+
+ err_threads:
+	/* Stop the reactors that were started, and clean up the rest */
+	for (j = i; j < count; j++)
+		httpd_reactor_deinit(&hd.hd_rt[j]);
+	hd.hd_rt_cnt = i;
+	httpd_stop_reactors();
+	httpd_pool_deinit();
+ err_arena:
+	httpd_arena_pool_deinit();
+ err_config:
+	/* The handlers are registered against the default limit again */
+	memset(&hd.hd_config, 0, sizeof(hd.hd_config));
+	return ret;
+}
+
+int httpd_start_reactors(unsigned count, const int *cpus)
+{
+	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+
+	config.reactors = count;
+	config.cpus = cpus;
+	return httpd_start(&config);
+}
+
+void httpd_stop()
+{
+	/* The reactors send out what the workers have completed */
+	httpd_pool_stop();
+	httpd_stop_reactors();
+	httpd_pool_deinit();
+	httpd_arena_pool_deinit();
+	httpd_uri_deinit();
 	memset(&hd, 0, sizeof(hd));
 }
@@ -0,0 +1,537 @@
+/**
+ * The output queues of the sessions.
+ *
+ * The sockets are non-blocking. Data is written to the socket right away, and
+ * whatever the socket doesn't take is queued up on the session, to be sent as
+ * the client takes it. While a session has a queue, the server waits for its
+ * socket to be writable instead of readable, so the requests pipelined behind
+ * a response aren't looked at till that response is out.
+ *
+ * The responses to pipelined requests, whose next request is in already, are
+ * held back in the queue, so that they go out together with one send once the
+ * pipeline is served, or once batch_size of the configuration is held.
+ *
+ * A queue is a list of segments, each of which is one of:
+ * - data that was copied in, or that was handed over to be freed once sent
+ * - a reference to data that doesn't change, which is sent as it is
+ * - a file, that is sent straight from the kernel where the port allows
+ * - a body provider, that is asked for more only once the client has taken
+ *   what it produced before
+ *
+ * Everything in here runs in the HTTPD thread.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <httpd.h>
+
+#include "httpd_priv.h"
+
+#ifdef OS_HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+/* The most segments that are gathered into one send */
+#define HTTPD_OUT_IOVS      16
+/* Room for the size line of a chunk ahead of its data, and for the CRLF after
+ * it (or for the last chunk) */
+#define HTTPD_OUT_CHUNK_HDR 10
+#define HTTPD_OUT_CHUNK_END 5
+
+struct httpd_out {
+	struct httpd_out *next;
+	/* The data that is yet to go out */
+	const char       *data;
+	size_t            len;
+	enum {
+		/* Copied into buf, that more can be added to */
+		HTTPD_OUT_COPY,
+		/* Referred to */
+		HTTPD_OUT_REF,
+		/* Handed over, and freed once sent */
+		HTTPD_OUT_GIVEN,
+		/* Once data runs out, it is refilled from these. The ones
+		 * that need it read into buf. */
+		HTTPD_OUT_FILE,
+		HTTPD_OUT_PROVIDER,
+	}                 type;
+	union {
+		size_t size;
+		char *given;
+		struct {
+			int    fd;
+			off_t  offset;
+			size_t left;
+		} file;
+		struct {
+			httpd_body_provider_t        fn;
+			httpd_free_provider_ctx_fn_t free_ctx;
+			void                        *ctx;
+			/* What is left of the body, -1 if it is chunked */
+			long                         left;
+			bool                         done;
+		} prov;
+	};
+	char              buf[];
+};
+
+static struct httpd_out *httpd_out_new(int type, size_t buf_size)
+{
+	struct httpd_out *o = malloc(sizeof(*o) + buf_size);
+	if (! o)
+		return NULL;
+	memset(o, 0, sizeof(*o));
+	o->type = type;
+	return o;
+}
+
+static void httpd_out_free_one(struct httpd_out *o)
+{
+	switch (o->type) {
+	case HTTPD_OUT_GIVEN:
+		free(o->given);
+		break;
+	case HTTPD_OUT_FILE:
+		close(o->file.fd);
+		break;
+	case HTTPD_OUT_PROVIDER:
+		if (o->prov.free_ctx)
+			o->prov.free_ctx(o->prov.ctx);
+		break;
+	default:
+		break;
+	}
+	free(o);
+}
+
+/* Whether everything of the segment has gone out */
+static bool httpd_out_done(struct httpd_out *o)
+{
+	if (o->len)
+		return false;
+	if (o->type == HTTPD_OUT_FILE)
+		return ! o->file.left;
+	if (o->type == HTTPD_OUT_PROVIDER)
+		return o->prov.done;
+	return true;
+}
+
+static void httpd_out_append(struct sock_db *sd, struct httpd_out *o)
+{
+	if (sd->out_tail)
+		sd->out_tail->next = o;
+	else
+		sd->out_head = o;
+	sd->out_tail = o;
+}
+
+/* Copy data to the end of the queue, into the last copy if it has room */
+static int httpd_out_copy(struct sock_db *sd, const struct iovec *iov, int iovcnt,
+			  size_t off, size_t len)
+{
+	struct httpd_out *o = sd->out_tail;
+	int i;
+
+	if (! o || o->type != HTTPD_OUT_COPY ||
+	    o->size - (o->data - o->buf) - o->len < len) {
+		size_t size = len;
+		/* Room for the rest of the batch */
+		if (sd->out_batch && size < hd.hd_config.batch_size)
+			size = hd.hd_config.batch_size;
+		o = httpd_out_new(HTTPD_OUT_COPY, size);
+		if (! o)
+			return -ENOMEM;
+		o->size = size;
+		o->data = o->buf;
+		httpd_out_append(sd, o);
+	}
+	for (i = 0; i < iovcnt; i++, off = 0) {
+		memcpy((char *)o->data + o->len, (char *)iov[i].iov_base + off,
+		       iov[i].iov_len - off);
+		o->len += iov[i].iov_len - off;
+	}
+	return OS_SUCCESS;
+}
+
+/* Whether to hold len more bytes back, for the rest of the pipeline */
+static bool httpd_out_hold(struct sock_db *sd, size_t len)
+{
+	return sd->out_batch && ! sd->out_writing &&
+		sd->out_held + len < hd.hd_config.batch_size;
+}
+
+static void httpd_out_pop(struct sock_db *sd)
+{
+	struct httpd_out *o = sd->out_head;
+	sd->out_head = o->next;
+	if (! sd->out_head)
+		sd->out_tail = NULL;
+	httpd_out_free_one(o);
+}
+
+void httpd_out_drain(struct sock_db *sd)
+{
+	if (! sd->out_writing) {
+		sd->out_writing = true;
+		httpd_poll_set_write(httpd_sess_fd(sd), true);
+	}
+}
+
+void httpd_out_free(struct sock_db *sd)
+{
+	while (sd->out_head)
+		httpd_out_pop(sd);
+	sd->out_writing = false;
+}
+
+/* Write without waiting. Returns the number of bytes written, 0 if the socket
+ * can't take any, negative on error. */
+static int httpd_out_write(struct sock_db *sd, struct iovec *iov, int iovcnt)
+{
+	httpd_sendv_func_t sendv_fn = httpd_sess_sendv_fn(sd);
+	httpd_send_func_t send_fn = httpd_sess_send_fn(sd);
+	int fd = httpd_sess_fd(sd);
+	int i, ret, total = 0;
+
+	errno = 0;
+	if (sendv_fn && iovcnt > 1) {
+		ret = sendv_fn(fd, iov, iovcnt, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return 0;
+		return ret < 0 ? -OS_FAIL : ret;
+	}
+
+	/* A piece at a time, till the socket takes less than a whole one */
+	for (i = 0; i < iovcnt; i++) {
+		errno = 0;
+		ret = send_fn(fd, iov[i].iov_base, iov[i].iov_len,
+			      MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			break;
+		if (ret < 0)
+			return total ? total : -OS_FAIL;
+		total += ret;
+		if ((size_t)ret < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+/* Get more data into a file or provider segment whose data ran out. Returns
+ * the amount of progress made, 0 if the socket can't take any for now,
+ * negative on error. */
+static int httpd_out_refill(struct sock_db *sd, struct httpd_out *o)
+{
+	if (o->type == HTTPD_OUT_FILE) {
+		size_t len = o->file.left;
+		ssize_t ret;
+#ifdef OS_HAVE_SENDFILE
+		if (httpd_sess_send_fn(sd) == __httpd_send) {
+			int fd = httpd_sess_fd(sd);
+			/* What was sent ahead of the file goes out first */
+			if (! httpd_poll_tx_idle(fd))
+				return 0;
+			ret = sendfile(fd, o->file.fd, &o->file.offset, len);
+			if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+				return 0;
+			if (ret <= 0)
+				return -OS_FAIL;
+			o->file.left -= ret;
+			return ret;
+		}
+#endif
+		/* Through the send function, a piece at a time */
+		if (len > HTTPD_CHUNK_BUF)
+			len = HTTPD_CHUNK_BUF;
+		do {
+			ret = pread(o->file.fd, o->buf, len, o->file.offset);
+		} while (ret < 0 && errno == EINTR);
+		if (ret <= 0)
+			return -OS_FAIL;
+		o->file.offset += ret;
+		o->file.left -= ret;
+		o->data = o->buf;
+		o->len = ret;
+		return ret;
+	}
+
+	/* A provider, that is asked for as much as a piece holds, and no
+	 * more than what is left of the body */
+	char *piece = o->buf + HTTPD_OUT_CHUNK_HDR;
+	unsigned len = HTTPD_CHUNK_BUF;
+	int ret;
+
+	if (o->prov.left >= 0 && (unsigned long)o->prov.left < len)
+		len = o->prov.left;
+	ret = len ? o->prov.fn(o->prov.ctx, piece, len) : 0;
+	if (ret < 0 || (unsigned)ret > len) {
+		httpd_d("body provider failed: %d\n", ret);
+		return -OS_FAIL;
+	}
+
+	if (o->prov.left >= 0) {
+		/* The body has to be as long as was said in the header */
+		if (! ret && o->prov.left) {
+			httpd_d("body provider ended short by %ld\n", o->prov.left);
+			return -OS_FAIL;
+		}
+		o->prov.left -= ret;
+		o->prov.done = ! o->prov.left;
+		o->data = piece;
+		o->len = ret;
+		return ret ? ret : 1;
+	}
+
+	/* Chunked, with each piece as a chunk, and the size line right ahead
+	 * of it */
+	if (! ret) {
+		memcpy(piece, "0\r\n\r\n", HTTPD_OUT_CHUNK_END);
+		o->data = piece;
+		o->len = HTTPD_OUT_CHUNK_END;
+		o->prov.done = true;
+		return o->len;
+	}
+	char size[HTTPD_OUT_CHUNK_HDR + 1];
+	int n = snprintf(size, sizeof(size), "%x\r\n", ret);
+	memcpy(piece - n, size, n);
+	memcpy(piece + ret, "\r\n", 2);
+	o->data = piece - n;
+	o->len = n + ret + 2;
+	return o->len;
+}
+
+/* Take what was written off the front of the queue */
+static void httpd_out_consume(struct sock_db *sd, size_t sent)
+{
+	struct httpd_out *o;
+
+	while ((o = sd->out_head) != NULL) {
+		size_t len = sent < o->len ? sent : o->len;
+		o->data += len;
+		o->len -= len;
+		sent -= len;
+		if (! httpd_out_done(o))
+			break;
+		httpd_out_pop(sd);
+	}
+}
+
+int httpd_out_flush(struct sock_db *sd)
+{
+	struct iovec iov[HTTPD_OUT_IOVS];
+	struct httpd_out *o;
+	size_t want;
+	int n, ret;
+
+	while ((o = sd->out_head) != NULL) {
+		if (httpd_out_done(o)) {
+			httpd_out_pop(sd);
+			continue;
+		}
+		if (! o->len) {
+			ret = httpd_out_refill(sd, o);
+			if (ret < 0)
+				return -OS_FAIL;
+			if (! ret)
+				break;
+			continue;
+		}
+
+		/* Everything that is in memory, up to the next segment that
+		 * has to be refilled */
+		for (n = 0, want = 0; o && o->len && n < HTTPD_OUT_IOVS; o = o->next, n++) {
+			iov[n].iov_base = (void *)o->data;
+			iov[n].iov_len = o->len;
+			want += o->len;
+		}
+		ret = httpd_out_write(sd, iov, n);
+		if (ret < 0)
+			return -OS_FAIL;
+		httpd_out_consume(sd, ret);
+		/* The socket is full */
+		if ((size_t)ret < want)
+			break;
+	}
+
+	sd->out_held = 0;
+	if (sd->out_head) {
+		/* The socket is full */
+		httpd_out_drain(sd);
+	} else if (sd->out_writing && httpd_poll_tx_idle(httpd_sess_fd(sd))) {
+		/* Done, once the backend has let go of everything too */
+		sd->out_writing = false;
+		httpd_poll_set_write(httpd_sess_fd(sd), false);
+	}
+	return OS_SUCCESS;
+}
+
+int httpd_out_release(struct sock_db *sd)
+{
+	sd->out_batch = false;
+	if (! sd->out_head || sd->out_writing)
+		return OS_SUCCESS;
+	return httpd_out_flush(sd);
+}
+
+int httpd_out_sendv(struct sock_db *sd, const struct iovec *iov, int iovcnt, int ref_from)
+{
+	struct httpd_out *o;
+	size_t off = 0, len, total = 0;
+	bool full = false;
+	int i = 0, j, ret;
+
+	for (j = 0; j < iovcnt; j++)
+		total += iov[j].iov_len;
+	bool hold = httpd_out_hold(sd, total);
+	if (! hold && sd->out_head && ! sd->out_writing &&
+	    total >= hd.hd_config.batch_size) {
+		/* Too much to be copied in behind what was held back */
+		if (httpd_out_flush(sd) != OS_SUCCESS)
+			return -OS_FAIL;
+	}
+
+	/* Straight to the socket, if nothing is waiting ahead of it */
+	while (! hold && ! sd->out_head && i < iovcnt) {
+		struct iovec v[HTTPD_OUT_IOVS];
+		size_t want = 0;
+		int n = 0;
+
+		for (j = i; j < iovcnt && n < HTTPD_OUT_IOVS; j++) {
+			len = iov[j].iov_len - (j == i ? off : 0);
+			if (! len)
+				continue;
+			v[n].iov_base = (char *)iov[j].iov_base + (j == i ? off : 0);
+			v[n].iov_len = len;
+			want += len;
+			n++;
+		}
+		if (! n)
+			return OS_SUCCESS;
+		ret = httpd_out_write(sd, v, n);
+		if (ret < 0)
+			return -OS_FAIL;
+		for (len = ret; i < iovcnt && len >= iov[i].iov_len - off; i++) {
+			len -= iov[i].iov_len - off;
+			off = 0;
+		}
+		off += len;
+		if ((size_t)ret < want) {
+			full = true;
+			break;
+		}
+	}
+
+	/* The rest is queued up, with what is copied kept together */
+	while (i < iovcnt) {
+		if (i >= ref_from) {
+			if (iov[i].iov_len > off) {
+				o = httpd_out_new(HTTPD_OUT_REF, 0);
+				if (! o)
+					return -ENOMEM;
+				o->data = (char *)iov[i].iov_base + off;
+				o->len = iov[i].iov_len - off;
+				httpd_out_append(sd, o);
+			}
+			i++;
+			off = 0;
+			continue;
+		}
+
+		for (j = i, len = 0; j < iovcnt && j < ref_from; j++)
+			len += iov[j].iov_len - (j == i ? off : 0);
+		if (len && httpd_out_copy(sd, iov + i, j - i, off, len) != OS_SUCCESS)
+			return -ENOMEM;
+		i = j;
+		off = 0;
+	}
+
+	if (hold) {
+		sd->out_held += total;
+		return OS_SUCCESS;
+	}
+	if (! sd->out_head || sd->out_writing)
+		return OS_SUCCESS;
+	if (full) {
+		httpd_out_drain(sd);
+		return OS_SUCCESS;
+	}
+	/* Along with what was held back */
+	return httpd_out_flush(sd);
+}
+
+int httpd_out_give(struct sock_db *sd, char *buf, size_t len)
+{
+	struct httpd_out *o;
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	int ret = 0;
+
+	if (! sd->out_head && len) {
+		ret = httpd_out_write(sd, &iov, 1);
+		if (ret < 0) {
+			free(buf);
+			return -OS_FAIL;
+		}
+	}
+	if ((size_t)ret == len) {
+		free(buf);
+		return OS_SUCCESS;
+	}
+
+	o = httpd_out_new(HTTPD_OUT_GIVEN, 0);
+	if (! o) {
+		free(buf);
+		return -ENOMEM;
+	}
+	o->given = buf;
+	o->data = buf + ret;
+	o->len = len - ret;
+	httpd_out_append(sd, o);
+	if (o == sd->out_head)
+		httpd_out_drain(sd);
+	else if (! sd->out_writing)
+		return httpd_out_flush(sd);
+	return OS_SUCCESS;
+}
+
+int httpd_out_file(struct sock_db *sd, int fd, off_t offset, size_t len)
+{
+	struct httpd_out *o;
+
+	if (! len)
+		return OS_SUCCESS;
+	o = httpd_out_new(HTTPD_OUT_FILE, HTTPD_CHUNK_BUF);
+	if (! o)
+		return -ENOMEM;
+	/* A copy of its own, that the handler's closing doesn't affect */
+	o->file.fd = dup(fd);
+	if (o->file.fd < 0) {
+		free(o);
+		return -OS_FAIL;
+	}
+	o->file.offset = offset;
+	o->file.left = len;
+	httpd_out_append(sd, o);
+	return sd->out_writing ? OS_SUCCESS : httpd_out_flush(sd);
+}
+
+int httpd_out_provider(struct sock_db *sd, long len, httpd_body_provider_t fn,
+		       httpd_free_provider_ctx_fn_t free_ctx, void *ctx)
+{
+	struct httpd_out *o;
+
+	o = httpd_out_new(HTTPD_OUT_PROVIDER, HTTPD_OUT_CHUNK_HDR + HTTPD_CHUNK_BUF +
+			  HTTPD_OUT_CHUNK_END);
+	if (! o) {
+		if (free_ctx)
+			free_ctx(ctx);
+		return -ENOMEM;
+	}
+	o->prov.fn = fn;
+	o->prov.free_ctx = free_ctx;
+	o->prov.ctx = ctx;
+	o->prov.left = len;
+	httpd_out_append(sd, o);
+	return sd->out_writing ? OS_SUCCESS : httpd_out_flush(sd);
+}
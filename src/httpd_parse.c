@@ -1,100 +1,236 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <strings.h>
+#include <errno.h>
 #include <httpd.h>
 
 #include "httpd_priv.h"
 
-#define HDR_CONTENT_LEN   "Content-Length:"
+static const struct {
+	const char *name;
+	unsigned    len;
+} httpd_hdr_names[HTTPD_HDR_MAX] = {
+#define HTTPD_HDR_NAME(id, name) [id] = { name, sizeof(name) - 1 }
+	HTTPD_HDR_NAME(HTTPD_HDR_HOST, "Host"),
+	HTTPD_HDR_NAME(HTTPD_HDR_CONTENT_LENGTH, "Content-Length"),
+	HTTPD_HDR_NAME(HTTPD_HDR_CONTENT_TYPE, "Content-Type"),
+	HTTPD_HDR_NAME(HTTPD_HDR_CONNECTION, "Connection"),
+	HTTPD_HDR_NAME(HTTPD_HDR_ACCEPT, "Accept"),
+	HTTPD_HDR_NAME(HTTPD_HDR_ACCEPT_ENCODING, "Accept-Encoding"),
+	HTTPD_HDR_NAME(HTTPD_HDR_AUTHORIZATION, "Authorization"),
+	HTTPD_HDR_NAME(HTTPD_HDR_COOKIE, "Cookie"),
+	HTTPD_HDR_NAME(HTTPD_HDR_IF_NONE_MATCH, "If-None-Match"),
+	HTTPD_HDR_NAME(HTTPD_HDR_USER_AGENT, "User-Agent"),
+	HTTPD_HDR_NAME(HTTPD_HDR_TRANSFER_ENCODING, "Transfer-Encoding"),
+#undef HTTPD_HDR_NAME
+};
+
+static httpd_hdr_t httpd_hdr_classify(const char *name, unsigned len)
+{
+	int i;
+	for (i = HTTPD_HDR_OTHER + 1; i < HTTPD_HDR_MAX; i++)
+		if (httpd_hdr_names[i].len == len &&
+		    strncasecmp(httpd_hdr_names[i].name, name, len) == 0)
+			return i;
+	return HTTPD_HDR_OTHER;
+}
+
+static inline bool httpd_is_space(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/* Note down where the header is. Only what the web server itself needs is
+ * looked into. */
 static int httpd_parse_hdr_field(httpd_req_t *r,
 				 struct httpd_req_aux *ra,
 				 char *buf, int buf_len)
 {
-	/* buf[buf_len]     is \0
-	 * buf[buf_len - 1] is \n
+	char *rx_buf = ra->sd->rx_buf;
+	char *colon, *val, *end;
+
+	/* buf[buf_len - 1] is \n
 	 * buf[buf_len - 2] is \r
 	 * -and before this is the value.
 	 *
 	 * For convenience, let's replace \r with \0
 	 */
-	buf[buf_len - 2] = '\0';
-	if (strncmp(HDR_CONTENT_LEN, buf, strlen(HDR_CONTENT_LEN)) == 0) {
-		char *p = buf + strlen(HDR_CONTENT_LEN);
+	end = buf + buf_len - 2;
+	*end = '\0';
+	colon = buf + httpd_scan(buf, end - buf, ':', ':');
+	if (colon == end || colon == buf)
+		return OS_SUCCESS;
+	for (val = colon + 1; httpd_is_space(*val); val++)
+		;
+	while (end > val && httpd_is_space(end[-1]))
+		*--end = '\0';
+
+	httpd_hdr_t id = httpd_hdr_classify(buf, colon - buf);
+	if (id == HTTPD_HDR_CONTENT_LENGTH) {
 		char *endptr;
-		r->content_len = strtol(p, &endptr, 10);
+		r->content_len = strtol(val, &endptr, 10);
 		if (*endptr != '\0')
 			return -OS_FAIL;
 		ra->remaining_len = r->content_len;
 	}
+
+	if (ra->hdrs_cnt == HTTPD_MAX_REQ_HDRS)
+		return OS_SUCCESS;
+	ra->hdrs[ra->hdrs_cnt].name = buf - rx_buf;
+	ra->hdrs[ra->hdrs_cnt].name_len = colon - buf;
+	ra->hdrs[ra->hdrs_cnt].val = val - rx_buf;
+	ra->hdrs[ra->hdrs_cnt].val_len = end - val;
+	ra->hdrs[ra->hdrs_cnt].id = id;
+	ra->hdrs_cnt++;
+	/* The first one wins */
+	if (id != HTTPD_HDR_OTHER && ! ra->hdrs_by_id[id])
+		ra->hdrs_by_id[id] = ra->hdrs_cnt;
 	return OS_SUCCESS;
 }
 
-static int httpd_parse_first_line(httpd_req_t *r, char *buf, int buf_len)
+static void httpd_req_hdr(httpd_req_t *r, unsigned i, const char **val,
+			  size_t *val_len)
 {
-	/* Since this is a line from the HTTP header, the last byte is \n. We
-	 * will overwrite that with \0 so that we can use str*() functions
-	 * without spilling over.
-	 */
-	char *current = buf;
-	buf[buf_len - 1] = '\0';
+	struct httpd_req_aux *ra = r->aux;
+	*val = ra->hdr_buf + ra->hdrs[i].val;
+	if (val_len)
+		*val_len = ra->hdrs[i].val_len;
+}
+
+int httpd_req_get_hdr(httpd_req_t *r, httpd_hdr_t hdr, const char **val,
+		      size_t *val_len)
+{
+	struct httpd_req_aux *ra = r->aux;
 
+	if (hdr <= HTTPD_HDR_OTHER || hdr >= HTTPD_HDR_MAX || ! ra->hdrs_by_id[hdr])
+		return -ENOENT;
+	httpd_req_hdr(r, ra->hdrs_by_id[hdr] - 1, val, val_len);
+	return OS_SUCCESS;
+}
+
+int httpd_req_get_hdr_value(httpd_req_t *r, const char *field,
+			    const char **val, size_t *val_len)
+{
+	struct httpd_req_aux *ra = r->aux;
+	size_t len = strlen(field);
+	unsigned i;
+
+	httpd_hdr_t id = httpd_hdr_classify(field, len);
+	if (id != HTTPD_HDR_OTHER)
+		return httpd_req_get_hdr(r, id, val, val_len);
+	for (i = 0; i < ra->hdrs_cnt; i++) {
+		if (ra->hdrs[i].id == HTTPD_HDR_OTHER &&
+		    ra->hdrs[i].name_len == len &&
+		    strncasecmp(ra->hdr_buf + ra->hdrs[i].name, field, len) == 0) {
+			httpd_req_hdr(r, i, val, val_len);
+			return OS_SUCCESS;
+		}
+	}
+	return -ENOENT;
+}
+
+/* The first 4 bytes of s, as a word that can be compared in one go */
+static inline uint32_t httpd_word(const char *s)
+{
+	uint32_t w;
+	memcpy(&w, s, sizeof(w));
+	return w;
+}
+
+static int httpd_parse_first_line(httpd_req_t *r, char *buf, int buf_len)
+{
+	/* Since this is a line from the HTTP header, it ends with \r\n */
+	size_t len = buf_len - 2, i, uri_len;
+	uint32_t method = len >= 5 ? httpd_word(buf) : 0;
 
 	/* Extract method */
-	char *token = strsep(&current, " ");
-	if (strcmp(token, "GET") == 0) {
+	if (method == httpd_word("GET ")) {
 		r->type = HTTPD_RQTYPE_GET;
-	} else if (strcmp(token, "POST") == 0) {
-		r->type = HTTPD_RQTYPE_POST;
-	} else if (strcmp(token, "PUT") == 0) {
+		i = 4;
+	} else if (method == httpd_word("PUT ")) {
 		r->type = HTTPD_RQTYPE_PUT;
+		i = 4;
+	} else if (method == httpd_word("POST") && buf[4] == ' ') {
+		r->type = HTTPD_RQTYPE_POST;
+		i = 5;
 	} else {
 		httpd_d("HTTP Operation not supported\n");
 		r->type = -1;
 		/* Continue instead of returning error. It will return 404 if
 		 * URI match doesn't work */
+		i = httpd_scan(buf, len, ' ', ' ') + 1;
 	}
 
-
 	/* Extract URI */
-	if (!current || *current == '\0')
+	if (i >= len)
 		return -OS_FAIL;
-	token = strsep(&current, " ");
-	strncpy((char *)r->uri, token, sizeof(r->uri));
-
+	uri_len = httpd_scan(buf + i, len - i, ' ', ' ');
+	if (uri_len == 0 || i + uri_len == len)
+		return -OS_FAIL;
+	r->uri = httpd_arena_strndup(((struct httpd_req_aux *)r->aux)->arena,
+				     buf + i, uri_len);
+	if (! r->uri)
+		return -OS_FAIL;
+	i += uri_len + 1;
 
 	/* Extract version */
-	if (*current == '\0')
-		return -OS_FAIL;
-	token = strsep(&current, "\r");
-	if (strcmp(token, "HTTP/1.1") != 0) {
+	if (len - i != strlen("HTTP/1.1") || memcmp(buf + i, "HTTP/1.1", len - i) != 0) {
 		httpd_d("Unsupported HTTP version\n");
 		return -OS_FAIL;
 	}
 	return OS_SUCCESS;
 }
 
-static int httpd_read_one_line(httpd_req_t *r, struct httpd_req_aux *ra)
+/* Read whatever is available on the socket into the receive buffer, without
+ * waiting for more. As many bytes as are available (and fit) are read in one
+ * go. Returns -EAGAIN if there was nothing to read.
+ */
+static int httpd_fill_rx_buf(struct sock_db *sd)
 {
+	if (sd->rx_tail == httpd_sess_rx_size(sd)) {
+		httpd_d("Header too long\n");
+		return -OS_FAIL;
+	}
+	httpd_recv_func_t recv_fn = httpd_sess_recv_fn(sd);
+	errno = 0;
+	int ret = recv_fn(httpd_sess_fd(sd), sd->rx_buf + sd->rx_tail,
+			  httpd_sess_rx_size(sd) - sd->rx_tail, MSG_DONTWAIT);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return -EAGAIN;
+	if (ret == 0)
+		ret = -ECONNRESET;
+	if (ret < 0)
+		return ret;
+	sd->rx_tail += ret;
+	return OS_SUCCESS;
+}
+
+/* Returns a pointer to the next header line in the receive buffer, and
+ * consumes it. The line is parsed in place. On success the number of bytes in
+ * the line (including the \r\n) is returned.
+ *
+ * The whole header is in the buffer by now (see httpd_req_recv_hdr()), so
+ * this never has to wait for a line.
+ */
+static int httpd_read_one_line(struct httpd_req_aux *ra, char **line)
+{
+	struct sock_db *sd = ra->sd;
+	unsigned i = sd->rx_head;
 	int ret;
-	unsigned i = 0;
-	bool cr_received = false;
 
-	while (i < (sizeof(ra->scratch) - 2)) {
-		ret = httpd_recv(r, ra->scratch + i, 1);
-		if (ret < 0)
+	while (i + 1 < sd->rx_tail) {
+		i += httpd_scan(sd->rx_buf + i, sd->rx_tail - i, '\r', '\r');
+		if (i + 1 >= sd->rx_tail)
+			break;
+		if (sd->rx_buf[i + 1] == '\n') {
+			*line = sd->rx_buf + sd->rx_head;
+			ret = i + 2 - sd->rx_head;
+			sd->rx_head = i + 2;
 			return ret;
-
-		if (ra->scratch[i] == '\n' && cr_received) {
-			/* Return the number of bytes read so far */
-			return i + 1;
 		}
-
-		if (ra->scratch[i] == '\r')
-			cr_received = true;
-		else
-			cr_received = false;
-
 		i++;
 	}
-	httpd_d("Header too long\n");
+	httpd_d("Incomplete header\n");
 	return -OS_FAIL;
 }
 
@@ -102,20 +238,19 @@ int httpd_parse_hdrs(httpd_req_t *r, struct httpd_req_aux *ra)
 {
 	int rd_bytes, ret;
 	bool first_line = false;
+	char *line;
 
 	while (1) {
-		rd_bytes = httpd_read_one_line(r, ra);
+		rd_bytes = httpd_read_one_line(ra, &line);
 		if (rd_bytes < 0)
 			return rd_bytes;
-//		httpd_d("Line read:%.*s:\n", rd_bytes, ra->scratch);
+//		httpd_d("Line read:%.*s:\n", rd_bytes, line);
 
-		if (rd_bytes == 2 &&
-		    ra->scratch[0] == '\r' &&
-		    ra->scratch[1] == '\n')
+		if (rd_bytes == 2)
 			break;
 
 		if (! first_line) {
-			ret = httpd_parse_first_line(r, ra->scratch, rd_bytes);
+			ret = httpd_parse_first_line(r, line, rd_bytes);
 			if (ret < 0)
 				return ret;
 			first_line = true;
@@ -125,7 +260,7 @@ int httpd_parse_hdrs(httpd_req_t *r, struct httpd_req_aux *ra)
 			 * a delayed parsing, in case the URI handler is
 			 * interested in any of the header files.
 			 */
-			ret = httpd_parse_hdr_field(r, ra, ra->scratch, rd_bytes);
+			ret = httpd_parse_hdr_field(r, ra, line, rd_bytes);
 			if (ret < 0)
 				return ret;
 		}
@@ -133,71 +268,216 @@ int httpd_parse_hdrs(httpd_req_t *r, struct httpd_req_aux *ra)
 	return OS_SUCCESS;
 }
 
-/* Get a URL query tag from a URL of the type /resource?param1=val1&param2=val2
+/* Check if a complete request header is already sitting in the receive buffer
+ * of this socket. Such pipelined requests must be served before going back to
+ * select(), since that data won't make the socket readable again.
+ *
+ * Where the scan got to is remembered in the session, so that the bytes of a
+ * header that trickles in are looked at only once.
  */
-int httpd_req_get_url_param(httpd_req_t *r, char *key, char *val, int val_size)
+bool httpd_req_pending(struct sock_db *sd)
 {
-	/* Copy the URI into another buffer because strsep() modifies the
-	 * string passed to it
-	 */
-	char url[HTTPD_MAX_URI_LEN];
-	strncpy(url, r->uri, HTTPD_MAX_URI_LEN);
-	char *url_ptr = url;
-	/* Check for the presence of '?' in the URI which indicates that
-	 * there is a query string. url_ptr will point to the first character
-	 * after '?' or to the terminating '\0' depending on the presence/absence
-	 * of a query string.
-	 */
-	char *p = strsep(&url_ptr, "?");
+	unsigned i = sd->rx_scan > sd->rx_head ? sd->rx_scan : sd->rx_head;
+	while (i + 3 < sd->rx_tail) {
+		i += httpd_scan(sd->rx_buf + i, sd->rx_tail - i, '\r', '\r');
+		if (i + 3 >= sd->rx_tail)
+			break;
+		if (memcmp(sd->rx_buf + i, "\r\n\r\n", 4) == 0) {
+			/* Found right away, if asked again */
+			sd->rx_scan = i;
+			return true;
+		}
+		i++;
+	}
+	/* The terminator could start in the last 3 bytes */
+	if (i > sd->rx_tail - 3 && sd->rx_tail >= 3)
+		i = sd->rx_tail - 3;
+	sd->rx_scan = i;
+	return false;
+}
 
-	while (url_ptr && strlen(url_ptr)) {
-		/* Get the name=val string. Multiple name=value pairs
-		 * are separated by '&'
-		 */
-		p = strsep(&url_ptr, "&");
+/* Get the complete header of the session's next request into its receive
+ * buffer, reading only what is already there on the socket. Returns -EAGAIN
+ * if the rest of the header is yet to arrive, which is then picked up from
+ * where it was left, the next time that the socket is readable.
+ */
+int httpd_req_recv_hdr(struct sock_db *sd)
+{
+	int ret;
 
-		/* Search for the '=' character. Else, it would mean
-		 * that the parameter is invalid
-		 */
-		char *val_ptr = strchr(p, '=');
-		if (!val_ptr)
-			break;
+	httpd_rx_compact(sd);
+	while (! httpd_req_pending(sd)) {
+		ret = httpd_fill_rx_buf(sd);
+		if (ret < 0)
+			return ret;
+	}
+	return OS_SUCCESS;
+}
 
-		/* If the key, does not match, continue searching */
-		if (strncmp(p, key, strlen(key)))
+static int httpd_hex_val(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Percent-decode s, up to any of the stop characters, into d. Decoding only
+ * ever shrinks, so d may be s itself. Returns where in s it stopped. */
+static char *httpd_query_decode(char *d, char *s, const char *stop, char **d_end)
+{
+	while (*s && ! strchr(stop, *s)) {
+		int hi, lo;
+		if (*s == '+') {
+			*d++ = ' ';
+			s++;
+		} else if (*s == '%' && (hi = httpd_hex_val(s[1])) >= 0 &&
+			   (lo = httpd_hex_val(s[2])) >= 0) {
+			*d++ = (hi << 4) | lo;
+			s += 3;
+		} else {
+			*d++ = *s++;
+		}
+	}
+	*d_end = d;
+	return s;
+}
+
+/* Split up the query string of a URI of the type
+ * /resource?param1=val1&param2=val2 into the request's index */
+static void httpd_query_parse(httpd_req_t *r)
+{
+	struct httpd_req_aux *ra = r->aux;
+	const char *q = strchr(r->uri, '?');
+	char *s, *d;
+
+	ra->query_parsed = true;
+	ra->query_cnt = 0;
+	if (! q)
+		return;
+	ra->query = httpd_arena_strndup(ra->arena, q + 1, strlen(q + 1));
+	if (! ra->query) {
+		httpd_d("No memory for the query string\n");
+		return;
+	}
+
+	s = d = ra->query;
+	while (*s && ra->query_cnt < HTTPD_MAX_QUERY_PARAMS) {
+		char *key = d, *val;
+		char sep;
+		if (*s == '&') {
+			s++;
 			continue;
+		}
+		/* d never gets ahead of s, and s is moved past a separator
+		 * before it can be overwritten with a NUL */
+		s = httpd_query_decode(d, s, "=&", &d);
+		sep = *s;
+		if (sep)
+			s++;
+		*d++ = '\0';
+		if (sep == '=') {
+			val = d;
+			s = httpd_query_decode(d, s, "&", &d);
+			if (*s)
+				s++;
+			*d++ = '\0';
+		} else {
+			/* No value, it is the key's NUL */
+			val = d - 1;
+		}
 
-		/* Else, get the NULL terminated value and copy it to the
-		 * caller's buffer.
-		 * However, if the length is 0, return failure.
-		 */
-		val_ptr++;
-		if (!strlen(val_ptr))
-			return -OS_FAIL;
+		ra->query_params[ra->query_cnt].key = key - ra->query;
+		ra->query_params[ra->query_cnt].val = val - ra->query;
+		ra->query_params[ra->query_cnt].val_len = d - val - 1;
+		ra->query_cnt++;
+	}
+}
 
-		strncpy(val, val_ptr, val_size);
-		return OS_SUCCESS;
+int httpd_req_get_query(httpd_req_t *r, const char *key, const char **val,
+			size_t *val_len)
+{
+	struct httpd_req_aux *ra = r->aux;
+	unsigned i;
+
+	if (! ra->query_parsed)
+		httpd_query_parse(r);
+	for (i = 0; i < ra->query_cnt; i++) {
+		if (strcmp(ra->query + ra->query_params[i].key, key) == 0) {
+			*val = ra->query + ra->query_params[i].val;
+			if (val_len)
+				*val_len = ra->query_params[i].val_len;
+			return OS_SUCCESS;
+		}
 	}
-	httpd_d("Key %s not found\n", key);
-	return -OS_FAIL;
+	return -ENOENT;
+}
+
+int httpd_req_query_next(httpd_req_t *r, unsigned *it, const char **key,
+			 const char **val)
+{
+	struct httpd_req_aux *ra = r->aux;
+
+	if (! ra->query_parsed)
+		httpd_query_parse(r);
+	if (*it >= ra->query_cnt)
+		return -ENOENT;
+	*key = ra->query + ra->query_params[*it].key;
+	*val = ra->query + ra->query_params[*it].val;
+	(*it)++;
+	return OS_SUCCESS;
+}
+
+int httpd_req_get_url_param(httpd_req_t *r, char *key, char *val, int val_size)
+{
+	const char *v;
+	size_t len;
+
+	if (httpd_req_get_query(r, key, &v, &len) != OS_SUCCESS) {
+		httpd_d("Key %s not found\n", key);
+		return -OS_FAIL;
+	}
+	/* An empty value is as good as none */
+	if (! len)
+		return -OS_FAIL;
+	strncpy(val, v, val_size);
+	return OS_SUCCESS;
 }
 
 /* This (request management) could probably be a file in itself, let's see */
 int httpd_req_new(httpd_req_t *r, struct sock_db *sd)
 {
-	memset(r, 0, sizeof(hd.hd_req));
-	memset(&hd.hd_req_aux, 0, sizeof(hd.hd_req_aux));
-	r->aux = &hd.hd_req_aux;
+	memset(r, 0, sizeof(*r));
+	memset(&httpd_rt->rt_req_aux, 0, sizeof(httpd_rt->rt_req_aux));
+	r->aux = &httpd_rt->rt_req_aux;
 	/* Associate the request to the socket */
 	struct httpd_req_aux *ra  = r->aux;
 	ra->sd = sd;
+	ra->hdr_buf = sd->rx_buf;
+	/* A request that went to the worker pool took what it needed of the
+	 * arena, without being deleted */
+	httpd_arena_reset(&httpd_rt->rt_arena);
+	ra->arena = &httpd_rt->rt_arena;
+	r->uri = "";
 	/* Set defaults */
 	ra->status = HTTPD_200;
 	ra->content_type = HTTPD_TYPE_JSON;
 	/* Copy session info to the request */
 	r->sess_ctx = sd->ctx;
 	r->free_ctx = sd->free_ctx;
-	return httpd_parse_hdrs(r, r->aux);
+	int ret = httpd_parse_hdrs(r, r->aux);
+	if (ret != OS_SUCCESS)
+		return ret;
+	/* The body has one deadline, however slowly it trickles in */
+	unsigned timeout = hd.hd_config.body_timeout_ms;
+	if (ra->remaining_len && timeout) {
+		ra->body_by = otime_ms() + timeout;
+		httpd_timer_set(sd, timeout);
+	}
+	return OS_SUCCESS;
 }
 
 int httpd_req_delete(httpd_req_t *r)
@@ -218,7 +498,9 @@ int httpd_req_delete(httpd_req_t *r)
 	/* Retrieve session info from the request into the socket database */
 	ra->sd->ctx = r->sess_ctx;
 	ra->sd->free_ctx = r->free_ctx;
-	/* Clear out the request and request_aux structures */
+	/* Clear out the request and request_aux structures, and the memory
+	 * that goes with them */
+	httpd_arena_reset(ra->arena);
 	ra->sd = NULL;
 	r->aux = NULL;
 	return OS_SUCCESS;
@@ -0,0 +1,213 @@
+#include <errno.h>
+
+#include <httpd.h>
+
+#include "httpd_priv.h"
+
+/* Wait for activity on the sockets of the web server. The port decides which
+ * backend is used:
+ * - io_uring: accepts, receives and sends are all performed through the
+ *   ring, see httpd_uring.c. Used when the port defines OS_HAVE_IO_URING.
+ * - epoll: a persistent interest set is kept in the kernel, only the ready
+ *   sockets are reported back. Used when the port defines OS_HAVE_EPOLL.
+ * - select: the default, available with all network stacks.
+ */
+
+#if defined(OS_HAVE_IO_URING)
+
+/* Implemented in httpd_uring.c */
+
+#elif defined(OS_HAVE_EPOLL)
+
+#include <sys/epoll.h>
+
+int httpd_poll_init()
+{
+	httpd_rt->rt_poll.fd = epoll_create1(EPOLL_CLOEXEC);
+	if (httpd_rt->rt_poll.fd < 0)
+		return -OS_FAIL;
+	return OS_SUCCESS;
+}
+
+void httpd_poll_deinit()
+{
+	close(httpd_rt->rt_poll.fd);
+	httpd_rt->rt_poll.fd = -1;
+}
+
+int httpd_poll_add(int fd)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(httpd_rt->rt_poll.fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		httpd_d("epoll add failed for %d: %d\n", fd, errno);
+		return -OS_FAIL;
+	}
+	return OS_SUCCESS;
+}
+
+void httpd_poll_del(int fd)
+{
+	epoll_ctl(httpd_rt->rt_poll.fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void httpd_poll_set_write(int fd, bool on)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = on ? EPOLLOUT : EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(httpd_rt->rt_poll.fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		httpd_d("epoll mod failed for %d: %d\n", fd, errno);
+}
+
+int httpd_poll_wait(int *fds, int max_fds, int timeout_ms)
+{
+	struct epoll_event evs[HTTPD_POLL_MAX_EVENTS];
+	int i, n;
+
+	if (max_fds > HTTPD_POLL_MAX_EVENTS)
+		max_fds = HTTPD_POLL_MAX_EVENTS;
+	n = epoll_wait(httpd_rt->rt_poll.fd, evs, max_fds, timeout_ms);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -OS_FAIL;
+	/* Errors and hang-ups are reported as readable too, the subsequent
+	 * recv() will tell what happened */
+	for (i = 0; i < n; i++)
+		fds[i] = evs[i].data.fd;
+	return n;
+}
+
+#else /* ! OS_HAVE_EPOLL */
+
+#include <sys/select.h>
+
+int httpd_poll_init()
+{
+	FD_ZERO(&httpd_rt->rt_poll.set);
+	FD_ZERO(&httpd_rt->rt_poll.wset);
+	httpd_rt->rt_poll.maxfd = -1;
+	return OS_SUCCESS;
+}
+
+void httpd_poll_deinit()
+{
+	FD_ZERO(&httpd_rt->rt_poll.set);
+	FD_ZERO(&httpd_rt->rt_poll.wset);
+	httpd_rt->rt_poll.maxfd = -1;
+}
+
+int httpd_poll_add(int fd)
+{
+	if (fd >= FD_SETSIZE) {
+		httpd_d("fd %d beyond FD_SETSIZE\n", fd);
+		return -OS_FAIL;
+	}
+	FD_SET(fd, &httpd_rt->rt_poll.set);
+	if (fd > httpd_rt->rt_poll.maxfd)
+		httpd_rt->rt_poll.maxfd = fd;
+	return OS_SUCCESS;
+}
+
+void httpd_poll_del(int fd)
+{
+	if (fd < 0 || fd >= FD_SETSIZE)
+		return;
+	FD_CLR(fd, &httpd_rt->rt_poll.set);
+	FD_CLR(fd, &httpd_rt->rt_poll.wset);
+	while (httpd_rt->rt_poll.maxfd >= 0 &&
+	       !FD_ISSET(httpd_rt->rt_poll.maxfd, &httpd_rt->rt_poll.set) &&
+	       !FD_ISSET(httpd_rt->rt_poll.maxfd, &httpd_rt->rt_poll.wset))
+		httpd_rt->rt_poll.maxfd--;
+}
+
+void httpd_poll_set_write(int fd, bool on)
+{
+	if (fd < 0 || fd >= FD_SETSIZE)
+		return;
+	if (on) {
+		FD_CLR(fd, &httpd_rt->rt_poll.set);
+		FD_SET(fd, &httpd_rt->rt_poll.wset);
+	} else {
+		FD_CLR(fd, &httpd_rt->rt_poll.wset);
+		FD_SET(fd, &httpd_rt->rt_poll.set);
+	}
+}
+
+int httpd_poll_wait(int *fds, int max_fds, int timeout_ms)
+{
+	fd_set read_set = httpd_rt->rt_poll.set;
+	fd_set write_set = httpd_rt->rt_poll.wset;
+	struct timeval tv;
+	int fd, n = 0;
+
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	int active_cnt = select(httpd_rt->rt_poll.maxfd + 1, &read_set, &write_set, NULL,
+				(timeout_ms >= 0) ? &tv : NULL);
+	if (active_cnt < 0)
+		return (errno == EINTR) ? 0 : -OS_FAIL;
+
+	for (fd = 0; fd <= httpd_rt->rt_poll.maxfd && n < max_fds && active_cnt; fd++) {
+		if (FD_ISSET(fd, &read_set) || FD_ISSET(fd, &write_set)) {
+			fds[n++] = fd;
+			active_cnt--;
+		}
+	}
+	return n;
+}
+
+#endif /* OS_HAVE_IO_URING, OS_HAVE_EPOLL */
+
+#ifndef OS_HAVE_IO_URING
+
+#include <fcntl.h>
+
+/* Everything goes straight to the socket */
+bool httpd_poll_tx_idle(int fd)
+{
+	return true;
+}
+
+void httpd_poll_close(int fd)
+{
+	close(fd);
+}
+
+/* The readiness based backends accept connections as they are reported, till
+ * there are no more pending */
+int httpd_poll_add_listener(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -OS_FAIL;
+	return httpd_poll_add(fd);
+}
+
+int httpd_poll_accept(int listen_fd)
+{
+	struct sockaddr_in6 addr_from;
+	socklen_t addr_from_len = sizeof(addr_from);
+	int fd;
+
+	/* The sessions never wait on their sockets, see httpd_out.c */
+#ifdef OS_HAVE_ACCEPT4
+	fd = oaccept4(listen_fd, (struct sockaddr *)&addr_from, &addr_from_len,
+		      SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	fd = accept(listen_fd, (struct sockaddr *)&addr_from, &addr_from_len);
+	if (fd >= 0) {
+		int flags = fcntl(fd, F_GETFL, 0);
+		if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+			close(fd);
+			return -OS_FAIL;
+		}
+	}
+#endif
+	if (fd < 0)
+		return (errno == EWOULDBLOCK) ? -EAGAIN : -errno;
+	return fd;
+}
+#endif /* ! OS_HAVE_IO_URING */
@@ -0,0 +1,563 @@
+/**
+ * The worker pool.
+ *
+ * URI handlers that may block for long (file system, databases, talking to
+ * other servers) would stall every other connection of their reactor. Such
+ * handlers are marked for offload, and are executed by a small pool of worker
+ * threads instead.
+ *
+ * The reactor takes a copy of the request, gathers its body as it arrives
+ * (without waiting on the socket, the other sessions are served meanwhile),
+ * hands the request over to the pool, and stops polling that session. A queue
+ * slot is set aside for the request upfront, so that a request whose body is
+ * in is never turned away. The handler's response is
+ * collected in memory, and once the handler returns, the reactor sends it out
+ * and resumes the session. So the responses on a connection still go out in
+ * the order of its requests.
+ *
+ * Requests that are detached by their handlers with
+ * httpd_req_async_handler_begin() are served the same way, except that it is
+ * the application that completes them.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include <httpd.h>
+
+#include "httpd_priv.h"
+
+#define HTTPD_JOB_RESP_MIN       256
+
+struct httpd_pool {
+	struct thread_data       *workers;
+	unsigned                  n_workers;
+	/* Protects everything below */
+	omutex_t                  lock;
+	/* Counts the jobs in the queue, and the wakeups on stop */
+	osem_t                    jobs;
+	struct httpd_job        **queue;
+	unsigned                  queue_len;
+	unsigned                  head;
+	unsigned                  count;
+	/* Slots set aside for the jobs that are gathering their bodies */
+	unsigned                  reserved;
+	bool                      halt;
+	struct httpd_worker_stats stats;
+};
+
+OS_THREAD_LOCAL struct httpd_job *httpd_cur_job;
+/* Set if the worker's current job was detached by its handler */
+static OS_THREAD_LOCAL bool httpd_cur_job_async;
+
+static void httpd_job_free_ctx(struct httpd_job *job)
+{
+	if (job->req.sess_ctx) {
+		if (job->req.free_ctx)
+			job->req.free_ctx(job->req.sess_ctx);
+		else
+			free(job->req.sess_ctx);
+	}
+}
+
+static void httpd_job_free(struct httpd_job *job)
+{
+	free(job->body);
+	free(job->resp);
+	httpd_arena_deinit(&job->arena);
+	free(job);
+}
+
+int httpd_job_send(struct httpd_job *job, const char *buf, unsigned buf_len)
+{
+	if (job->resp_len + buf_len > job->resp_size) {
+		size_t size = job->resp_size ? job->resp_size : HTTPD_JOB_RESP_MIN;
+		while (size < job->resp_len + buf_len)
+			size *= 2;
+		char *resp = realloc(job->resp, size);
+		if (! resp)
+			return -ENOMEM;
+		job->resp = resp;
+		job->resp_size = size;
+	}
+	memcpy(job->resp + job->resp_len, buf, buf_len);
+	job->resp_len += buf_len;
+	return buf_len;
+}
+
+int httpd_job_recv(struct httpd_job *job, char *buf, unsigned buf_len)
+{
+	/* httpd_req_recv() keeps track of how much of the body is left */
+	size_t offset = job->body_size - job->aux.remaining_len;
+	if (buf_len > job->aux.remaining_len)
+		buf_len = job->aux.remaining_len;
+	memcpy(buf, job->body + offset, buf_len);
+	return buf_len;
+}
+
+/* Executed by the reactor, once the worker is done with the job */
+static void httpd_job_complete(void *arg)
+{
+	struct httpd_job *job = arg;
+	struct sock_db *sd = job->sd;
+	int fd = job->fd;
+
+	if (! sd) {
+		/* The session was closed in the meantime */
+		httpd_d("offloaded request on closed socket %d\n", fd);
+		httpd_job_free_ctx(job);
+		httpd_job_free(job);
+		return;
+	}
+
+	/* Give the session back whatever the handler did to it */
+	sd->job = NULL;
+	sd->ctx = job->req.sess_ctx;
+	sd->free_ctx = job->req.free_ctx;
+	if (job->send_fn) {
+		httpd_rt->rt_sess.send_fn[sd->slot] = job->send_fn;
+		httpd_rt->rt_sess.sendv_fn[sd->slot] = NULL;
+	}
+	if (job->sendv_fn)
+		httpd_rt->rt_sess.sendv_fn[sd->slot] = job->sendv_fn;
+	if (job->recv_fn)
+		httpd_rt->rt_sess.recv_fn[sd->slot] = job->recv_fn;
+
+	int ret = OS_SUCCESS;
+	if (sd->parked) {
+		ret = httpd_poll_add(fd);
+		sd->parked = false;
+	}
+	/* The response is queued behind whatever is still going out */
+	if (ret == OS_SUCCESS && job->resp_len)
+		ret = httpd_out_give(sd, job->resp, job->resp_len);
+	else
+		free(job->resp);
+	job->resp = NULL;
+	if (job->ret != OS_SUCCESS)
+		ret = -OS_FAIL;
+	httpd_job_free(job);
+
+	/* Serve the requests that were pipelined behind this one */
+	if (ret == OS_SUCCESS && httpd_req_pending(sd))
+		ret = httpd_sess_process(fd);
+	else if (ret == OS_SUCCESS)
+		httpd_sess_touch(sd);
+	if (ret != OS_SUCCESS) {
+		httpd_d("cleaning up socket %d\n", fd);
+		httpd_sess_delete(fd);
+		httpd_poll_close(fd);
+	}
+}
+
+static void httpd_worker(void *arg)
+{
+	struct thread_data *td = arg;
+	struct httpd_pool *p = hd.hd_pool;
+	td->status = THREAD_RUNNING;
+	httpd_reader_add();
+
+	while (1) {
+		osem_wait(&p->jobs);
+		omutex_lock(&p->lock);
+		if (p->halt) {
+			omutex_unlock(&p->lock);
+			break;
+		}
+		struct httpd_job *job = p->queue[p->head];
+		p->head = (p->head + 1) % p->queue_len;
+		p->count--;
+		omutex_unlock(&p->lock);
+
+		httpd_cur_job = job;
+		httpd_cur_job_async = false;
+		int ret = httpd_uri_offloaded(&job->req);
+		httpd_cur_job = NULL;
+
+		omutex_lock(&p->lock);
+		p->stats.executed++;
+		omutex_unlock(&p->lock);
+
+		/* A detached job belongs to the application now */
+		if (httpd_cur_job_async)
+			continue;
+		job->ret = ret;
+		/* The session stays parked till the job gets back, so wait for
+		 * room if the reactor's control channel is full */
+		while ((ret = httpd_queue_work_rt(job->rt, httpd_job_complete,
+						  job)) == -ENOSPC)
+			othread_sleep(10);
+		if (ret != OS_SUCCESS)
+			httpd_d("Couldn't hand the job back to reactor %d\n",
+				job->rt->rt_id);
+	}
+	httpd_reader_del();
+	td->status = THREAD_STOPPED;
+	othread_delete();
+}
+
+/* The request's header stays in the session's receive buffer, which is
+ * another request's once this one is away, or another connection's once the
+ * session is closed. So the job takes a copy, and the header index is rebased
+ * onto that. */
+static int httpd_job_copy_hdrs(struct httpd_job *job)
+{
+	struct httpd_req_aux *ra = &job->aux;
+	unsigned i, lo = UINT16_MAX, hi = 0;
+
+	for (i = 0; i < ra->hdrs_cnt; i++) {
+		if (ra->hdrs[i].name < lo)
+			lo = ra->hdrs[i].name;
+		/* Along with the NUL after the value */
+		if (ra->hdrs[i].val + ra->hdrs[i].val_len + 1u > hi)
+			hi = ra->hdrs[i].val + ra->hdrs[i].val_len + 1u;
+	}
+	if (! ra->hdrs_cnt) {
+		ra->hdr_buf = NULL;
+		return OS_SUCCESS;
+	}
+	char *buf = httpd_arena_alloc(&job->arena, hi - lo);
+	if (! buf)
+		return -ENOMEM;
+	memcpy(buf, ra->hdr_buf + lo, hi - lo);
+	for (i = 0; i < ra->hdrs_cnt; i++) {
+		ra->hdrs[i].name -= lo;
+		ra->hdrs[i].val -= lo;
+	}
+	ra->hdr_buf = buf;
+	return OS_SUCCESS;
+}
+
+/* Copy the reactor's current request into a new job, with room for its body.
+ * The job never refers to the session's request state after this. */
+static int httpd_job_new(httpd_req_t *r, struct httpd_job **out)
+{
+	struct httpd_req_aux *ra = r->aux;
+	struct sock_db *sd = ra->sd;
+
+	/* The arena gets its blocks as they are needed */
+	struct httpd_job *job = calloc(1, sizeof(*job));
+	if (! job)
+		return -ENOMEM;
+	/* What is in the reactor's arena goes with the current request */
+	const char *uri = httpd_arena_strndup(&job->arena, r->uri, strlen(r->uri));
+	job->aux = *ra;
+	if (! uri || httpd_job_copy_hdrs(job) != OS_SUCCESS) {
+		httpd_job_free(job);
+		return -ENOMEM;
+	}
+	if (ra->remaining_len) {
+		job->body = malloc(ra->remaining_len);
+		if (! job->body) {
+			httpd_job_free(job);
+			return -ENOMEM;
+		}
+	}
+	job->body_size = ra->remaining_len;
+
+	job->rt = httpd_rt;
+	job->sd = sd;
+	job->fd = httpd_sess_fd(sd);
+	job->ret = OS_SUCCESS;
+	memcpy(&job->req, r, sizeof(job->req));
+	job->req.uri = uri;
+	job->req.aux = &job->aux;
+	job->aux.sd = NULL;
+	job->aux.arena = &job->arena;
+	job->aux.query_parsed = false;
+	job->aux.remaining_len = job->body_size;
+	job->aux.job = job;
+	*out = job;
+	return OS_SUCCESS;
+}
+
+/* Read the body of the request that the handler is called with, waiting for
+ * it as the handler would */
+static int httpd_job_read_body(struct httpd_job *job, httpd_req_t *r)
+{
+	while (job->body_len < job->body_size) {
+		int ret = httpd_req_recv(r, job->body + job->body_len,
+					 job->body_size - job->body_len);
+		if (ret <= 0)
+			return -OS_FAIL;
+		job->body_len += ret;
+	}
+	return OS_SUCCESS;
+}
+
+/* Read what has arrived of the job's body, without waiting for more. Returns
+ * -EAGAIN if there is more to come. */
+static int httpd_job_gather(struct httpd_job *job, struct sock_db *sd)
+{
+	while (job->body_len < job->body_size) {
+		size_t want = job->body_size - job->body_len;
+		unsigned buffered = sd->rx_tail - sd->rx_head;
+		int ret;
+
+		if (buffered) {
+			ret = want < buffered ? want : buffered;
+			memcpy(job->body + job->body_len, sd->rx_buf + sd->rx_head, ret);
+			sd->rx_head += ret;
+		} else {
+			errno = 0;
+			ret = httpd_sess_recv_fn(sd)(httpd_sess_fd(sd),
+						     job->body + job->body_len,
+						     want, MSG_DONTWAIT);
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return -EAGAIN;
+			if (ret <= 0)
+				return -OS_FAIL;
+		}
+		job->body_len += ret;
+	}
+	return OS_SUCCESS;
+}
+
+/* Park the job's session till the job is complete. The session context
+ * travels with the job, till it comes back. */
+static void httpd_job_detach(struct httpd_job *job)
+{
+	struct sock_db *sd = job->sd;
+	sd->job = job;
+	sd->ctx = NULL;
+	sd->free_ctx = NULL;
+}
+
+void httpd_job_orphan(struct httpd_job *job)
+{
+	struct httpd_pool *p = hd.hd_pool;
+
+	if (job->gathering) {
+		/* Still the reactor's, along with its slot */
+		omutex_lock(&p->lock);
+		p->reserved--;
+		omutex_unlock(&p->lock);
+		httpd_job_free_ctx(job);
+		httpd_job_free(job);
+		return;
+	}
+	/* The reactor finds out once the job gets back, the worker never
+	 * looks at this */
+	job->sd = NULL;
+}
+
+int httpd_pool_gather(struct sock_db *sd)
+{
+	struct httpd_pool *p = hd.hd_pool;
+	struct httpd_job *job = sd->job;
+
+	int ret = httpd_job_gather(job, sd);
+	if (ret != OS_SUCCESS)
+		return ret;
+
+	/* Into the slot that was set aside for it */
+	omutex_lock(&p->lock);
+	if (p->halt) {
+		omutex_unlock(&p->lock);
+		return -OS_FAIL;
+	}
+	p->reserved--;
+	p->queue[(p->head + p->count) % p->queue_len] = job;
+	p->count++;
+	if (p->count > p->stats.max_queued)
+		p->stats.max_queued = p->count;
+	job->gathering = false;
+	omutex_unlock(&p->lock);
+	osem_post(&p->jobs);
+	return OS_SUCCESS;
+}
+
+int httpd_pool_offload(httpd_req_t *r)
+{
+	struct httpd_pool *p = hd.hd_pool;
+	struct httpd_req_aux *ra = r->aux;
+	struct httpd_job *job;
+
+	int ret = httpd_job_new(r, &job);
+	if (ret == -ENOMEM)
+		goto busy;
+	if (ret != OS_SUCCESS)
+		return ret;
+
+	omutex_lock(&p->lock);
+	if (p->halt || p->count + p->reserved == p->queue_len) {
+		p->stats.rejected++;
+		omutex_unlock(&p->lock);
+		httpd_job_free(job);
+		goto busy;
+	}
+	p->reserved++;
+	omutex_unlock(&p->lock);
+	job->gathering = true;
+	httpd_job_detach(job);
+
+	/* The rest of the body is read as it arrives, see
+	 * httpd_sess_process() */
+	ret = httpd_pool_gather(ra->sd);
+	return ret == -EAGAIN ? OS_SUCCESS : ret;
+
+ busy:
+	httpd_d("worker pool busy, rejecting request\n");
+	httpd_resp_set_status(r, HTTPD_503);
+	httpd_resp_set_type(r, HTTPD_TYPE_TEXT);
+	httpd_resp_send(r, NULL, 0);
+	return OS_SUCCESS;
+}
+
+int httpd_req_async_handler_begin(httpd_req_t *r, httpd_req_t **out)
+{
+	struct httpd_req_aux *ra = r->aux;
+	struct httpd_job *job;
+
+	if (ra->job) {
+		/* The worker pool is serving this one already, it only needs
+		 * to be left alone by the worker */
+		httpd_cur_job_async = true;
+		*out = r;
+		return OS_SUCCESS;
+	}
+	if (! httpd_rt || ra->remaining_len > HTTPD_OFFLOAD_MAX_BODY)
+		return -OS_FAIL;
+
+	/* This is the handler's thread still, which waits for the body as
+	 * the handler would */
+	int ret = httpd_job_new(r, &job);
+	if (ret != OS_SUCCESS)
+		return ret;
+	if (httpd_job_read_body(job, r) != OS_SUCCESS) {
+		httpd_job_free(job);
+		return -OS_FAIL;
+	}
+	httpd_job_detach(job);
+	*out = &job->req;
+	return OS_SUCCESS;
+}
+
+int httpd_req_async_handler_complete(httpd_req_t *r)
+{
+	struct httpd_req_aux *ra = r->aux;
+	struct httpd_job *job = ra->job;
+	int ret;
+
+	if (! job)
+		return -OS_FAIL;
+	/* The session stays parked till the job gets back, so wait for room
+	 * if the reactor's control channel is full. A reactor doesn't wait, it
+	 * could be the one that the channel waits on. */
+	while ((ret = httpd_queue_work_rt(job->rt, httpd_job_complete,
+					  job)) == -ENOSPC && ! httpd_rt)
+		othread_sleep(10);
+	return ret;
+}
+
+int httpd_get_worker_stats(struct httpd_worker_stats *stats)
+{
+	struct httpd_pool *p = hd.hd_pool;
+	if (! p)
+		return -OS_FAIL;
+	omutex_lock(&p->lock);
+	*stats = p->stats;
+	stats->queued = p->count;
+	omutex_unlock(&p->lock);
+	return OS_SUCCESS;
+}
+
+void httpd_pool_stop()
+{
+	struct httpd_pool *p = hd.hd_pool;
+	unsigned i;
+	if (! p)
+		return;
+
+	omutex_lock(&p->lock);
+	p->halt = true;
+	omutex_unlock(&p->lock);
+	/* The jobs that haven't started go back to their reactors as failed,
+	 * which close their sessions. Their sessions refer to them till
+	 * then. */
+	while (1) {
+		omutex_lock(&p->lock);
+		struct httpd_job *job = p->count ? p->queue[p->head] : NULL;
+		if (job) {
+			p->head = (p->head + 1) % p->queue_len;
+			p->count--;
+		}
+		omutex_unlock(&p->lock);
+		if (! job)
+			break;
+		job->ret = -OS_FAIL;
+		while (httpd_queue_work_rt(job->rt, httpd_job_complete,
+					   job) == -ENOSPC)
+			othread_sleep(10);
+	}
+
+	for (i = 0; i < p->n_workers; i++)
+		osem_post(&p->jobs);
+	for (i = 0; i < p->n_workers; i++) {
+		while (p->workers[i].status == THREAD_RUNNING)
+			othread_sleep(1000);
+	}
+	p->n_workers = 0;
+}
+
+void httpd_pool_deinit()
+{
+	struct httpd_pool *p = hd.hd_pool;
+	if (! p)
+		return;
+	httpd_pool_stop();
+	osem_delete(&p->jobs);
+	omutex_delete(&p->lock);
+	free(p->queue);
+	free(p->workers);
+	free(p);
+	hd.hd_pool = NULL;
+}
+
+int httpd_pool_init(unsigned workers, unsigned queue_len, unsigned stack_size)
+{
+	struct httpd_pool *p;
+	unsigned i;
+
+	/* Offloaded handlers are executed by the reactors, if there are no
+	 * workers */
+	if (! workers || ! queue_len)
+		return OS_SUCCESS;
+
+	p = calloc(1, sizeof(*p));
+	if (! p)
+		return -OS_FAIL;
+	p->workers = calloc(workers, sizeof(*p->workers));
+	p->queue = calloc(queue_len, sizeof(*p->queue));
+	if (! p->workers || ! p->queue)
+		goto err_free;
+	if (omutex_init(&p->lock) != OS_SUCCESS)
+		goto err_free;
+	if (osem_init(&p->jobs, 0) != OS_SUCCESS) {
+		omutex_delete(&p->lock);
+		goto err_free;
+	}
+	p->queue_len = queue_len;
+	hd.hd_pool = p;
+
+	for (i = 0; i < workers; i++) {
+		/* Marked before the thread runs, so that a stop waits for it */
+		p->workers[i].status = THREAD_RUNNING;
+		if (othread_create(&p->workers[i].handle, "httpd_worker",
+				   stack_size, OS_DEFAULT_PRIORITY,
+				   httpd_worker, &p->workers[i]) != OS_SUCCESS) {
+			p->workers[i].status = THREAD_IDLE;
+			p->n_workers = i;
+			httpd_pool_deinit();
+			return -OS_FAIL;
+		}
+	}
+	p->n_workers = workers;
+	return OS_SUCCESS;
+
+ err_free:
+	free(p->queue);
+	free(p->workers);
+	free(p);
+	return -OS_FAIL;
+}
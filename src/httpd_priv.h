@@ -7,9 +7,19 @@
 
 #include <osal.h>
 
-/* The maximum number of sockets that will stay in the open state */
-#define HTTPD_MAX_OPEN_SOCKETS 8
-#define HTTPD_SCRATCH_BUF      512
+/* Chunked responses are coalesced into chunks of up to this size */
+#ifndef HTTPD_CHUNK_BUF
+#define HTTPD_CHUNK_BUF        1024
+#endif
+/* Most blocks that are kept around for the arenas of the requests, see
+ * httpd_arena.c */
+#ifndef HTTPD_ARENA_POOL_MAX
+#define HTTPD_ARENA_POOL_MAX   64
+#endif
+/* The timing wheel of the timeouts: its granularity, and its number of slots
+ * (a power of 2) */
+#define HTTPD_TIMER_TICK_MS    100
+#define HTTPD_TIMER_SLOTS      256
 
 struct thread_data {
 	othread_t      handle;
@@ -22,63 +32,523 @@ struct thread_data {
 	bool             halt;
 };
 
-/** A database of all the open sockets in the system. */
+/** The state of an open socket. Only the fields that aren't required on the
+ * dispatch path are kept here, the others are in struct httpd_sess_tbl. */
 struct sock_db {
-	/** The file descriptor for this socket */
-	int fd;
+	/** The slot of this socket in the session table */
+	int slot;
 	/** A custom context for this socket */
 	void *ctx;
 	/** Function for freeing the context */
 	httpd_free_sess_ctx_fn_t free_ctx;
-	/** Send function for this socket */
-	httpd_send_func_t send_fn;
-	/** Send function for this socket */
-	httpd_recv_func_t recv_fn;
+	/** Data read from the socket, but not yet consumed by a request. This
+	 * could be the body of the current request or the next pipelined
+	 * request. It is recv_buf_size long, see httpd_sess_rx_size(). */
+	char *rx_buf;
+	/** Offset of the first unconsumed byte in rx_buf */
+	unsigned rx_head;
+	/** Offset just past the last valid byte in rx_buf */
+	unsigned rx_tail;
+	/** Offset upto which rx_buf has been looked at for the end of a
+	 * request header, so that a header that arrives in pieces isn't
+	 * scanned from its start every time */
+	unsigned rx_scan;
+	/** The request of this session that is being served by the worker
+	 * pool. Once its body is in, the socket isn't polled until that
+	 * request completes. */
+	struct httpd_job *job;
+	/** The socket was taken off the poll set for job */
+	bool parked;
+	/** Output that the socket hasn't taken yet, see httpd_out.c. While
+	 * there is any, the socket is polled for writing. */
+	struct httpd_out *out_head;
+	struct httpd_out *out_tail;
+	bool out_writing;
+	/** The request being served has the next one behind it, so its
+	 * response is held back in the queue, along with out_held bytes of
+	 * the earlier ones */
+	bool out_batch;
+	unsigned out_held;
+	/** What the session is waiting for, which decides its timeout */
+	enum {
+		/** The header of a request */
+		HTTPD_SESS_HDR,
+		/** Nothing, it is an idle keep-alive session */
+		HTTPD_SESS_IDLE,
+		/** A request is being served */
+		HTTPD_SESS_BUSY,
+		/** The rest of the body of a request for the worker pool */
+		HTTPD_SESS_BODY,
+	} state;
+	/** The session is on the timing wheel, with this expiry tick */
+	bool tm_armed;
+	uint32_t tm_expiry;
+	/** Neighbours on the same slot of the timing wheel, -1 terminates */
+	int tm_prev;
+	int tm_next;
+	/** Neighbours in the list of idle sessions, least recently used
+	 * first. Only idle sessions are in that list. */
+	int lru_prev;
+	int lru_next;
+};
+
+/** A database of all the open sockets in the system.
+ *
+ * The fields that are looked at for every socket activity are kept in arrays
+ * of their own, indexed by the slot, so that going over a large number of
+ * sessions touches as few cache lines as possible.
+ */
+struct httpd_sess_tbl {
+	/** Number of slots in the table */
+	int                 max;
+	/** The socket descriptor in each slot, -1 for free slots */
+	int                *fd;
+	/** Send function for each slot */
+	httpd_send_func_t  *send_fn;
+	/* NULL if the responses are to be sent piece by piece with send_fn */
+	httpd_sendv_func_t *sendv_fn;
+	/** Receive function for each slot */
+	httpd_recv_func_t  *recv_fn;
+	/** Everything else about each slot */
+	struct sock_db     *sd;
+	/** The slot of each socket descriptor, -1 if it isn't a session */
+	int                *fd_slot;
+	/** Number of entries in fd_slot */
+	int                 fd_slot_len;
+	/** The receive buffers of all the slots, and the size of each */
+	char               *rx_bufs;
+	unsigned            rx_buf_size;
+	/** Stack of the free slots */
+	int                *free_slot;
+	/** Number of entries in free_slot */
+	int                 n_free;
+	/** The idle sessions, least recently used first. -1 if none */
+	int                 lru_head;
+	int                 lru_tail;
+};
+
+/** A hashed timing wheel, holding the deadline of every session. A session
+ * sits in the slot of its expiry tick, and a slot is gone through as the wheel
+ * gets to it, so that arming, disarming and expiring are all O(1). */
+struct httpd_timers {
+	/** The first session in each slot, -1 if none */
+	int      wheel[HTTPD_TIMER_SLOTS];
+	/** A bit for each slot that has any session in it */
+	uint32_t used[HTTPD_TIMER_SLOTS / 32];
+	/** The tick that the wheel has been advanced to */
+	uint32_t now;
+	/** No session expires before this tick */
+	uint32_t next;
+	/** Number of sessions on the wheel */
+	int      cnt;
+};
+
+/* The maximum number of ready sockets handled in one wakeup */
+#define HTTPD_POLL_MAX_EVENTS  32
+
+/** State of the backend that waits for socket activity */
+struct httpd_poll {
+#if defined(OS_HAVE_IO_URING)
+	/** The ring and everything in flight on it */
+	struct httpd_uring *ring;
+#elif defined(OS_HAVE_EPOLL)
+	/** The epoll instance holding the interest set */
+	int fd;
+#else
+	/** All the sockets that are waited upon, to be readable or to be
+	 * writable */
+	fd_set set;
+	fd_set wset;
+	/** The largest socket descriptor in the sets */
+	int maxfd;
+#endif
+};
+
+/** The memory of a request, see httpd_arena.c */
+struct httpd_arena {
+	/** The block that stays on across the requests, and the one being
+	 * handed out from. The blocks chained on after the first one go back
+	 * once the request is done with. */
+	struct httpd_arena_blk *first;
+	struct httpd_arena_blk *cur;
+};
+
+/** The blocks that the arenas chain on, once they run out */
+struct httpd_arena_pool {
+	omutex_t                lock;
+	/** The size of each block */
+	size_t                  block_size;
+	struct httpd_arena_blk *free;
+	unsigned                free_cnt;
 };
 
 struct httpd_req_aux {
 	struct sock_db  *sd;
-	/* Temporary buffer for our operations. Allocate dynamically? */
-	char             scratch[HTTPD_SCRATCH_BUF];
+	/* The memory of the request, see httpd_req_alloc() */
+	struct httpd_arena *arena;
+	/* The status line and the content headers of the response, put
+	 * together in the arena */
+	char            *status_line;
+	unsigned         status_line_len;
 	/* Amount of data remaining to be fetched */
 	size_t           remaining_len;
+	/* Time by which all of the body has to be in, 0 for none */
+	uint64_t         body_by;
 	/* HTTP response's status code */
 	char            *status;
 	/* HTTP response's content type */
 	char            *content_type;
+	/* Additional headers of the HTTP response */
+	struct {
+		const char *field;
+		const char *value;
+	}                resp_hdrs[HTTPD_MAX_RESP_HDRS];
+	unsigned         resp_hdrs_cnt;
+	/* The request's headers, as offsets into hdr_buf. That is the
+	 * session's receive buffer, or a copy in the arena for a request
+	 * served by the worker pool. The values are NUL terminated there. */
+	const char      *hdr_buf;
+	struct {
+		uint16_t name;
+		uint16_t name_len;
+		uint16_t val;
+		uint16_t val_len;
+		uint8_t  id;
+	}                hdrs[HTTPD_MAX_REQ_HDRS];
+	unsigned         hdrs_cnt;
+	/* For each recognised header, its index in hdrs plus 1, 0 if the
+	 * request doesn't have it */
+	uint8_t          hdrs_by_id[HTTPD_HDR_MAX];
+	/* Set once the header of a chunked response is out */
+	bool             resp_hdrs_sent;
+	/* Data of a chunked response, yet to be sent out */
+	char             chunk_buf[HTTPD_CHUNK_BUF];
+	unsigned         chunk_len;
+	/* Set if this request is served by the worker pool */
+	struct httpd_job *job;
+	/* The handler that the request was matched to, and the values of the
+	 * parameters in its URI, as offsets into the request's URI */
+	const struct httpd_uri *route;
+	struct {
+		uint16_t off;
+		uint16_t len;
+	}                uri_params[HTTPD_MAX_URI_PARAMS];
+	unsigned         uri_params_cnt;
+	/* The query string, copied into the arena and percent-decoded there
+	 * on first use, and its parameters as offsets into that. The keys and
+	 * values are NUL terminated there. */
+	bool             query_parsed;
+	char            *query;
+	struct {
+		uint16_t key;
+		uint16_t val;
+		uint16_t val_len;
+	}                query_params[HTTPD_MAX_QUERY_PARAMS];
+	unsigned         query_cnt;
 };
 
-struct httpd_data {
+/** A request that is served away from its reactor. The handler works on
+ * copies of the request, the body is read upfront, and the response is
+ * collected for the reactor to send out. */
+struct httpd_job {
+	/* The reactor that the request came in on, and its session. The
+	 * session is only ever looked at by the reactor, it is NULL once the
+	 * session is closed. */
+	struct httpd_reactor *rt;
+	struct sock_db       *sd;
+	int                   fd;
+	struct httpd_req      req;
+	struct httpd_req_aux  aux;
+	/* The memory of the request, that goes with the job */
+	struct httpd_arena    arena;
+	/* What the handler returned */
+	int                   ret;
+	/* The request body, body_len of body_size bytes are in */
+	char                 *body;
+	size_t                body_len;
+	size_t                body_size;
+	/* The body is being read by the reactor, the job isn't queued yet */
+	bool                  gathering;
+	/* The response */
+	char                 *resp;
+	size_t                resp_len;
+	size_t                resp_size;
+	/* Overrides set by the handler, applied by the reactor */
+	httpd_send_func_t     send_fn;
+	httpd_sendv_func_t    sendv_fn;
+	httpd_recv_func_t     recv_fn;
+};
+
+/** Everything that belongs to one event loop thread (reactor). Each reactor
+ * has a listening socket of its own, and serves the connections accepted on
+ * it. */
+struct httpd_reactor {
+	/* Index of this reactor */
+	int                  rt_id;
+	/* CPU that this reactor's thread is pinned to, -1 for none */
+	int                  rt_cpu;
 	/* Information for the HTTPd thread */
-	struct thread_data   hd_td;
+	struct thread_data   rt_td;
+	/* The listening socket */
+	int                  rt_listen_fd;
+	/* The control channel, and the descriptor that it wakes us up on */
+	int                  rt_ctrl_fd;
+#ifdef OS_HAVE_EVENTFD
+	struct httpd_ctrl_q *rt_ctrl_q;
+#else
+	int                  rt_ctrl_port;
+#endif
 	/* The socket database */
-	struct sock_db       hd_sd[HTTPD_MAX_OPEN_SOCKETS];
-	/* Registered URI handlers */
-	struct httpd_uri    *hd_calls[HTTPD_MAX_URI_HANDLERS];
+	struct httpd_sess_tbl rt_sess;
+	/* The timeouts of the sessions */
+	struct httpd_timers  rt_timers;
+	/* Waiting for activity on the sockets */
+	struct httpd_poll    rt_poll;
 	/* The current HTTPD request */
-	struct httpd_req     hd_req;
+	struct httpd_req     rt_req;
 	/* Additional data about the HTTPD request. This could
 	 * potentially be merged with the httpd_req above. But that
 	 * is exposed in the API. We could reconsider whether the
 	 * httpd_req should be visible to the user, or could we make
 	 * it opaque.  */
-	struct httpd_req_aux hd_req_aux;
+	struct httpd_req_aux rt_req_aux;
+	/* The memory of the current request */
+	struct httpd_arena   rt_arena;
+	/* What became of the connections accepted by this reactor. Only
+	 * this reactor's thread updates these. */
+	struct httpd_conn_stats rt_conn;
+};
+
+struct httpd_data {
+	/* The configuration that the web server was started with */
+	httpd_config_t       hd_config;
+	/* The reactors */
+	struct httpd_reactor *hd_rt;
+	int                  hd_rt_cnt;
+	/* Registered URI handlers, shared by all the reactors. This is an
+	 * immutable snapshot that is replaced on every change. */
+	struct httpd_route_tbl *hd_routes;
+	/* Bumped with every new snapshot, see httpd_routes_enter() */
+	unsigned long        hd_routes_epoch;
+	/* The threads that look up URI handlers */
+	struct httpd_reader *hd_readers;
+	/* The fixed routes, that are looked at first */
+	httpd_route_lookup_t hd_route_lookup;
+	/* The worker pool */
+	struct httpd_pool   *hd_pool;
+	/* The spare blocks of the arenas of the requests */
+	struct httpd_arena_pool hd_arena_pool;
+	/* The response that connections are turned away with, when the
+	 * sessions are all in use */
+	char                 hd_busy_resp[128];
+	unsigned             hd_busy_resp_len;
 };
 extern struct httpd_data hd;
+/* The reactor that the calling thread runs, NULL for any other thread */
+extern OS_THREAD_LOCAL struct httpd_reactor *httpd_rt;
+/* The job that a worker thread is executing, NULL on all other threads */
+extern OS_THREAD_LOCAL struct httpd_job *httpd_cur_job;
 
 /******************* Session Management ********************/
-void httpd_sess_init();
+int httpd_sess_init(struct httpd_sess_tbl *st, int max_sess, unsigned rx_buf_size);
+void httpd_sess_deinit(struct httpd_sess_tbl *st);
+/* Returns -ENOSPC if the sessions are all in use */
 int httpd_sess_new(int newfd);
 int httpd_sess_process(int newfd);
 void httpd_sess_delete(int fd);
-void httpd_sess_set_descriptors(fd_set *fdset, int *maxfd);
+struct sock_db *httpd_sess_get(int fd);
 int httpd_sess_iterate(int start);
+/* Arm the timeout for what the session is waiting for now */
+void httpd_sess_touch(struct sock_db *sd);
+/* Close a session whose timeout went off */
+void httpd_sess_expire(struct sock_db *sd);
+
+static inline int httpd_sess_fd(struct sock_db *sd)
+{
+	return httpd_rt->rt_sess.fd[sd->slot];
+}
+
+static inline httpd_send_func_t httpd_sess_send_fn(struct sock_db *sd)
+{
+	return httpd_rt->rt_sess.send_fn[sd->slot];
+}
+
+static inline httpd_sendv_func_t httpd_sess_sendv_fn(struct sock_db *sd)
+{
+	return httpd_rt->rt_sess.sendv_fn[sd->slot];
+}
+
+static inline httpd_recv_func_t httpd_sess_recv_fn(struct sock_db *sd)
+{
+	return httpd_rt->rt_sess.recv_fn[sd->slot];
+}
+
+static inline unsigned httpd_sess_rx_size(struct sock_db *sd)
+{
+	return httpd_rt->rt_sess.rx_buf_size;
+}
+
+/****************** Event Polling ********************/
+int httpd_poll_init();
+void httpd_poll_deinit();
+/* Add/remove a socket to/from the set that is waited upon */
+int httpd_poll_add(int fd);
+void httpd_poll_del(int fd);
+/* Close a socket once it is removed. The backend may keep it open a while,
+ * till what was sent on it is out. */
+void httpd_poll_close(int fd);
+/* Wait for the socket to be writable instead of readable, or back */
+void httpd_poll_set_write(int fd, bool on);
+/* Nothing that was sent on the socket is still held by the backend */
+bool httpd_poll_tx_idle(int fd);
+/* Add the listening socket, and accept a connection on it once it is
+ * reported as ready. Returns the new socket, -EAGAIN if there is none
+ * pending, or another negative errno on error. */
+int httpd_poll_add_listener(int fd);
+int httpd_poll_accept(int listen_fd);
+/* Turn away a connection that was just accepted with a 503, and close it */
+void httpd_conn_shed(int fd);
+/* Wait for activity, for at most timeout_ms (-1 for no limit). The ready
+ * sockets are returned in fds, the return value is the number of such sockets,
+ * or negative on error */
+int httpd_poll_wait(int *fds, int max_fds, int timeout_ms);
+
+/****************** Timeouts ********************/
+void httpd_timer_init(struct httpd_timers *t);
+/* (Re)arm the session's timeout to go off in ms, 0 just disarms it */
+void httpd_timer_set(struct sock_db *sd, unsigned ms);
+void httpd_timer_del(struct sock_db *sd);
+/* Milliseconds till the next timeout goes off, -1 if none is armed */
+int httpd_timer_next_ms(void);
+/* Expire the sessions whose timeout went off */
+void httpd_timer_expire(void);
+
+/****************** Output Queue ********************/
+/* Send the buffers on the session without waiting, and queue up what the
+ * socket doesn't take. The buffers from ref_from on are referred to till they
+ * are sent, the ones before it are copied. */
+int httpd_out_sendv(struct sock_db *sd, const struct iovec *iov, int iovcnt, int ref_from);
+/* Send buf, which is freed once it is out, and on error */
+int httpd_out_give(struct sock_db *sd, char *buf, size_t len);
+/* Send len bytes of the file from offset. The server keeps a copy of fd. */
+int httpd_out_file(struct sock_db *sd, int fd, off_t offset, size_t len);
+/* Send what the provider produces, len bytes of it or chunked if -1 */
+int httpd_out_provider(struct sock_db *sd, long len, httpd_body_provider_t fn,
+		       httpd_free_provider_ctx_fn_t free_ctx, void *ctx);
+/* Send as much of the queue as the socket takes, once it is writable */
+int httpd_out_flush(struct sock_db *sd);
+/* The pipeline is served, send what was held back of it */
+int httpd_out_release(struct sock_db *sd);
+/* Wait for the socket to be writable till the backend has let go of all that
+ * was sent, see httpd_poll_tx_idle() */
+void httpd_out_drain(struct sock_db *sd);
+void httpd_out_free(struct sock_db *sd);
+
+/* The session is waiting for its output to go out */
+static inline bool httpd_out_pending(struct sock_db *sd)
+{
+	return sd->out_writing;
+}
+
+/****************** Request Memory ********************/
+int httpd_arena_pool_init(unsigned block_size);
+void httpd_arena_pool_deinit();
+/* Set the arena up with its first block */
+int httpd_arena_init(struct httpd_arena *a);
+/* Give back the arena's blocks, all of them */
+void httpd_arena_deinit(struct httpd_arena *a);
+/* Returns NULL if out of memory */
+void *httpd_arena_alloc(struct httpd_arena *a, size_t size);
+char *httpd_arena_strndup(struct httpd_arena *a, const char *s, size_t len);
+/* Hand out the first block from its start again, and give back the others */
+void httpd_arena_reset(struct httpd_arena *a);
+
+/****************** Work Queue ********************/
+/* Queue work to a specific reactor */
+int httpd_queue_work_rt(struct httpd_reactor *rt, httpd_work_fn_t work, void *arg);
+
+/****************** Control Channel ********************/
+struct httpd_ctrl_data {
+	enum httpd_ctrl_msg {
+		HTTPD_CTRL_SHUTDOWN,
+		HTTPD_CTRL_WORK,
+	} hc_msg;
+	httpd_work_fn_t hc_work;
+	void *hc_work_arg;
+};
+
+int httpd_ctrl_init(struct httpd_reactor *rt);
+void httpd_ctrl_deinit(struct httpd_reactor *rt);
+/* Send a message to a reactor, from any thread */
+int httpd_ctrl_send(struct httpd_reactor *rt, const struct httpd_ctrl_data *msg);
+/* Executed by the reactor when its control descriptor is readable. Every
+ * message that has arrived is passed on to httpd_process_ctrl_msg(). */
+void httpd_ctrl_recv(struct httpd_reactor *rt);
+void httpd_process_ctrl_msg(const struct httpd_ctrl_data *msg);
+
+/****************** Worker Pool ********************/
+int httpd_pool_init(unsigned workers, unsigned queue_len, unsigned stack_size);
+/* Stop the workers. Jobs are all handed back to their reactors, the ones that
+ * haven't started yet as failed. */
+void httpd_pool_stop();
+/* Free the pool, once the reactors are done with it */
+void httpd_pool_deinit();
+/* Hand the current request over to the worker pool. On success the request
+ * belongs to the pool, and its session is detached. The session may have to
+ * gather the rest of the request's body first. */
+int httpd_pool_offload(httpd_req_t *r);
+/* Read more of the body of the session's job, without waiting. The job goes
+ * to the workers once all of it is in, -EAGAIN if there is more to come. */
+int httpd_pool_gather(struct sock_db *sd);
+/* The session of the job is being closed */
+void httpd_job_orphan(struct httpd_job *job);
+/* The send/recv of requests served by the worker pool */
+int httpd_job_send(struct httpd_job *job, const char *buf, unsigned buf_len);
+int httpd_job_recv(struct httpd_job *job, char *buf, unsigned buf_len);
 
 /****************** URI handling ********************/
 int httpd_uri(httpd_req_t *req);
+/* Execute the handler of a request that was offloaded, on a worker */
+int httpd_uri_offloaded(httpd_req_t *req);
+
+/* The URI handlers are looked up without locks. The threads that do so
+ * (reactors and workers) add themselves as readers, and are inside a read
+ * section from looking up a handler till it returns. A snapshot of the
+ * handlers is freed, and an unregister returns, once every reader that could
+ * still be using the old snapshot has left its read section. */
+struct httpd_reader {
+	/* The epoch that the reader entered in, plus 1. 0 if it is outside */
+	unsigned long        epoch;
+	struct httpd_reader *next;
+};
+void httpd_reader_add(void);
+void httpd_reader_del(void);
+/* Free the lookup tree of the URI handlers */
+void httpd_uri_deinit(void);
+/* Make room for max URI handlers, with the ones registered already kept */
+int httpd_uri_init(unsigned max);
 
 /****************** Parsing ********************/
+/* The offset of the first a or b in buf, len if there is none. Pass the same
+ * character twice to look for just that one. */
+typedef size_t (*httpd_scan_fn_t)(const char *buf, size_t len, char a, char b);
+size_t httpd_scan(const char *buf, size_t len, char a, char b);
+
 int httpd_parse_hdrs(httpd_req_t *r, struct httpd_req_aux *ra);
+bool httpd_req_pending(struct sock_db *sd);
+int httpd_req_recv_hdr(struct sock_db *sd);
+
+/* Move any leftover data to the start of the receive buffer, so that the
+ * next request's header has the most space available */
+static inline void httpd_rx_compact(struct sock_db *sd)
+{
+	if (! sd->rx_head)
+		return;
+	memmove(sd->rx_buf, sd->rx_buf + sd->rx_head, sd->rx_tail - sd->rx_head);
+	sd->rx_tail -= sd->rx_head;
+	sd->rx_scan = sd->rx_scan > sd->rx_head ? sd->rx_scan - sd->rx_head : 0;
+	sd->rx_head = 0;
+}
 
 int httpd_req_new(httpd_req_t *r, struct sock_db *sd);
 int httpd_req_delete(httpd_req_t *r);
@@ -92,13 +562,25 @@ int httpd_req_delete(httpd_req_t *r);
  */
 int httpd_send(httpd_req_t *r, const char *buf, unsigned buf_len);
 int httpd_recv(httpd_req_t *r, char *buf, unsigned buf_len);
+/* Send out all of the buffers, in as few calls as the session allows */
+int httpd_sendv(httpd_req_t *r, struct iovec *iov, int iovcnt);
+/* The same, with the buffers from static_from on left in place till they are
+ * sent, rather than copied if the socket can't take them right away */
+int httpd_sendv_static(httpd_req_t *r, struct iovec *iov, int iovcnt, int static_from);
 
 /* These are the lower level default send/recv function of the
  * HTTPd. These should NEVER be directly called. The semantics of
  * these is exactly similar to send()/recv() of the BSD socket API.
  */
 int __httpd_send(int sockfd, const char *buf, unsigned buf_len, int flags);
+int __httpd_sendv(int sockfd, const struct iovec *iov, int iovcnt, int flags);
 int __httpd_recv(int sockfd, char *buf, unsigned buf_len, int flags);
 
+#ifdef OS_HAVE_IO_URING
+/* Queue data for sending through the ring, see httpd_uring.c */
+int httpd_uring_send(int sockfd, const char *buf, unsigned buf_len, int flags);
+int httpd_uring_sendv(int sockfd, const struct iovec *iov, int iovcnt, int flags);
+#endif
+
 
 #endif /* ! _HTTPD_PRIV_H_ */
@@ -0,0 +1,86 @@
+/**
+ * Scanning of request headers for the characters that delimit them.
+ *
+ * The parser looks for CR, ':' and ' ' through httpd_scan(). On x86 that
+ * compares 16 (SSE2) or 32 (AVX2) bytes at a time, picking the widest that
+ * the CPU has the first time that it is called. Everywhere else, it is a
+ * plain loop.
+ */
+
+#include <stdint.h>
+
+#include <httpd.h>
+
+#include "httpd_priv.h"
+
+static size_t httpd_scan_scalar(const char *buf, size_t len, char a, char b)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		if (buf[i] == a || buf[i] == b)
+			break;
+	return i;
+}
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+
+#include <immintrin.h>
+
+static size_t httpd_scan_sse2(const char *buf, size_t len, char a, char b)
+{
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+							       _mm_cmpeq_epi8(v, vb)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + httpd_scan_scalar(buf + i, len - i, a, b);
+}
+
+__attribute__((target("avx2")))
+static size_t httpd_scan_avx2(const char *buf, size_t len, char a, char b)
+{
+	const __m256i va = _mm256_set1_epi8(a);
+	const __m256i vb = _mm256_set1_epi8(b);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+								     _mm256_cmpeq_epi8(v, vb)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + httpd_scan_sse2(buf + i, len - i, a, b);
+}
+
+static size_t httpd_scan_pick(const char *buf, size_t len, char a, char b);
+static httpd_scan_fn_t httpd_scan_fn = httpd_scan_pick;
+
+/* Replaces itself with the best one for this CPU, on the first call */
+static size_t httpd_scan_pick(const char *buf, size_t len, char a, char b)
+{
+	httpd_scan_fn_t fn = httpd_scan_sse2;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fn = httpd_scan_avx2;
+	__atomic_store_n(&httpd_scan_fn, fn, __ATOMIC_RELAXED);
+	return fn(buf, len, a, b);
+}
+
+#else /* ! x86 */
+
+static httpd_scan_fn_t httpd_scan_fn = httpd_scan_scalar;
+
+#endif /* ! x86 */
+
+size_t httpd_scan(const char *buf, size_t len, char a, char b)
+{
+	return __atomic_load_n(&httpd_scan_fn, __ATOMIC_RELAXED)(buf, len, a, b);
+}
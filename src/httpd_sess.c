@@ -1,38 +1,166 @@
 #include <sys/socket.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include <httpd.h>
 
 #include "httpd_priv.h"
 
 
-int httpd_sess_new(int newfd)
+/* Make sure that the fd to slot map covers this socket descriptor */
+static int httpd_sess_grow_fd_map(struct httpd_sess_tbl *st, int fd)
 {
-	httpd_d("new session %d\n", newfd);
+	int len = st->fd_slot_len ? st->fd_slot_len : 64;
 	int i;
-	for (i = 0; i < HTTPD_MAX_OPEN_SOCKETS; i++) {
-		//		httpd_d("db [%d] = %d\n", i, hd.hd_sd[i].fd);
-		if (hd.hd_sd[i].fd == -1) {
-			memset(&hd.hd_sd[i], 0, sizeof(hd.hd_sd[i]));
-			hd.hd_sd[i].fd = newfd;
-			hd.hd_sd[i].send_fn = __httpd_send;
-			hd.hd_sd[i].recv_fn = __httpd_recv;
-			return 0;
+
+	while (len <= fd)
+		len *= 2;
+	int *fd_slot = realloc(st->fd_slot, len * sizeof(*fd_slot));
+	if (! fd_slot)
+		return -OS_FAIL;
+	for (i = st->fd_slot_len; i < len; i++)
+		fd_slot[i] = -1;
+	st->fd_slot = fd_slot;
+	st->fd_slot_len = len;
+	return OS_SUCCESS;
+}
+
+static void httpd_sess_lru_del(struct sock_db *sd)
+{
+	struct httpd_sess_tbl *st = &httpd_rt->rt_sess;
+
+	if (sd->state != HTTPD_SESS_IDLE)
+		return;
+	if (sd->lru_prev >= 0)
+		st->sd[sd->lru_prev].lru_next = sd->lru_next;
+	else
+		st->lru_head = sd->lru_next;
+	if (sd->lru_next >= 0)
+		st->sd[sd->lru_next].lru_prev = sd->lru_prev;
+	else
+		st->lru_tail = sd->lru_prev;
+}
+
+static void httpd_sess_lru_add(struct sock_db *sd)
+{
+	struct httpd_sess_tbl *st = &httpd_rt->rt_sess;
+
+	sd->lru_next = -1;
+	sd->lru_prev = st->lru_tail;
+	if (st->lru_tail >= 0)
+		st->sd[st->lru_tail].lru_next = sd->slot;
+	else
+		st->lru_head = sd->slot;
+	st->lru_tail = sd->slot;
+}
+
+/* The session is serving a request */
+static void httpd_sess_busy(struct sock_db *sd)
+{
+	httpd_sess_lru_del(sd);
+	sd->state = HTTPD_SESS_BUSY;
+}
+
+void httpd_sess_touch(struct sock_db *sd)
+{
+	if (httpd_out_pending(sd)) {
+		/* The client has this long to take some of the response */
+		httpd_sess_busy(sd);
+		httpd_timer_set(sd, hd.hd_config.send_timeout_ms);
+	} else if (sd->job && sd->job->gathering) {
+		/* The body has one deadline, however slowly it trickles in */
+		if (sd->state != HTTPD_SESS_BODY) {
+			httpd_sess_busy(sd);
+			sd->state = HTTPD_SESS_BODY;
+			httpd_timer_set(sd, hd.hd_config.body_timeout_ms);
+		}
+	} else if (sd->job) {
+		/* The request isn't timed while it is away */
+		httpd_sess_busy(sd);
+		httpd_timer_del(sd);
+	} else if (sd->rx_tail > sd->rx_head) {
+		/* A part of the next request is in. Its header gets no more
+		 * time for trickling in slowly. */
+		if (sd->state != HTTPD_SESS_HDR) {
+			httpd_sess_busy(sd);
+			sd->state = HTTPD_SESS_HDR;
+			httpd_timer_set(sd, hd.hd_config.hdr_timeout_ms);
 		}
+	} else {
+		/* To the back of the list, if it was idle already */
+		httpd_sess_busy(sd);
+		sd->state = HTTPD_SESS_IDLE;
+		httpd_sess_lru_add(sd);
+		httpd_timer_set(sd, hd.hd_config.idle_timeout_ms);
 	}
-	return -OS_FAIL;
 }
 
-struct sock_db *httpd_sess_get(int newfd)
+void httpd_sess_expire(struct sock_db *sd)
 {
-	int i;
-	for (i = 0; i < HTTPD_MAX_OPEN_SOCKETS; i++) {
-		if (hd.hd_sd[i].fd == newfd) {
-			return &hd.hd_sd[i];
-		}
+	int fd = httpd_sess_fd(sd);
+	httpd_d("session %d timed out\n", fd);
+	httpd_sess_delete(fd);
+	httpd_poll_close(fd);
+}
+
+/* Close the idle session that was used the longest time ago */
+static int httpd_sess_purge(void)
+{
+	struct httpd_sess_tbl *st = &httpd_rt->rt_sess;
+
+	if (st->lru_head < 0)
+		return -OS_FAIL;
+	int fd = st->fd[st->lru_head];
+	httpd_d("purging idle session %d\n", fd);
+	httpd_sess_delete(fd);
+	httpd_poll_close(fd);
+	return OS_SUCCESS;
+}
+
+int httpd_sess_new(int newfd)
+{
+	struct httpd_sess_tbl *st = &httpd_rt->rt_sess;
+	httpd_d("new session %d\n", newfd);
+
+	if (! st->n_free && (! hd.hd_config.lru_purge || httpd_sess_purge() != OS_SUCCESS))
+		return -ENOSPC;
+	if (newfd >= st->fd_slot_len && httpd_sess_grow_fd_map(st, newfd) != OS_SUCCESS)
+		return -OS_FAIL;
+
+	int slot = st->free_slot[--st->n_free];
+	memset(&st->sd[slot], 0, sizeof(st->sd[slot]));
+	st->sd[slot].slot = slot;
+	st->sd[slot].rx_buf = st->rx_bufs + (size_t)slot * st->rx_buf_size;
+	st->fd[slot] = newfd;
+	st->send_fn[slot] = __httpd_send;
+	st->sendv_fn[slot] = __httpd_sendv;
+	st->recv_fn[slot] = __httpd_recv;
+	st->fd_slot[newfd] = slot;
+	if (httpd_poll_add(newfd) != OS_SUCCESS) {
+		st->fd[slot] = -1;
+		st->fd_slot[newfd] = -1;
+		st->free_slot[st->n_free++] = slot;
+		return -OS_FAIL;
 	}
-	return NULL;
+	/* The first request's header is timed from now */
+	st->sd[slot].state = HTTPD_SESS_HDR;
+	httpd_timer_set(&st->sd[slot], hd.hd_config.hdr_timeout_ms);
+	return 0;
+}
+
+struct sock_db *httpd_sess_get(int newfd)
+{
+	/* Sessions are only visible from the reactor serving them */
+	if (! httpd_rt)
+		return NULL;
+	struct httpd_sess_tbl *st = &httpd_rt->rt_sess;
+	if (newfd < 0 || newfd >= st->fd_slot_len)
+		return NULL;
+	int slot = st->fd_slot[newfd];
+	if (slot < 0)
+		return NULL;
+	return &st->sd[slot];
 }
 
 void *httpd_sess_get_ctx(int sockfd)
@@ -44,47 +172,83 @@ void *httpd_sess_get_ctx(int sockfd)
 		return NULL;
 }
 
-void httpd_sess_set_descriptors(fd_set *fdset, int *maxfd)
+void httpd_sess_delete(int fd)
 {
-	int i;
-	*maxfd = -1;
-	for (i = 0; i < HTTPD_MAX_OPEN_SOCKETS; i++) {
-		if (hd.hd_sd[i].fd != -1) {
-			FD_SET(hd.hd_sd[i].fd, fdset);
-/*                      httpd_d("FD_SET %d\n", hd.hd_sd[i].fd); */
-			if (hd.hd_sd[i].fd > *maxfd) {
-				*maxfd = hd.hd_sd[i].fd;
-			}
-		}
+	struct httpd_sess_tbl *st = &httpd_rt->rt_sess;
+	httpd_d("delete session %d\n", fd);
+	struct sock_db *sd = httpd_sess_get(fd);
+	if (! sd)
+		return;
+
+	httpd_poll_del(fd);
+	if (sd->job) {
+		/* The job may be running still, it is freed once it gets
+		 * back */
+		httpd_job_orphan(sd->job);
+		sd->job = NULL;
 	}
+	httpd_out_free(sd);
+	httpd_timer_del(sd);
+	httpd_sess_lru_del(sd);
+	if (sd->ctx) {
+		if (sd->free_ctx)
+			sd->free_ctx(sd->ctx);
+		else
+			free(sd->ctx);
+		sd->ctx = NULL;
+		sd->free_ctx = NULL;
+	}
+	st->fd[sd->slot] = -1;
+	st->fd_slot[fd] = -1;
+	st->free_slot[st->n_free++] = sd->slot;
 }
 
-void httpd_sess_delete(int fd)
+int httpd_sess_init(struct httpd_sess_tbl *st, int max_sess, unsigned rx_buf_size)
 {
-	httpd_d("delete session %d\n", fd);
 	int i;
-	for (i = 0; i < HTTPD_MAX_OPEN_SOCKETS; i++) {
-		if (hd.hd_sd[i].fd == fd) {
-			hd.hd_sd[i].fd = -1;
-			if (hd.hd_sd[i].ctx) {
-				if (hd.hd_sd[i].free_ctx)
-					hd.hd_sd[i].free_ctx(hd.hd_sd[i].ctx);
-				else
-					free(hd.hd_sd[i].ctx);
-				hd.hd_sd[i].ctx = NULL;
-				hd.hd_sd[i].free_ctx = NULL;
-			}
-		}
+
+	memset(st, 0, sizeof(*st));
+	st->fd = malloc(max_sess * sizeof(*st->fd));
+	st->send_fn = malloc(max_sess * sizeof(*st->send_fn));
+	st->sendv_fn = malloc(max_sess * sizeof(*st->sendv_fn));
+	st->recv_fn = malloc(max_sess * sizeof(*st->recv_fn));
+	st->sd = calloc(max_sess, sizeof(*st->sd));
+	st->free_slot = malloc(max_sess * sizeof(*st->free_slot));
+	/* One allocation for the receive buffers of all the sessions */
+	st->rx_bufs = malloc((size_t)max_sess * rx_buf_size);
+	if (! st->fd || ! st->send_fn || ! st->sendv_fn || ! st->recv_fn ||
+	    ! st->sd || ! st->free_slot || ! st->rx_bufs || httpd_sess_grow_fd_map(st, max_sess) != OS_SUCCESS) {
+		httpd_sess_deinit(st);
+		return -OS_FAIL;
+	}
+	st->max = max_sess;
+	st->rx_buf_size = rx_buf_size;
+	/* Hand out the lower slots first */
+	for (i = 0; i < max_sess; i++) {
+		st->fd[i] = -1;
+		st->free_slot[i] = max_sess - 1 - i;
 	}
+	st->n_free = max_sess;
+	st->lru_head = st->lru_tail = -1;
+	return OS_SUCCESS;
 }
 
-void httpd_sess_init()
+void httpd_sess_deinit(struct httpd_sess_tbl *st)
 {
 	int i;
-	for (i = 0; i < HTTPD_MAX_OPEN_SOCKETS; i++) {
-		hd.hd_sd[i].fd = -1;
-		hd.hd_sd[i].ctx = NULL;
-	}
+
+	for (i = 0; st->fd && i < st->max; i++)
+		if (st->fd[i] != -1)
+			httpd_out_free(&st->sd[i]);
+	free(st->fd);
+	free(st->send_fn);
+	free(st->sendv_fn);
+	free(st->recv_fn);
+	free(st->sd);
+	free(st->free_slot);
+	free(st->fd_slot);
+	free(st->rx_bufs);
+	memset(st, 0, sizeof(*st));
 }
 
 void shutdown_handle(void *arg)
@@ -93,6 +257,18 @@ void shutdown_handle(void *arg)
 	othread_delete();
 }
 
+/* Leave the socket alone till the worker pool is done with its request. That
+ * waits for the earlier responses to be out. */
+static void httpd_sess_park(struct sock_db *sd)
+{
+	if (! httpd_poll_tx_idle(httpd_sess_fd(sd))) {
+		httpd_out_drain(sd);
+		return;
+	}
+	httpd_poll_del(httpd_sess_fd(sd));
+	sd->parked = true;
+}
+
 /* This MUST return OS_SUCCESS on successful execution. If any other
  * value is returned, everything related to this socket will be
  * cleaned up and the socket will be closed.
@@ -103,51 +279,111 @@ int httpd_sess_process(int newfd)
 	if (! sd)
 		return -OS_FAIL;
 
-	if (httpd_req_new(&hd.hd_req, sd) != OS_SUCCESS)
-		return -OS_FAIL;
-	if (httpd_uri(&hd.hd_req) < 0)
-		return -OS_FAIL;
-	if (httpd_req_delete(&hd.hd_req) != OS_SUCCESS)
+	if (httpd_out_pending(sd)) {
+		/* The socket is writable. Whatever was pipelined behind the
+		 * response waits till all of it is out. */
+		if (httpd_out_flush(sd) != OS_SUCCESS)
+			return -OS_FAIL;
+		if (! httpd_out_pending(sd) && sd->job && ! sd->job->gathering &&
+		    ! sd->parked)
+			httpd_sess_park(sd);
+		if (httpd_out_pending(sd) || (sd->job && ! sd->job->gathering) ||
+		    (! sd->job && ! httpd_req_pending(sd))) {
+			httpd_sess_touch(sd);
+			return OS_SUCCESS;
+		}
+	}
+
+	if (sd->job) {
+		/* The rest of the body of a request for the worker pool. It is
+		 * left alone once it is away. */
+		int ret = sd->job->gathering ? httpd_pool_gather(sd) : -EAGAIN;
+		if (ret != OS_SUCCESS && ret != -EAGAIN)
+			return -OS_FAIL;
+		if (ret == OS_SUCCESS && ! httpd_out_pending(sd))
+			httpd_sess_park(sd);
+		httpd_sess_touch(sd);
+		return OS_SUCCESS;
+	}
+
+	/* Serve all the complete requests that were received in one go */
+	do {
+		int ret = httpd_req_recv_hdr(sd);
+		if (ret == -EAGAIN) {
+			/* Only a part of the header is in. The rest of it is
+			 * looked for when the socket is readable again. */
+			if (httpd_out_release(sd) != OS_SUCCESS)
+				return -OS_FAIL;
+			httpd_sess_touch(sd);
+			return OS_SUCCESS;
+		}
+		if (ret < 0)
+			return -OS_FAIL;
+		/* The header of the request after this one gets a deadline
+		 * of its own */
+		httpd_sess_busy(sd);
+		if (httpd_req_new(&httpd_rt->rt_req, sd) != OS_SUCCESS)
+			return -OS_FAIL;
+		/* With more than its body in, the next request has arrived
+		 * too, and this response can go out along with its one */
+		sd->out_batch = hd.hd_config.batch_size &&
+			sd->rx_tail - sd->rx_head > httpd_rt->rt_req_aux.remaining_len;
+		if (httpd_uri(&httpd_rt->rt_req) < 0)
+			return -OS_FAIL;
+		if (sd->job) {
+			/* The request went to the worker pool. Leave the
+			 * socket alone till the response is out, once the
+			 * earlier ones are, and the rest of its body is in. */
+			if (httpd_out_release(sd) != OS_SUCCESS)
+				return -OS_FAIL;
+			if (! httpd_out_pending(sd) && ! sd->job->gathering)
+				httpd_sess_park(sd);
+			httpd_sess_touch(sd);
+			return OS_SUCCESS;
+		}
+		if (httpd_req_delete(&httpd_rt->rt_req) != OS_SUCCESS)
+			return -OS_FAIL;
+	} while (! httpd_out_pending(sd) && httpd_req_pending(sd));
+	if (httpd_out_release(sd) != OS_SUCCESS)
 		return -OS_FAIL;
+	httpd_sess_touch(sd);
 	return OS_SUCCESS;
 }
 
 int httpd_sess_iterate(int start_fd)
 {
-	int start_index = 0;
-	int i;
+	struct httpd_sess_tbl *st = &httpd_rt->rt_sess;
+	int i = 0;
 
 	if (start_fd != -1) {
 		/* Take our index to where this fd is stored */
-		for (i = 0; i < HTTPD_MAX_OPEN_SOCKETS; i++) {
-			if (hd.hd_sd[i].fd == start_fd) {
-				start_index = i + 1;
-				break;
-			}
-		}
+		struct sock_db *sd = httpd_sess_get(start_fd);
+		if (sd)
+			i = sd->slot + 1;
 	}
 
-	for (i = start_index; i < HTTPD_MAX_OPEN_SOCKETS; i++) {
-		if (hd.hd_sd[i].fd != -1) {
-			return hd.hd_sd[i].fd;
-		}
+	for (; i < st->max; i++) {
+		if (st->fd[i] != -1)
+			return st->fd[i];
 	}
 	return -1;
 }
 
 static void httpd_sess_close(void *arg)
 {
-	struct sock_db *sock_db = (struct sock_db *)arg;
-	if (sock_db) {
-		int fd = sock_db->fd;
+	int fd = (intptr_t)arg;
+	/* Only the reactor serving this socket will find it */
+	if (httpd_sess_get(fd)) {
 		httpd_sess_delete(fd);
-		close(fd);
+		httpd_poll_close(fd);
 	}
 }
 
 void httpd_trigger_sess_close(int sockfd)
 {
-	struct sock_db *sock_db = httpd_sess_get(sockfd);
-	if (sock_db)
-		httpd_queue_work(httpd_sess_close, sock_db);
+	int i;
+	/* The socket could belong to any of the reactors */
+	for (i = 0; i < hd.hd_rt_cnt; i++)
+		httpd_queue_work_rt(&hd.hd_rt[i], httpd_sess_close,
+				    (void *)(intptr_t)sockfd);
 }
@@ -0,0 +1,169 @@
+/**
+ * The timeouts of the sessions, on a hashed timing wheel.
+ *
+ * Time is counted in ticks of HTTPD_TIMER_TICK_MS. A session whose timeout
+ * goes off at tick T sits in slot (T % HTTPD_TIMER_SLOTS) of the wheel, in a
+ * list that is linked through the session table. Timeouts longer than a turn
+ * of the wheel share their slot with earlier ones, and are just skipped till
+ * the wheel gets around to them.
+ *
+ * The event loop sleeps till the earliest timeout, which is tracked as a lower
+ * bound: sessions that are disarmed leave it as it is, and the server then at
+ * most wakes up for nothing, once. After the timeouts that went off, the bound
+ * moves on to the next slot that has any session in it, which a bitmap of the
+ * slots finds without looking at the sessions.
+ *
+ * Everything in here runs in the HTTPD thread.
+ */
+
+#include <httpd.h>
+
+#include "httpd_priv.h"
+
+/* Wrap around safe comparison of ticks */
+#define TICK_BEFORE(a, b)  ((int32_t)((a) - (b)) < 0)
+
+static inline uint32_t httpd_timer_tick(uint64_t ms)
+{
+	return ms / HTTPD_TIMER_TICK_MS;
+}
+
+static inline int *httpd_timer_slot(struct httpd_timers *t, uint32_t tick)
+{
+	return &t->wheel[tick & (HTTPD_TIMER_SLOTS - 1)];
+}
+
+static inline void httpd_timer_used(struct httpd_timers *t, uint32_t tick,
+				    bool used)
+{
+	unsigned i = tick & (HTTPD_TIMER_SLOTS - 1);
+	if (used)
+		t->used[i / 32] |= 1U << (i % 32);
+	else
+		t->used[i / 32] &= ~(1U << (i % 32));
+}
+
+void httpd_timer_init(struct httpd_timers *t)
+{
+	int i;
+
+	for (i = 0; i < HTTPD_TIMER_SLOTS; i++)
+		t->wheel[i] = -1;
+	memset(t->used, 0, sizeof(t->used));
+	t->now = httpd_timer_tick(otime_ms());
+	t->next = t->now;
+	t->cnt = 0;
+}
+
+void httpd_timer_del(struct sock_db *sd)
+{
+	struct httpd_timers *t = &httpd_rt->rt_timers;
+	struct sock_db *sds = httpd_rt->rt_sess.sd;
+
+	if (! sd->tm_armed)
+		return;
+	if (sd->tm_prev >= 0)
+		sds[sd->tm_prev].tm_next = sd->tm_next;
+	else if ((*httpd_timer_slot(t, sd->tm_expiry) = sd->tm_next) < 0)
+		httpd_timer_used(t, sd->tm_expiry, false);
+	if (sd->tm_next >= 0)
+		sds[sd->tm_next].tm_prev = sd->tm_prev;
+	sd->tm_armed = false;
+	t->cnt--;
+}
+
+void httpd_timer_set(struct sock_db *sd, unsigned ms)
+{
+	struct httpd_timers *t = &httpd_rt->rt_timers;
+	struct sock_db *sds = httpd_rt->rt_sess.sd;
+	int *slot;
+
+	httpd_timer_del(sd);
+	if (! ms)
+		return;
+
+	/* Rounded up, and from the end of the current tick, so that it never
+	 * goes off early */
+	sd->tm_expiry = httpd_timer_tick(otime_ms()) +
+		(ms + HTTPD_TIMER_TICK_MS - 1) / HTTPD_TIMER_TICK_MS + 1;
+	slot = httpd_timer_slot(t, sd->tm_expiry);
+	sd->tm_prev = -1;
+	sd->tm_next = *slot;
+	if (sd->tm_next >= 0)
+		sds[sd->tm_next].tm_prev = sd->slot;
+	*slot = sd->slot;
+	httpd_timer_used(t, sd->tm_expiry, true);
+	sd->tm_armed = true;
+
+	if (! t->cnt++ || TICK_BEFORE(sd->tm_expiry, t->next))
+		t->next = sd->tm_expiry;
+}
+
+int httpd_timer_next_ms(void)
+{
+	struct httpd_timers *t = &httpd_rt->rt_timers;
+	uint64_t ms;
+	int32_t ticks;
+
+	if (! t->cnt)
+		return -1;
+	ms = otime_ms();
+	ticks = t->next - httpd_timer_tick(ms);
+	if (ticks <= 0)
+		return 0;
+	return ticks * HTTPD_TIMER_TICK_MS - ms % HTTPD_TIMER_TICK_MS;
+}
+
+/* Find the next slot within the next turn of the wheel that has any session
+ * in it. Its sessions may all be a turn or more away, which only makes for a
+ * wakeup for nothing. */
+static uint32_t httpd_timer_find_next(struct httpd_timers *t)
+{
+	uint32_t end = t->now + HTTPD_TIMER_SLOTS;
+	uint32_t tick;
+	unsigned i;
+
+	for (tick = t->now + 1; TICK_BEFORE(tick, end); tick += 32 - i % 32) {
+		i = tick & (HTTPD_TIMER_SLOTS - 1);
+		uint32_t bits = t->used[i / 32] >> (i % 32);
+		if (bits)
+			return tick + __builtin_ctz(bits);
+	}
+	return end;
+}
+
+void httpd_timer_expire(void)
+{
+	struct httpd_timers *t = &httpd_rt->rt_timers;
+	struct sock_db *sds = httpd_rt->rt_sess.sd;
+	uint32_t now = httpd_timer_tick(otime_ms());
+	uint32_t tick = t->now;
+	int i, n;
+
+	/* Nothing goes off before t->next, so the slots up to that can be
+	 * skipped */
+	if (! t->cnt || TICK_BEFORE(now, t->next)) {
+		t->now = now;
+		return;
+	}
+	if (TICK_BEFORE(tick, t->next - 1))
+		tick = t->next - 1;
+
+	/* A slot is looked at just once, even if the wheel went around more
+	 * than that since the last time */
+	for (n = 0; tick != now && n < HTTPD_TIMER_SLOTS; n++) {
+		tick++;
+		i = *httpd_timer_slot(t, tick);
+		while (i >= 0) {
+			struct sock_db *sd = &sds[i];
+			i = sd->tm_next;
+			if (! TICK_BEFORE(now, sd->tm_expiry)) {
+				httpd_timer_del(sd);
+				httpd_sess_expire(sd);
+			}
+		}
+	}
+	t->now = now;
+	if (t->cnt)
+		t->next = httpd_timer_find_next(t);
+}
@@ -1,4 +1,6 @@
 #include <errno.h>
+#include <poll.h>
+#include <unistd.h>
 #include <httpd.h>
 
 #include "httpd_priv.h"
@@ -6,27 +8,113 @@
 int httpd_set_send_override(httpd_req_t *r, httpd_send_func_t send_func)
 {
 	struct httpd_req_aux *ra = r->aux;
-	ra->sd->send_fn = send_func;
+	/* The default vectored send would bypass this */
+	if (ra->job) {
+		ra->job->send_fn = send_func;
+		ra->job->sendv_fn = NULL;
+	} else {
+		httpd_rt->rt_sess.send_fn[ra->sd->slot] = send_func;
+		httpd_rt->rt_sess.sendv_fn[ra->sd->slot] = NULL;
+	}
+	return OS_SUCCESS;
+}
+
+int httpd_set_sendv_override(httpd_req_t *r, httpd_sendv_func_t sendv_func)
+{
+	struct httpd_req_aux *ra = r->aux;
+	if (ra->job)
+		ra->job->sendv_fn = sendv_func;
+	else
+		httpd_rt->rt_sess.sendv_fn[ra->sd->slot] = sendv_func;
 	return OS_SUCCESS;
 }
 
 int httpd_set_recv_override(httpd_req_t *r, httpd_recv_func_t recv_func)
 {
 	struct httpd_req_aux *ra = r->aux;
-	ra->sd->recv_fn = recv_func;
+	if (ra->job)
+		ra->job->recv_fn = recv_func;
+	else
+		httpd_rt->rt_sess.recv_fn[ra->sd->slot] = recv_func;
 	return OS_SUCCESS;
 }
 
 int httpd_send(httpd_req_t *r, const char *buf, unsigned buf_len)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = buf_len };
+	return httpd_sendv(r, &iov, 1);
+}
+
+int httpd_sendv_static(httpd_req_t *r, struct iovec *iov, int iovcnt, int static_from)
 {
 	struct httpd_req_aux *ra = r->aux;
-	return ra->sd->send_fn(ra->sd->fd, buf, buf_len, 0);
+	int i, ret;
+
+	if (ra->job) {
+		for (i = 0; i < iovcnt; i++) {
+			ret = httpd_job_send(ra->job, iov[i].iov_base, iov[i].iov_len);
+			if (ret < 0)
+				return ret;
+		}
+		return OS_SUCCESS;
+	}
+	return httpd_out_sendv(ra->sd, iov, iovcnt, static_from);
+}
+
+int httpd_sendv(httpd_req_t *r, struct iovec *iov, int iovcnt)
+{
+	return httpd_sendv_static(r, iov, iovcnt, iovcnt);
+}
+
+/* The rest of a body that is read by the handler, which has nothing else to
+ * do till it arrives, or till the body's deadline */
+static int httpd_recv_wait(struct httpd_req_aux *ra, int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int ret;
+
+	do {
+		int timeout = -1;
+		if (ra->body_by) {
+			uint64_t now = otime_ms();
+			timeout = now < ra->body_by ? (int)(ra->body_by - now) : 0;
+		}
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+	if (ret == 0)
+		httpd_d("Timed out waiting for the body\n");
+	return ret > 0 ? OS_SUCCESS : -OS_FAIL;
 }
 
 int httpd_recv(httpd_req_t *r, char *buf, unsigned buf_len)
 {
 	struct httpd_req_aux *ra = r->aux;
-	int ret = ra->sd->recv_fn(ra->sd->fd, buf, buf_len, 0);
+	struct sock_db *sd = ra->sd;
+
+	if (ra->job)
+		return httpd_job_recv(ra->job, buf, buf_len);
+
+	/* Hand out any data that was buffered while reading the header */
+	unsigned buffered = sd->rx_tail - sd->rx_head;
+	if (buffered) {
+		if (buf_len > buffered)
+			buf_len = buffered;
+		memcpy(buf, sd->rx_buf + sd->rx_head, buf_len);
+		sd->rx_head += buf_len;
+		return buf_len;
+	}
+
+	httpd_recv_func_t recv_fn = httpd_sess_recv_fn(sd);
+	int ret;
+	do {
+		errno = 0;
+		ret = recv_fn(httpd_sess_fd(sd), buf, buf_len, 0);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (httpd_recv_wait(ra, httpd_sess_fd(sd)) != OS_SUCCESS)
+				return -OS_FAIL;
+			errno = EINTR;
+		}
+	} while (ret < 0 && errno == EINTR);
 	if (ret == 0)
 		ret = -ECONNRESET;
 	return ret;
@@ -35,17 +123,257 @@ int httpd_recv(httpd_req_t *r, char *buf, unsigned buf_len)
 
 #define HTTPD_HDR_STR      "HTTP/1.1 %s\r\n"                   \
                            "Content-Type: %s\r\n"              \
-                           "Content-Length: %d\r\n"
+                           "Content-Length: %lu\r\n"
+#define HTTPD_CHUNK_HDR_STR "HTTP/1.1 %s\r\n"                  \
+                           "Content-Type: %s\r\n"              \
+                           "Transfer-Encoding: chunked\r\n"
+/* Status line, 4 for each additional header, header end */
+#define HTTPD_HDR_IOVS     (1 + 4 * HTTPD_MAX_RESP_HDRS + 1)
+
+/* Put the status line and the content headers of the response together in the
+ * arena, for a body of len bytes, or a chunked one if len is negative */
+static int httpd_resp_status_line(struct httpd_req_aux *ra, long len)
+{
+	/* The chunked one is the longer, plus room for the digits of len */
+	size_t size = sizeof(HTTPD_CHUNK_HDR_STR) + strlen(ra->status) +
+		strlen(ra->content_type) + 20;
+	char *line = httpd_arena_alloc(ra->arena, size);
+	if (! line)
+		return -ENOMEM;
+	if (len >= 0)
+		ra->status_line_len = snprintf(line, size, HTTPD_HDR_STR, ra->status,
+					       ra->content_type, (unsigned long)len);
+	else
+		ra->status_line_len = snprintf(line, size, HTTPD_CHUNK_HDR_STR,
+					       ra->status, ra->content_type);
+	ra->status_line = line;
+	return OS_SUCCESS;
+}
+
+/* Fill in the response header, the status line is expected to be put
+ * together already */
+static int httpd_resp_hdr_iov(struct httpd_req_aux *ra, struct iovec *iov)
+{
+	unsigned i;
+	int n = 0;
+
+	iov[n].iov_base = ra->status_line;
+	iov[n++].iov_len = ra->status_line_len;
+	for (i = 0; i < ra->resp_hdrs_cnt; i++) {
+		iov[n].iov_base = (void *)ra->resp_hdrs[i].field;
+		iov[n++].iov_len = strlen(ra->resp_hdrs[i].field);
+		iov[n].iov_base = ": ";
+		iov[n++].iov_len = 2;
+		iov[n].iov_base = (void *)ra->resp_hdrs[i].value;
+		iov[n++].iov_len = strlen(ra->resp_hdrs[i].value);
+		iov[n].iov_base = "\r\n";
+		iov[n++].iov_len = 2;
+	}
+	iov[n].iov_base = "\r\n";
+	iov[n++].iov_len = 2;
+	return n;
+}
+
 int httpd_resp_send(httpd_req_t *r, const char *buf, unsigned buf_len)
 {
 	struct httpd_req_aux *ra = r->aux;
-	snprintf(ra->scratch, sizeof(ra->scratch), HTTPD_HDR_STR,
-		 ra->status, ra->content_type, buf_len);
-	httpd_send(r, ra->scratch, strlen(ra->scratch));
-	/* Space for sending additional headers based on set_header */
-	httpd_send(r, "\r\n", strlen("\r\n"));
-	if (buf && buf_len)
-	     httpd_send(r, buf, buf_len);
+	struct iovec iov[HTTPD_HDR_IOVS + 1];
+
+	if (httpd_resp_status_line(ra, buf_len) != OS_SUCCESS)
+		return -ENOMEM;
+	int n = httpd_resp_hdr_iov(ra, iov);
+	if (buf && buf_len) {
+		iov[n].iov_base = (void *)buf;
+		iov[n++].iov_len = buf_len;
+	}
+	return httpd_sendv(r, iov, n);
+}
+
+int httpd_resp_send_static(httpd_req_t *r, const char *buf, unsigned buf_len)
+{
+	struct httpd_req_aux *ra = r->aux;
+	struct iovec iov[HTTPD_HDR_IOVS + 1];
+
+	if (httpd_resp_status_line(ra, buf_len) != OS_SUCCESS)
+		return -ENOMEM;
+	int n = httpd_resp_hdr_iov(ra, iov);
+	if (buf && buf_len) {
+		iov[n].iov_base = (void *)buf;
+		iov[n++].iov_len = buf_len;
+	}
+	return httpd_sendv_static(r, iov, n, buf && buf_len ? n - 1 : n);
+}
+
+int httpd_resp_send_file(httpd_req_t *r, int fd, off_t offset, size_t len)
+{
+	struct httpd_req_aux *ra = r->aux;
+	struct iovec iov[HTTPD_HDR_IOVS];
+
+	if (httpd_resp_status_line(ra, len) != OS_SUCCESS)
+		return -ENOMEM;
+	int n = httpd_resp_hdr_iov(ra, iov);
+	int ret = httpd_sendv(r, iov, n);
+	if (ret != OS_SUCCESS)
+		return ret;
+
+	if (! ra->job)
+		return httpd_out_file(ra->sd, fd, offset, len);
+	/* The data has to go into the worker's response, so read it in. The
+	 * chunk buffer is unused for a response like this. */
+	while (len) {
+		size_t to_read = len < sizeof(ra->chunk_buf) ? len : sizeof(ra->chunk_buf);
+		ssize_t rd = pread(fd, ra->chunk_buf, to_read, offset);
+		if (rd < 0 && errno == EINTR)
+			continue;
+		if (rd <= 0)
+			return -OS_FAIL;
+		struct iovec data = { .iov_base = ra->chunk_buf, .iov_len = rd };
+		if (httpd_sendv(r, &data, 1) != OS_SUCCESS)
+			return -OS_FAIL;
+		offset += rd;
+		len -= rd;
+	}
+	return OS_SUCCESS;
+}
+
+/* Send out the buffered chunk, followed by the data in buf as a chunk of its
+ * own. The header goes along with the first chunk, and the last-chunk marker
+ * with the last one. */
+static int httpd_resp_flush_chunks(httpd_req_t *r, const char *buf,
+				   unsigned buf_len, bool last)
+{
+	struct httpd_req_aux *ra = r->aux;
+	struct iovec iov[HTTPD_HDR_IOVS + 7];
+	char size_buf[2][12];
+	int n = 0;
+
+	if (! ra->resp_hdrs_sent) {
+		if (httpd_resp_status_line(ra, -1) != OS_SUCCESS)
+			return -ENOMEM;
+		n = httpd_resp_hdr_iov(ra, iov);
+	}
+	if (ra->chunk_len) {
+		snprintf(size_buf[0], sizeof(size_buf[0]), "%x\r\n", ra->chunk_len);
+		iov[n].iov_base = size_buf[0];
+		iov[n++].iov_len = strlen(size_buf[0]);
+		iov[n].iov_base = ra->chunk_buf;
+		iov[n++].iov_len = ra->chunk_len;
+		iov[n].iov_base = "\r\n";
+		iov[n++].iov_len = 2;
+	}
+	if (buf_len) {
+		snprintf(size_buf[1], sizeof(size_buf[1]), "%x\r\n", buf_len);
+		iov[n].iov_base = size_buf[1];
+		iov[n++].iov_len = strlen(size_buf[1]);
+		iov[n].iov_base = (void *)buf;
+		iov[n++].iov_len = buf_len;
+		iov[n].iov_base = "\r\n";
+		iov[n++].iov_len = 2;
+	}
+	if (last) {
+		iov[n].iov_base = "0\r\n\r\n";
+		iov[n++].iov_len = 5;
+	}
+	if (! n)
+		return OS_SUCCESS;
+
+	ra->resp_hdrs_sent = true;
+	ra->chunk_len = 0;
+	return httpd_sendv(r, iov, n);
+}
+
+int httpd_resp_send_chunk(httpd_req_t *r, const char *buf, unsigned buf_len)
+{
+	struct httpd_req_aux *ra = r->aux;
+
+	if (! buf || ! buf_len)
+		return httpd_resp_flush_chunks(r, NULL, 0, true);
+
+	if (ra->chunk_len + buf_len > sizeof(ra->chunk_buf)) {
+		/* Anything that wouldn't fit in an empty buffer either, goes
+		 * out as it is */
+		if (buf_len >= sizeof(ra->chunk_buf))
+			return httpd_resp_flush_chunks(r, buf, buf_len, false);
+		int ret = httpd_resp_flush_chunks(r, NULL, 0, false);
+		if (ret != OS_SUCCESS)
+			return ret;
+	}
+	memcpy(ra->chunk_buf + ra->chunk_len, buf, buf_len);
+	ra->chunk_len += buf_len;
+	if (ra->chunk_len == sizeof(ra->chunk_buf))
+		return httpd_resp_flush_chunks(r, NULL, 0, false);
+	return OS_SUCCESS;
+}
+
+int httpd_resp_send_provider(httpd_req_t *r, long len, httpd_body_provider_t provider,
+			     httpd_free_provider_ctx_fn_t free_ctx, void *ctx)
+{
+	struct httpd_req_aux *ra = r->aux;
+	struct iovec iov[HTTPD_HDR_IOVS];
+	int n, ret;
+
+	ret = httpd_resp_status_line(ra, len);
+	if (ret == OS_SUCCESS) {
+		n = httpd_resp_hdr_iov(ra, iov);
+		ret = httpd_sendv(r, iov, n);
+	}
+	if (ret != OS_SUCCESS) {
+		if (free_ctx)
+			free_ctx(ctx);
+		return ret;
+	}
+	if (! ra->job)
+		return httpd_out_provider(ra->sd, len, provider, free_ctx, ctx);
+
+	/* A worker's response is sent all at once, so the body is produced
+	 * upfront, with the chunk buffer to hold the pieces */
+	ra->resp_hdrs_sent = true;
+	for (;;) {
+		unsigned want = sizeof(ra->chunk_buf);
+		if (len >= 0 && (unsigned long)len < want)
+			want = len;
+		ret = want ? provider(ctx, ra->chunk_buf, want) : 0;
+		if (ret < 0 || (unsigned)ret > want || (! ret && len > 0)) {
+			ret = -OS_FAIL;
+			break;
+		}
+		if (len < 0) {
+			char size[12];
+			snprintf(size, sizeof(size), "%x\r\n", ret);
+			struct iovec chunk[3] = {
+				{ .iov_base = size, .iov_len = strlen(size) },
+				{ .iov_base = ra->chunk_buf, .iov_len = ret },
+				{ .iov_base = "\r\n", .iov_len = 2 },
+			};
+			if (! ret) {
+				chunk[0].iov_base = "0\r\n\r\n";
+				chunk[0].iov_len = 5;
+			}
+			ret = httpd_sendv(r, chunk, chunk[1].iov_len ? 3 : 1);
+			if (ret != OS_SUCCESS || chunk[0].iov_len == 5)
+				break;
+			continue;
+		}
+		if (! ret)
+			break;
+		len -= ret;
+		ret = httpd_send(r, ra->chunk_buf, ret);
+		if (ret != OS_SUCCESS)
+			break;
+	}
+	if (free_ctx)
+		free_ctx(ctx);
+	return ret;
+}
+
+int httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value)
+{
+	struct httpd_req_aux *ra = r->aux;
+	if (ra->resp_hdrs_cnt == HTTPD_MAX_RESP_HDRS)
+		return -ENOSPC;
+	ra->resp_hdrs[ra->resp_hdrs_cnt].field = field;
+	ra->resp_hdrs[ra->resp_hdrs_cnt].value = value;
+	ra->resp_hdrs_cnt++;
 	return OS_SUCCESS;
 }
 
@@ -81,12 +409,31 @@ int httpd_req_recv(httpd_req_t *r, char *buf, unsigned buf_len)
 int httpd_req_to_sockfd(httpd_req_t *r)
 {
 	struct httpd_req_aux *ra = r->aux;
-	return ra->sd->fd;
+	if (ra->job)
+		return ra->job->fd;
+	return httpd_sess_fd(ra->sd);
 }
 
 int __httpd_send(int sockfd, const char *buf, unsigned buf_len, int flags)
 {
+#ifdef OS_HAVE_IO_URING
+	return httpd_uring_send(sockfd, buf, buf_len, flags);
+#else
 	return send(sockfd, buf, buf_len, flags);
+#endif
+}
+
+int __httpd_sendv(int sockfd, const struct iovec *iov, int iovcnt, int flags)
+{
+#ifdef OS_HAVE_IO_URING
+	return httpd_uring_sendv(sockfd, iov, iovcnt, flags);
+#else
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+	return sendmsg(sockfd, &msg, flags);
+#endif
 }
 
 int __httpd_recv(int sockfd, char *buf, unsigned buf_len, int flags)
@@ -1,4 +1,6 @@
 #include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
 
 #include <httpd.h>
 
@@ -7,42 +9,465 @@
 #define httpd_uri_d(...) 
 // #define httpd_uri_d httpd_d
 
+/* The URI handlers are looked up in a radix tree. Each node has a label, a
+ * literal piece of the URIs that it leads to, and is keyed in its parent by
+ * the first character of that. A '{param}' is a child of its own, that matches
+ * up to the next '/'. A node has the handler whose URI ends there, if any.
+ */
+struct httpd_route {
+	/* Children that begin with a literal, and their first characters */
+	struct httpd_route **kids;
+	char                *kid_chars;
+	unsigned             kids_cnt;
+	/* The child that is a parameter */
+	struct httpd_route  *param;
+	struct httpd_uri    *uri;
+	unsigned             label_len;
+	char                 label[];
+};
+
+static struct httpd_route *httpd_route_new(const char *label, unsigned len)
+{
+	struct httpd_route *n = calloc(1, sizeof(*n) + len);
+	if (! n)
+		return NULL;
+	memcpy(n->label, label, len);
+	n->label_len = len;
+	return n;
+}
+
+static void httpd_route_free(struct httpd_route *n)
+{
+	unsigned i;
+
+	if (! n)
+		return;
+	for (i = 0; i < n->kids_cnt; i++)
+		httpd_route_free(n->kids[i]);
+	httpd_route_free(n->param);
+	free(n->kids);
+	free(n->kid_chars);
+	free(n);
+}
+
+static int httpd_route_add_kid(struct httpd_route *n, struct httpd_route *kid)
+{
+	struct httpd_route **kids = realloc(n->kids, (n->kids_cnt + 1) * sizeof(*kids));
+	if (! kids)
+		return -ENOMEM;
+	n->kids = kids;
+	char *kid_chars = realloc(n->kid_chars, n->kids_cnt + 1);
+	if (! kid_chars)
+		return -ENOMEM;
+	n->kid_chars = kid_chars;
+	n->kids[n->kids_cnt] = kid;
+	n->kid_chars[n->kids_cnt] = kid->label[0];
+	n->kids_cnt++;
+	return OS_SUCCESS;
+}
+
+static inline struct httpd_route *httpd_route_kid(const struct httpd_route *n, char c,
+						  unsigned *idx)
+{
+	const char *k = n->kids_cnt ? memchr(n->kid_chars, c, n->kids_cnt) : NULL;
+	if (! k)
+		return NULL;
+	*idx = k - n->kid_chars;
+	return n->kids[*idx];
+}
+
+static int httpd_route_insert(struct httpd_route *n, struct httpd_uri *uri)
+{
+	const char *s = uri->uri;
+	struct httpd_route *kid;
+	unsigned i, len, common;
+
+	while (*s) {
+		if (*s == '{') {
+			if (! n->param) {
+				n->param = httpd_route_new("", 0);
+				if (! n->param)
+					return -ENOMEM;
+			}
+			n = n->param;
+			s = strchr(s, '}') + 1;
+			continue;
+		}
+
+		len = strcspn(s, "{");
+		kid = httpd_route_kid(n, *s, &i);
+		if (! kid) {
+			kid = httpd_route_new(s, len);
+			if (! kid)
+				return -ENOMEM;
+			if (httpd_route_add_kid(n, kid) != OS_SUCCESS) {
+				free(kid);
+				return -ENOMEM;
+			}
+			n = kid;
+			s += len;
+			continue;
+		}
+
+		for (common = 0; common < len && common < kid->label_len &&
+			     s[common] == kid->label[common]; common++)
+			;
+		if (common < kid->label_len) {
+			/* Split the child where we part ways */
+			struct httpd_route *mid = httpd_route_new(kid->label, common);
+			if (! mid)
+				return -ENOMEM;
+			if (httpd_route_add_kid(mid, kid) != OS_SUCCESS) {
+				httpd_route_free(mid);
+				return -ENOMEM;
+			}
+			kid->label_len -= common;
+			memmove(kid->label, kid->label + common, kid->label_len);
+			mid->kid_chars[0] = kid->label[0];
+			n->kids[i] = mid;
+			kid = mid;
+		}
+		n = kid;
+		s += common;
+	}
+
+	/* The first one registered wins, as it always has */
+	if (! n->uri)
+		n->uri = uri;
+	return OS_SUCCESS;
+}
+
+/* A snapshot of the registered URI handlers. It isn't changed once it is
+ * published, changes make a new one. */
+struct httpd_route_tbl {
+	struct httpd_route *tree;
+	unsigned            n_calls;
+	struct httpd_uri   *calls[];
+};
+
+/* The limit on the handlers, till the web server is started with its own */
+static unsigned httpd_uri_max(void)
+{
+	return hd.hd_config.max_uri_handlers ? hd.hd_config.max_uri_handlers :
+		HTTPD_MAX_URI_HANDLERS;
+}
+
+static OS_THREAD_LOCAL struct httpd_reader httpd_reader;
+
+static void httpd_routes_enter(void)
+{
+	/* Any snapshot that we go on to see is at least as new as this */
+	__atomic_store_n(&httpd_reader.epoch,
+			 __atomic_load_n(&hd.hd_routes_epoch, __ATOMIC_SEQ_CST) + 1,
+			 __ATOMIC_SEQ_CST);
+}
+
+static void httpd_routes_exit(void)
+{
+	__atomic_store_n(&httpd_reader.epoch, 0, __ATOMIC_RELEASE);
+}
+
+static inline struct httpd_route_tbl *httpd_routes_get(void)
+{
+	return __atomic_load_n(&hd.hd_routes, __ATOMIC_SEQ_CST);
+}
+
+/* Held by whoever is changing the URI handlers. The handlers can be
+ * registered before the web server is started, and after it is stopped, so
+ * this is set up by the first one to take it, and kept for good. */
+static omutex_t httpd_routes_mutex;
+static int httpd_routes_mutex_state;
+enum { HTTPD_LOCK_NONE, HTTPD_LOCK_INIT, HTTPD_LOCK_READY };
+
+static int httpd_routes_lock(void)
+{
+	int state = HTTPD_LOCK_NONE;
+
+	if (__atomic_compare_exchange_n(&httpd_routes_mutex_state, &state,
+					HTTPD_LOCK_INIT, false, __ATOMIC_ACQUIRE,
+					__ATOMIC_ACQUIRE)) {
+		if (omutex_init(&httpd_routes_mutex) != OS_SUCCESS) {
+			__atomic_store_n(&httpd_routes_mutex_state,
+					 HTTPD_LOCK_NONE, __ATOMIC_RELEASE);
+			return -ENOMEM;
+		}
+		__atomic_store_n(&httpd_routes_mutex_state, HTTPD_LOCK_READY,
+				 __ATOMIC_RELEASE);
+	}
+	/* Only ever waits for another thread that is setting it up */
+	while (__atomic_load_n(&httpd_routes_mutex_state, __ATOMIC_ACQUIRE) !=
+	       HTTPD_LOCK_READY) {
+		if (__atomic_load_n(&httpd_routes_mutex_state, __ATOMIC_ACQUIRE) ==
+		    HTTPD_LOCK_NONE)
+			return -ENOMEM;
+		othread_sleep(1);
+	}
+	omutex_lock(&httpd_routes_mutex);
+	return OS_SUCCESS;
+}
+
+static void httpd_routes_unlock(void)
+{
+	omutex_unlock(&httpd_routes_mutex);
+}
+
+/* httpd_start() has set up the lock already, by httpd_uri_init() */
+void httpd_reader_add(void)
+{
+	(void) httpd_routes_lock();
+	httpd_reader.epoch = 0;
+	httpd_reader.next = hd.hd_readers;
+	hd.hd_readers = &httpd_reader;
+	httpd_routes_unlock();
+}
+
+void httpd_reader_del(void)
+{
+	struct httpd_reader **r;
+
+	(void) httpd_routes_lock();
+	for (r = &hd.hd_readers; *r; r = &(*r)->next) {
+		if (*r == &httpd_reader) {
+			*r = httpd_reader.next;
+			break;
+		}
+	}
+	httpd_routes_unlock();
+}
+
+/* Wait for every reader that may have seen the snapshot before the current
+ * one. Called with the lock held. */
+static void httpd_routes_sync(void)
+{
+	unsigned long epoch = __atomic_add_fetch(&hd.hd_routes_epoch, 1,
+						 __ATOMIC_SEQ_CST);
+	struct httpd_reader *r;
+	unsigned long e;
+
+	for (r = hd.hd_readers; r; r = r->next) {
+		/* A handler that is changing the handlers can't wait for
+		 * itself */
+		if (r == &httpd_reader)
+			continue;
+		while ((e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST)) &&
+		       e <= epoch)
+			othread_sleep(1);
+	}
+}
+
+static void httpd_route_tbl_free(struct httpd_route_tbl *t)
+{
+	if (! t)
+		return;
+	httpd_route_free(t->tree);
+	free(t);
+}
+
+/* A new snapshot, with room for n handlers, for those to be filled in */
+static struct httpd_route_tbl *httpd_route_tbl_new(unsigned n)
+{
+	struct httpd_route_tbl *t = calloc(1, sizeof(*t) + n * sizeof(t->calls[0]));
+	if (t)
+		t->n_calls = n;
+	return t;
+}
+
+/* Build the tree of the new snapshot t, and publish it in place of the
+ * current one. t is freed on errors. Called with the lock held. */
+static int httpd_routes_publish(struct httpd_route_tbl *t)
+{
+	struct httpd_route_tbl *old = httpd_routes_get();
+	unsigned j, n = t->n_calls;
+	int ret = OS_SUCCESS;
+
+	/* Of identical URIs, the first registered one wins */
+	t->tree = httpd_route_new("", 0);
+	if (! t->tree)
+		ret = -ENOMEM;
+	for (j = 0; j < n && ret == OS_SUCCESS; j++)
+		if (t->calls[j])
+			ret = httpd_route_insert(t->tree, t->calls[j]);
+	if (ret != OS_SUCCESS) {
+		httpd_route_tbl_free(t);
+		return ret;
+	}
+
+	__atomic_store_n(&hd.hd_routes, t, __ATOMIC_SEQ_CST);
+	httpd_routes_sync();
+	httpd_route_tbl_free(old);
+	return OS_SUCCESS;
+}
+
+/* Publish a copy of the current snapshot, with calls[i] set to handle */
+static int httpd_routes_update(unsigned i, struct httpd_uri *handle)
+{
+	struct httpd_route_tbl *old = httpd_routes_get();
+	struct httpd_route_tbl *t = httpd_route_tbl_new(old ? old->n_calls :
+							httpd_uri_max());
+
+	if (! t)
+		return -ENOMEM;
+	if (old)
+		memcpy(t->calls, old->calls, t->n_calls * sizeof(t->calls[0]));
+	t->calls[i] = handle;
+	return httpd_routes_publish(t);
+}
+
+int httpd_uri_init(unsigned max)
+{
+	struct httpd_route_tbl *old, *t;
+	unsigned i, n = 0;
+	int ret = httpd_routes_lock();
+
+	if (ret != OS_SUCCESS)
+		return ret;
+	old = httpd_routes_get();
+	if (old && old->n_calls != max) {
+		t = httpd_route_tbl_new(max);
+		if (! t)
+			ret = -ENOMEM;
+		/* In the same order, which decides between identical URIs */
+		for (i = 0; t && i < old->n_calls && ret == OS_SUCCESS; i++) {
+			if (! old->calls[i])
+				continue;
+			if (n == max)
+				ret = -ENOSPC;
+			else
+				t->calls[n++] = old->calls[i];
+		}
+		if (ret == OS_SUCCESS)
+			ret = httpd_routes_publish(t);
+		else
+			free(t);
+	}
+	httpd_routes_unlock();
+	return ret;
+}
+
+void httpd_uri_deinit(void)
+{
+	httpd_route_tbl_free(hd.hd_routes);
+	hd.hd_routes = NULL;
+}
+
+static bool httpd_uri_valid(const char *uri)
+{
+	while ((uri = strchr(uri, '{')) != NULL) {
+		uri = strchr(uri, '}');
+		if (! uri)
+			return false;
+	}
+	return true;
+}
+
 int httpd_register_uri_handler(struct httpd_uri *handle)
 {
-	int i;
-	for (i = 0; i < HTTPD_MAX_URI_HANDLERS; i++) {
+	struct httpd_route_tbl *t;
+	unsigned long epoch = httpd_reader.epoch;
+	unsigned i, n;
+	int ret = -ENOSPC;
+
+	if (! httpd_uri_valid(handle->uri))
+		return -EINVAL;
+	/* A handler may be calling this, it isn't using the snapshot
+	 * anymore */
+	httpd_routes_exit();
+	if (httpd_routes_lock() != OS_SUCCESS) {
+		__atomic_store_n(&httpd_reader.epoch, epoch, __ATOMIC_SEQ_CST);
+		return -ENOMEM;
+	}
+	t = httpd_routes_get();
+	n = t ? t->n_calls : httpd_uri_max();
+	for (i = 0; i < n; i++) {
 		httpd_uri_d("[%d]", i);
-		if (hd.hd_calls[i] == NULL) {
+		if (! t || t->calls[i] == NULL) {
 			httpd_uri_d ("installed\n");
-			hd.hd_calls[i] = handle;
-			return OS_SUCCESS;
+			ret = httpd_routes_update(i, handle);
+			break;
 		}
-		httpd_uri_d("exists %s\n", hd.hd_calls[i]->uri);
+		httpd_uri_d("exists %s\n", t->calls[i]->uri);
 	}
-	return -ENOSPC;
+	httpd_routes_unlock();
+	__atomic_store_n(&httpd_reader.epoch, epoch, __ATOMIC_SEQ_CST);
+	return ret;
 }
 
 int httpd_unregister_uri_handler(struct httpd_uri *handle)
 {
-	int i;
-	for (i = 0; i < HTTPD_MAX_URI_HANDLERS; i++) {
-		if (hd.hd_calls[i] == handle) {
-			hd.hd_calls[i] = NULL;
-			return OS_SUCCESS;
+	struct httpd_route_tbl *t;
+	unsigned long epoch = httpd_reader.epoch;
+	unsigned i;
+	int ret = -EINVAL;
+
+	httpd_routes_exit();
+	if (httpd_routes_lock() != OS_SUCCESS) {
+		__atomic_store_n(&httpd_reader.epoch, epoch, __ATOMIC_SEQ_CST);
+		return -ENOMEM;
+	}
+	t = httpd_routes_get();
+	for (i = 0; t && i < t->n_calls; i++) {
+		if (t->calls[i] == handle) {
+			/* Once this returns, the handler isn't running on any
+			 * of the reactors and workers (other than ours) */
+			ret = httpd_routes_update(i, NULL);
+			break;
 		}
 	}
-	return -EINVAL;
+	httpd_routes_unlock();
+	__atomic_store_n(&httpd_reader.epoch, epoch, __ATOMIC_SEQ_CST);
+	return ret;
 }
 
-static int get_match_len(const char *s1, const char *s2)
+void httpd_set_route_lookup(httpd_route_lookup_t lookup)
 {
-	int cnt = 0;
-	while (*s1 && (*s1 == *s2)) {
-		s1++;
-		s2++;
-		cnt++;
+	__atomic_store_n(&hd.hd_route_lookup, lookup, __ATOMIC_SEQ_CST);
+}
+
+struct httpd_route_match {
+	const struct httpd_uri *uri;
+	size_t                  len;
+	unsigned                params_cnt;
+	struct {
+		uint16_t off;
+		uint16_t len;
+	}                       params[HTTPD_MAX_URI_PARAMS];
+};
+
+/* The node's label has matched path up to pos. The literal children are tried
+ * before the parameter, and the longest match of all is kept. */
+static void httpd_route_lookup(const struct httpd_route *n, const char *path,
+			       size_t len, size_t pos,
+			       struct httpd_route_match *cur,
+			       struct httpd_route_match *best)
+{
+	const struct httpd_route *kid;
+	unsigned i, cnt = cur->params_cnt;
+	size_t end;
+
+	if (n->uri && pos > best->len) {
+		*best = *cur;
+		best->uri = n->uri;
+		best->len = pos;
+	}
+	if (pos == len)
+		return;
+
+	kid = httpd_route_kid(n, path[pos], &i);
+	if (kid && kid->label_len <= len - pos &&
+	    memcmp(kid->label, path + pos, kid->label_len) == 0)
+		httpd_route_lookup(kid, path, len, pos + kid->label_len, cur, best);
+
+	if (n->param && path[pos] != '/') {
+		for (end = pos; end < len && path[end] != '/'; end++)
+			;
+		if (cnt < HTTPD_MAX_URI_PARAMS) {
+			cur->params[cnt].off = pos;
+			cur->params[cnt].len = end - pos;
+			cur->params_cnt = cnt + 1;
+		}
+		httpd_route_lookup(n->param, path, len, end, cur, best);
+		cur->params_cnt = cnt;
 	}
-	return cnt;
 }
 
 typedef int (*httpd_uri_handler_t)(httpd_req_t *r);
@@ -52,53 +477,119 @@ typedef int (*httpd_uri_handler_t)(httpd_req_t *r);
  * starting with 'http://', take care of that right at the time of
  * header parsing
  */
-static httpd_uri_handler_t httpd_find_handler(httpd_req_t *req)
-{
-	int i, cur_match = -1, cur_match_len = 0;
-	for (i = 0; i < HTTPD_MAX_URI_HANDLERS; i++) {
-		if (hd.hd_calls[i]) {
-			httpd_uri_d("hdlr [%d] = %s\n", i, hd.hd_calls[i]->uri);
-			int tmp = get_match_len(hd.hd_calls[i]->uri, req->uri);
-			if (tmp > cur_match_len &&
-			    (unsigned )tmp == strlen(hd.hd_calls[i]->uri)) {
-				cur_match_len = tmp;
-				cur_match = i;
-			}
-		}
+static httpd_uri_handler_t httpd_find_handler(httpd_req_t *req,
+					      struct httpd_uri **uri)
+{
+	struct httpd_req_aux *ra = req->aux;
+	struct httpd_route_match cur, best;
+	httpd_route_lookup_t lookup = __atomic_load_n(&hd.hd_route_lookup,
+						      __ATOMIC_ACQUIRE);
+	struct httpd_route_tbl *t = httpd_routes_get();
+	/* The query string has no say in the matter */
+	size_t len = strcspn(req->uri, "?");
+
+	memset(&best, 0, sizeof(best));
+	if (lookup)
+		best.uri = lookup(req->uri, len, req->type);
+	if (! best.uri && t) {
+		memset(&cur, 0, sizeof(cur));
+		httpd_route_lookup(t->tree, req->uri, len, 0, &cur, &best);
 	}
-	if (cur_match == -1)
+	if (! best.uri)
 		return NULL;
 
+	httpd_uri_d("hdlr %s\n", best.uri->uri);
+	ra->route = best.uri;
+	ra->uri_params_cnt = best.params_cnt;
+	memcpy(ra->uri_params, best.params, sizeof(best.params));
+
+	*uri = (struct httpd_uri *)best.uri;
 	switch (req->type) {
 	case HTTPD_RQTYPE_GET:
-		return hd.hd_calls[cur_match]->get;
+		return best.uri->get;
 		break;
 	case HTTPD_RQTYPE_POST:
-		return hd.hd_calls[cur_match]->post;
+		return best.uri->post;
 		break;
 	case HTTPD_RQTYPE_PUT:
-		return hd.hd_calls[cur_match]->put;
+		return best.uri->put;
 		break;
 	}
 	return NULL;
 }
 
+int httpd_req_get_uri_param(httpd_req_t *r, const char *name,
+			    const char **val, size_t *val_len)
+{
+	struct httpd_req_aux *ra = r->aux;
+	const char *p, *e;
+	unsigned i;
+
+	if (! ra->route)
+		return -ENOENT;
+	/* The parameters were captured in the order of the handler's URI */
+	p = ra->route->uri;
+	for (i = 0; i < ra->uri_params_cnt && (p = strchr(p, '{')) != NULL; i++) {
+		e = strchr(++p, '}');
+		if ((size_t)(e - p) == strlen(name) && memcmp(p, name, e - p) == 0) {
+			*val = r->uri + ra->uri_params[i].off;
+			*val_len = ra->uri_params[i].len;
+			return OS_SUCCESS;
+		}
+		p = e;
+	}
+	return -ENOENT;
+}
+
 int httpd_uri(httpd_req_t *req)
 {
 	httpd_uri_handler_t uri_handler;
+	struct httpd_uri *uri = NULL;
+
+	int ret = OS_SUCCESS;
 
 	httpd_uri_d("Request %d for %s\n", req->type, req->uri);
-	uri_handler = httpd_find_handler(req);
+	/* The handler can't be unregistered from under us, till it returns */
+	httpd_routes_enter();
+	uri_handler = httpd_find_handler(req, &uri);
 	if (uri_handler == NULL) {
 		httpd_uri_d("Response: 404\n");
 		httpd_resp_send_404(req);
 		goto out;
 	}
+	req->user_ctx = uri->user_ctx;
+	if (uri->offload && hd.hd_pool &&
+	    req->content_len <= HTTPD_OFFLOAD_MAX_BODY) {
+		/* The session is resumed once the worker is done */
+		ret = httpd_pool_offload(req);
+		goto out;
+	}
 	if (uri_handler(req) != OS_SUCCESS) {
 		/* Something failed, this socket should be closed */
-		return -OS_FAIL;
+		ret = -OS_FAIL;
 	}
 
  out:
-	return OS_SUCCESS;
+	httpd_routes_exit();
+	return ret;
+}
+
+int httpd_uri_offloaded(httpd_req_t *req)
+{
+	httpd_uri_handler_t uri_handler;
+	struct httpd_uri *uri = NULL;
+	int ret;
+
+	/* The handler may have been unregistered while the request was
+	 * queued, so it is looked up afresh */
+	httpd_routes_enter();
+	uri_handler = httpd_find_handler(req, &uri);
+	if (uri_handler == NULL) {
+		httpd_routes_exit();
+		return httpd_resp_send_404(req);
+	}
+	req->user_ctx = uri->user_ctx;
+	ret = uri_handler(req);
+	httpd_routes_exit();
+	return ret;
 }
@@ -0,0 +1,848 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include <httpd.h>
+
+#include "httpd_priv.h"
+
+#ifdef OS_HAVE_IO_URING
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* The io_uring engine
+ *
+ * This implements the httpd_poll_*() API on top of an io_uring, and also takes
+ * over the default send function. Instead of a syscall per operation, all the
+ * operations prepared during one iteration of the server loop are submitted,
+ * and their completions reaped, with a single io_uring_enter():
+ * - The listening socket has a multishot accept armed. Accepted sockets are
+ *   queued up, and handed out by httpd_poll_accept().
+ * - Every session has a recv armed that reads straight into the session's
+ *   receive buffer. The socket is reported as ready once that completes, and
+ *   the request is then parsed out of the buffer as usual. (Sessions that
+ *   override the receive function, and the control socket, get a poll
+ *   armed instead.)
+ * - Data sent on a session is staged in blocks, and each session's staged
+ *   blocks go out as one chain of linked sends before the next wait. A
+ *   vectored send is staged in the same way. A session only gets so many
+ *   bytes staged and in flight, past that (or with the blocks all in use)
+ *   its sends take nothing, as a non-blocking socket would. The session
+ *   is then reported as writable once its sends have completed.
+ * - A session that is closed with sends still in flight leaves its socket
+ *   open till those complete, or till the send timeout has it shut down.
+ *   The sends refer to the socket by its number, so that isn't handed out
+ *   again before then.
+ *
+ * Everything in here runs in the HTTPD thread.
+ */
+
+#define HTTPD_URING_ENTRIES      256
+/* The blocks for staging data to be sent */
+#define HTTPD_URING_TX_BLOCKS    64
+#define HTTPD_URING_TX_BLOCK_SZ  2048
+/* The most bytes that a socket may have staged and in flight */
+#define HTTPD_URING_TX_SOCK_MAX  (8 * HTTPD_URING_TX_BLOCK_SZ)
+/* Connections accepted but not yet picked up by the server */
+#define HTTPD_URING_ACCEPT_Q     64
+
+enum uring_op {
+	URING_OP_ACCEPT = 1,
+	URING_OP_RECV,
+	URING_OP_POLL,
+	URING_OP_SEND,
+	URING_OP_CANCEL,
+};
+
+/* The user data of every operation carries the operation and either the socket
+ * descriptor, or the index of the block that is being sent */
+#define URING_UDATA(op, id)   (((uint64_t)(op) << 32) | (uint32_t)(id))
+#define URING_UDATA_OP(ud)    ((unsigned)((ud) >> 32))
+#define URING_UDATA_ID(ud)    ((int)(uint32_t)(ud))
+
+struct uring_tx_blk {
+	/* The next block of the same socket, -1 terminates */
+	int      next;
+	int      fd;
+	unsigned len;
+	char     data[HTTPD_URING_TX_BLOCK_SZ];
+};
+
+/* Per socket descriptor state */
+struct uring_fd {
+#define URING_FD_REGISTERED  0x01
+#define URING_FD_LISTENER    0x02
+	/* A recv, poll or accept is in flight */
+#define URING_FD_ARMED       0x04
+	/* A cancellation of the above is in flight */
+#define URING_FD_CANCELLING  0x08
+	/* Present in the ready list */
+#define URING_FD_READY       0x10
+	/* Present in the tx list */
+#define URING_FD_TX_PENDING  0x20
+	/* The session waits to be able to send, rather than for data */
+#define URING_FD_WANT_WRITE  0x40
+	/* Present in the starved list, having found the blocks all in use */
+#define URING_FD_STARVED     0x80
+	/* Present in the rearm list */
+#define URING_FD_REARM       0x100
+	/* Removed, but with sends in flight still. Present in the draining
+	 * list. */
+#define URING_FD_DRAINING    0x200
+	/* To be closed, once drained */
+#define URING_FD_CLOSE       0x400
+	uint16_t flags;
+	/* The operation that is armed */
+	uint8_t  armed_op;
+	/* Blocks staged, but not yet submitted */
+	int      tx_first;
+	int      tx_last;
+	/* Number of sends submitted, but not yet completed */
+	unsigned tx_inflight;
+	/* Bytes staged and in flight */
+	unsigned tx_bytes;
+	/* When a draining socket is shut down, 0 for never */
+	uint64_t drain_by;
+};
+
+struct httpd_uring {
+	int                   ring_fd;
+
+	/* The submission queue */
+	unsigned             *sq_head;
+	unsigned             *sq_tail;
+	unsigned              sq_mask;
+	unsigned              sq_entries;
+	struct io_uring_sqe  *sqes;
+	unsigned              to_submit;
+
+	/* The completion queue */
+	unsigned             *cq_head;
+	unsigned             *cq_tail;
+	unsigned              cq_mask;
+	struct io_uring_cqe  *cqes;
+
+	void                 *sq_ring;
+	size_t                sq_ring_sz;
+	void                 *cq_ring;
+	size_t                cq_ring_sz;
+	size_t                sqes_sz;
+
+	/* State of each socket, indexed by the socket descriptor */
+	struct uring_fd      *fds;
+	int                   nfds;
+	/* Sockets that are ready, and will be reported by the next wait */
+	int                  *ready;
+	int                   n_ready;
+	/* Sockets reported by the last wait, and the ones added since, these
+	 * need to be armed (again) */
+	int                  *rearm;
+	int                   n_rearm;
+	/* Sockets with staged data to be sent */
+	int                  *tx;
+	int                   n_tx;
+	/* Sockets that are waiting for a block to be freed */
+	int                  *starved;
+	int                   n_starved;
+	/* Sockets that were removed, and wait for their sends to complete */
+	int                  *draining;
+	int                   n_draining;
+
+	struct uring_tx_blk  *blks;
+	int                   blk_free;
+
+	int                   accept_q[HTTPD_URING_ACCEPT_Q];
+	int                   accept_head;
+	int                   accept_cnt;
+	int                   listen_fd;
+};
+
+/* Submit, and wait for min_complete completions for at most timeout_ms (-1 for
+ * no limit) */
+static int uring_enter(struct httpd_uring *u, unsigned min_complete, int timeout_ms)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	int ret;
+
+	if (min_complete && timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (unsigned long)&ts;
+		ret = syscall(__NR_io_uring_enter, u->ring_fd, u->to_submit,
+			      min_complete, flags | IORING_ENTER_EXT_ARG,
+			      &arg, sizeof(arg));
+	} else {
+		ret = syscall(__NR_io_uring_enter, u->ring_fd, u->to_submit,
+			      min_complete, flags, NULL, 0);
+	}
+	if (ret < 0)
+		return (errno == EINTR || errno == ETIME) ? 0 : -errno;
+	u->to_submit -= (ret > (int)u->to_submit) ? u->to_submit : (unsigned)ret;
+	return OS_SUCCESS;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct httpd_uring *u)
+{
+	unsigned tail = *u->sq_tail;
+	/* Submit what we have, if the queue is full */
+	while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+		uring_enter(u, 0, -1);
+	struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	return sqe;
+}
+
+static int uring_grow_fds(struct httpd_uring *u, int fd)
+{
+	int n = u->nfds ? u->nfds : 64;
+	int i;
+
+	while (n <= fd)
+		n *= 2;
+	struct uring_fd *fds = realloc(u->fds, n * sizeof(*fds));
+	if (! fds)
+		return -OS_FAIL;
+	u->fds = fds;
+	for (i = u->nfds; i < n; i++) {
+		memset(&fds[i], 0, sizeof(fds[i]));
+		fds[i].tx_first = fds[i].tx_last = -1;
+	}
+	/* Each socket is present at most once in these lists */
+	int *ready = realloc(u->ready, n * sizeof(int));
+	if (ready)
+		u->ready = ready;
+	int *rearm = realloc(u->rearm, n * sizeof(int));
+	if (rearm)
+		u->rearm = rearm;
+	int *tx = realloc(u->tx, n * sizeof(int));
+	if (tx)
+		u->tx = tx;
+	int *starved = realloc(u->starved, n * sizeof(int));
+	if (starved)
+		u->starved = starved;
+	int *draining = realloc(u->draining, n * sizeof(int));
+	if (draining)
+		u->draining = draining;
+	if (! ready || ! rearm || ! tx || ! starved || ! draining)
+		return -OS_FAIL;
+	u->nfds = n;
+	return OS_SUCCESS;
+}
+
+static void uring_set_ready(struct httpd_uring *u, int fd)
+{
+	struct uring_fd *f = &u->fds[fd];
+	if ((f->flags & URING_FD_REGISTERED) && !(f->flags & URING_FD_READY)) {
+		f->flags |= URING_FD_READY;
+		u->ready[u->n_ready++] = fd;
+	}
+}
+
+/* Arm the socket with the next wait, once it has been served. The recv of a
+ * session is aimed at the end of its data, which moves while it is served. */
+static void uring_set_rearm(struct httpd_uring *u, int fd)
+{
+	struct uring_fd *f = &u->fds[fd];
+	if (!(f->flags & URING_FD_REARM)) {
+		f->flags |= URING_FD_REARM;
+		u->rearm[u->n_rearm++] = fd;
+	}
+}
+
+static void uring_list_remove(int *list, int *n, int fd)
+{
+	int i;
+	for (i = 0; i < *n; i++) {
+		if (list[i] == fd) {
+			list[i] = list[--(*n)];
+			return;
+		}
+	}
+}
+
+/* The last send of a removed socket has completed */
+static void uring_drained(struct httpd_uring *u, int fd)
+{
+	struct uring_fd *f = &u->fds[fd];
+
+	uring_list_remove(u->draining, &u->n_draining, fd);
+	if (f->flags & URING_FD_CLOSE)
+		close(fd);
+	f->flags = 0;
+}
+
+static void uring_arm_accept(struct httpd_uring *u, int fd)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = URING_UDATA(URING_OP_ACCEPT, fd);
+	u->fds[fd].flags |= URING_FD_ARMED;
+	u->fds[fd].armed_op = URING_OP_ACCEPT;
+}
+
+/* Arm a socket so that we are told about the next data on it */
+static void uring_arm(struct httpd_uring *u, int fd)
+{
+	struct uring_fd *f = &u->fds[fd];
+	struct io_uring_sqe *sqe;
+
+	if (!(f->flags & URING_FD_REGISTERED) || (f->flags & URING_FD_ARMED))
+		return;
+	if (f->flags & URING_FD_LISTENER) {
+		uring_arm_accept(u, fd);
+		return;
+	}
+
+	struct sock_db *sd = httpd_sess_get(fd);
+	if (f->flags & URING_FD_WANT_WRITE) {
+		/* The ring's own sends report back once they complete, see
+		 * uring_complete_send(). Otherwise the socket is polled. */
+		if (f->tx_bytes || (f->flags & URING_FD_STARVED))
+			return;
+		sqe = uring_get_sqe(u);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = POLLOUT;
+		sqe->user_data = URING_UDATA(URING_OP_POLL, fd);
+		f->armed_op = URING_OP_POLL;
+	} else if (sd && httpd_sess_recv_fn(sd) == __httpd_recv) {
+		/* Receive straight into the free space of the session's
+		 * buffer, after moving any leftover data to its start */
+		httpd_rx_compact(sd);
+		if (sd->rx_tail == httpd_sess_rx_size(sd)) {
+			/* Let the parser bail out on this */
+			uring_set_ready(u, fd);
+			return;
+		}
+		sqe = uring_get_sqe(u);
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long)(sd->rx_buf + sd->rx_tail);
+		sqe->len = httpd_sess_rx_size(sd) - sd->rx_tail;
+		sqe->user_data = URING_UDATA(URING_OP_RECV, fd);
+		f->armed_op = URING_OP_RECV;
+	} else {
+		sqe = uring_get_sqe(u);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = URING_UDATA(URING_OP_POLL, fd);
+		f->armed_op = URING_OP_POLL;
+	}
+	f->flags |= URING_FD_ARMED;
+}
+
+/* Submit the staged blocks of all the sockets that have nothing in flight. The
+ * blocks of a socket are linked, so that they go out in order. Sockets that
+ * still have sends in flight wait for those to complete first. */
+static void uring_flush_tx(struct httpd_uring *u)
+{
+	int i = 0;
+	while (i < u->n_tx) {
+		int fd = u->tx[i];
+		struct uring_fd *f = &u->fds[fd];
+		if (f->tx_inflight) {
+			i++;
+			continue;
+		}
+		int b = f->tx_first;
+		while (b != -1) {
+			struct uring_tx_blk *blk = &u->blks[b];
+			struct io_uring_sqe *sqe = uring_get_sqe(u);
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = fd;
+			sqe->addr = (unsigned long)blk->data;
+			sqe->len = blk->len;
+			sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+			sqe->user_data = URING_UDATA(URING_OP_SEND, b);
+			if (blk->next != -1)
+				sqe->flags |= IOSQE_IO_LINK;
+			f->tx_inflight++;
+			b = blk->next;
+		}
+		f->tx_first = f->tx_last = -1;
+		f->flags &= ~URING_FD_TX_PENDING;
+		u->tx[i] = u->tx[--u->n_tx];
+	}
+}
+
+static void uring_complete_send(struct httpd_uring *u, int b, int res)
+{
+	struct uring_tx_blk *blk = &u->blks[b];
+	struct uring_fd *f = &u->fds[blk->fd];
+
+	f->tx_inflight--;
+	f->tx_bytes -= blk->len;
+	if (res != (int)blk->len && (f->flags & URING_FD_REGISTERED)) {
+		/* A failed send breaks the chain. Shut the socket down, the
+		 * session is then closed once its recv completes. */
+		httpd_d("send failed on %d: %d\n", blk->fd, res);
+		shutdown(blk->fd, SHUT_RDWR);
+	}
+	if (! f->tx_bytes && (f->flags & URING_FD_WANT_WRITE))
+		uring_set_ready(u, blk->fd);
+	/* Anything staged behind these goes out with the next flush */
+	if ((f->flags & URING_FD_DRAINING) && ! f->tx_inflight &&
+	    f->tx_first == -1)
+		uring_drained(u, blk->fd);
+	blk->next = u->blk_free;
+	u->blk_free = b;
+
+	/* The sockets that ran out of blocks get to try again */
+	while (u->n_starved) {
+		int fd = u->starved[--u->n_starved];
+		u->fds[fd].flags &= ~URING_FD_STARVED;
+		uring_set_ready(u, fd);
+	}
+}
+
+static void uring_reap(struct httpd_uring *u)
+{
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+		int id = URING_UDATA_ID(cqe->user_data);
+		int res = cqe->res;
+		struct uring_fd *f = (id < u->nfds) ? &u->fds[id] : NULL;
+
+		switch (URING_UDATA_OP(cqe->user_data)) {
+		case URING_OP_ACCEPT:
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				f->flags &= ~URING_FD_ARMED;
+			if (res < 0)
+				break;
+			if (u->accept_cnt == HTTPD_URING_ACCEPT_Q) {
+				httpd_d("Warn: accept queue full\n");
+				httpd_conn_shed(res);
+				break;
+			}
+			u->accept_q[(u->accept_head + u->accept_cnt) %
+				    HTTPD_URING_ACCEPT_Q] = res;
+			u->accept_cnt++;
+			uring_set_ready(u, id);
+			break;
+		case URING_OP_RECV:
+			f->flags &= ~(URING_FD_ARMED | URING_FD_CANCELLING);
+			if (res > 0) {
+				struct sock_db *sd = httpd_sess_get(id);
+				if (sd)
+					sd->rx_tail += res;
+			}
+			/* On end of stream or errors the socket is reported too.
+			 * The parser then reads the socket, and finds out. */
+			if (res != -ECANCELED)
+				uring_set_ready(u, id);
+			break;
+		case URING_OP_POLL:
+			f->flags &= ~(URING_FD_ARMED | URING_FD_CANCELLING);
+			if (res != -ECANCELED)
+				uring_set_ready(u, id);
+			break;
+		case URING_OP_SEND:
+			uring_complete_send(u, id, res);
+			break;
+		case URING_OP_CANCEL:
+			break;
+		}
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+int httpd_poll_init()
+{
+	struct httpd_uring *u = calloc(1, sizeof(*u));
+	struct io_uring_params p;
+	int i;
+
+	if (! u)
+		return -OS_FAIL;
+	u->listen_fd = -1;
+	memset(&p, 0, sizeof(p));
+	u->ring_fd = syscall(__NR_io_uring_setup, HTTPD_URING_ENTRIES, &p);
+	if (u->ring_fd < 0) {
+		httpd_d("io_uring setup failed: %d\n", errno);
+		free(u);
+		return -OS_FAIL;
+	}
+
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_sz > u->sq_ring_sz)
+			u->sq_ring_sz = u->cq_ring_sz;
+		u->cq_ring_sz = 0;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto err;
+	if (u->cq_ring_sz) {
+		u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->ring_fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto err_sq;
+	} else {
+		u->cq_ring = u->sq_ring;
+	}
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto err_cq;
+
+	char *sq = u->sq_ring, *cq = u->cq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	/* The SQE at index i always sits at slot i of the array */
+	unsigned *sq_array = (unsigned *)(sq + p.sq_off.array);
+	for (i = 0; i < (int)p.sq_entries; i++)
+		sq_array[i] = i;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	u->blks = malloc(HTTPD_URING_TX_BLOCKS * sizeof(*u->blks));
+	if (! u->blks)
+		goto err_sqes;
+	for (i = 0; i < HTTPD_URING_TX_BLOCKS; i++)
+		u->blks[i].next = (i + 1 < HTTPD_URING_TX_BLOCKS) ? i + 1 : -1;
+	u->blk_free = 0;
+
+	httpd_rt->rt_poll.ring = u;
+	return OS_SUCCESS;
+
+ err_sqes:
+	munmap(u->sqes, u->sqes_sz);
+ err_cq:
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_sz);
+ err_sq:
+	munmap(u->sq_ring, u->sq_ring_sz);
+ err:
+	close(u->ring_fd);
+	free(u);
+	return -OS_FAIL;
+}
+
+void httpd_poll_deinit()
+{
+	struct httpd_uring *u = httpd_rt->rt_poll.ring;
+	if (! u)
+		return;
+	/* Anything still in flight is cancelled with the ring */
+	close(u->ring_fd);
+	while (u->n_draining) {
+		int fd = u->draining[--u->n_draining];
+		if (u->fds[fd].flags & URING_FD_CLOSE)
+			close(fd);
+	}
+	while (u->accept_cnt--) {
+		close(u->accept_q[u->accept_head]);
+		u->accept_head = (u->accept_head + 1) % HTTPD_URING_ACCEPT_Q;
+	}
+	munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_sz);
+	munmap(u->sq_ring, u->sq_ring_sz);
+	free(u->blks);
+	free(u->fds);
+	free(u->ready);
+	free(u->rearm);
+	free(u->tx);
+	free(u->starved);
+	free(u->draining);
+	free(u);
+	httpd_rt->rt_poll.ring = NULL;
+}
+
+int httpd_poll_add(int fd)
+{
+	struct httpd_uring *u = httpd_rt->rt_poll.ring;
+	if (fd >= u->nfds && uring_grow_fds(u, fd) != OS_SUCCESS)
+		return -OS_FAIL;
+	/* Back from the worker pool, before its sends completed */
+	if (u->fds[fd].flags & URING_FD_DRAINING)
+		uring_list_remove(u->draining, &u->n_draining, fd);
+	u->fds[fd].flags = URING_FD_REGISTERED;
+	/* Not before the next wait: a session that is back from the worker
+	 * pool gets on with its pipelined requests first */
+	uring_set_rearm(u, fd);
+	return OS_SUCCESS;
+}
+
+int httpd_poll_add_listener(int fd)
+{
+	struct httpd_uring *u = httpd_rt->rt_poll.ring;
+	if (fd >= u->nfds && uring_grow_fds(u, fd) != OS_SUCCESS)
+		return -OS_FAIL;
+	u->fds[fd].flags = URING_FD_REGISTERED | URING_FD_LISTENER;
+	u->listen_fd = fd;
+	uring_arm(u, fd);
+	return OS_SUCCESS;
+}
+
+int httpd_poll_accept(int listen_fd)
+{
+	struct httpd_uring *u = httpd_rt->rt_poll.ring;
+	if (! u->accept_cnt)
+		return -EAGAIN;
+	int fd = u->accept_q[u->accept_head];
+	u->accept_head = (u->accept_head + 1) % HTTPD_URING_ACCEPT_Q;
+	u->accept_cnt--;
+	return fd;
+}
+
+/* The socket is about to be closed, or handed to the worker pool. What was
+ * armed on it is cancelled before we return, so that nothing writes to the
+ * session's buffer later on. Whatever was staged for it is still sent out, but
+ * that isn't waited for: the socket is drained on the next waits instead. */
+void httpd_poll_del(int fd)
+{
+	struct httpd_uring *u = httpd_rt->rt_poll.ring;
+	if (fd < 0 || fd >= u->nfds)
+		return;
+	struct uring_fd *f = &u->fds[fd];
+	if (!(f->flags & URING_FD_REGISTERED))
+		return;
+
+	/* Cancelling doesn't depend on the client, this is quick */
+	while (f->flags & URING_FD_ARMED) {
+		if (!(f->flags & URING_FD_CANCELLING)) {
+			struct io_uring_sqe *sqe = uring_get_sqe(u);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = URING_UDATA(f->armed_op, fd);
+			sqe->user_data = URING_UDATA(URING_OP_CANCEL, fd);
+			f->flags |= URING_FD_CANCELLING;
+		}
+		if (uring_enter(u, 1, -1) < 0)
+			break;
+		uring_reap(u);
+	}
+
+	uring_list_remove(u->ready, &u->n_ready, fd);
+	uring_list_remove(u->rearm, &u->n_rearm, fd);
+	uring_list_remove(u->starved, &u->n_starved, fd);
+	if (! f->tx_inflight && f->tx_first == -1) {
+		f->flags = 0;
+		return;
+	}
+	/* The staged blocks stay in the tx list, and go out in order after the
+	 * ones in flight. A client that doesn't take them doesn't hold the
+	 * socket for longer than the send timeout. */
+	f->flags = URING_FD_DRAINING | (f->flags & URING_FD_TX_PENDING);
+	f->drain_by = hd.hd_config.send_timeout_ms ?
+		otime_ms() + hd.hd_config.send_timeout_ms : 0;
+	u->draining[u->n_draining++] = fd;
+}
+
+void httpd_poll_close(int fd)
+{
+	struct httpd_uring *u = httpd_rt->rt_poll.ring;
+	if (fd >= 0 && fd < u->nfds && (u->fds[fd].flags & URING_FD_DRAINING))
+		u->fds[fd].flags |= URING_FD_CLOSE;
+	else
+		close(fd);
+}
+
+/* Shut down the draining sockets that are past their send timeout, so that
+ * their sends fail. Returns how long till the next one is due, -1 for
+ * none. */
+static int uring_drain_expire(struct httpd_uring *u)
+{
+	uint64_t now = otime_ms();
+	int i, next = -1;
+
+	for (i = 0; i < u->n_draining; i++) {
+		struct uring_fd *f = &u->fds[u->draining[i]];
+		if (! f->drain_by)
+			continue;
+		if (f->drain_by <= now) {
+			httpd_d("send timeout on closed socket %d\n", u->draining[i]);
+			shutdown(u->draining[i], SHUT_RDWR);
+			f->drain_by = 0;
+		} else if (next < 0 || f->drain_by - now < (uint64_t)next) {
+			next = f->drain_by - now;
+		}
+	}
+	return next;
+}
+
+void httpd_poll_set_write(int fd, bool on)
+{
+	struct httpd_uring *u = httpd_rt->rt_poll.ring;
+	if (fd < 0 || fd >= u->nfds)
+		return;
+	struct uring_fd *f = &u->fds[fd];
+	if (on) {
+		f->flags |= URING_FD_WANT_WRITE;
+		/* A socket that is being served is armed for this once it is
+		 * done. One that waits on a recv still is told about once its
+		 * sends complete, or right away if there are none. */
+		if ((f->flags & URING_FD_ARMED) && ! f->tx_bytes &&
+		    !(f->flags & URING_FD_STARVED))
+			uring_set_ready(u, fd);
+	} else {
+		f->flags &= ~URING_FD_WANT_WRITE;
+	}
+}
+
+bool httpd_poll_tx_idle(int fd)
+{
+	struct httpd_uring *u = httpd_rt ? httpd_rt->rt_poll.ring : NULL;
+	if (! u || fd < 0 || fd >= u->nfds)
+		return true;
+	return ! u->fds[fd].tx_bytes;
+}
+
+int httpd_poll_wait(int *fds, int max_fds, int timeout_ms)
+{
+	struct httpd_uring *u = httpd_rt->rt_poll.ring;
+	int i, n = 0;
+
+	/* The sockets that were reported last time have been served by now */
+	for (i = 0; i < u->n_rearm; i++) {
+		u->fds[u->rearm[i]].flags &= ~URING_FD_REARM;
+		uring_arm(u, u->rearm[i]);
+	}
+	u->n_rearm = 0;
+	/* Connections that couldn't be picked up last time */
+	if (u->accept_cnt && u->listen_fd != -1)
+		uring_set_ready(u, u->listen_fd);
+	/* Wake up for the send timeouts of the draining sockets too */
+	if (u->n_draining) {
+		int drain_ms = uring_drain_expire(u);
+		if (drain_ms >= 0 && (timeout_ms < 0 || drain_ms < timeout_ms))
+			timeout_ms = drain_ms;
+	}
+
+	while (1) {
+		uring_flush_tx(u);
+		/* Submit everything, and only wait if there is nothing to
+		 * report already */
+		if (uring_enter(u, u->n_ready ? 0 : 1, timeout_ms) < 0)
+			return -OS_FAIL;
+		uring_reap(u);
+		/* With a timeout, the server gets to look at the time after
+		 * every wait */
+		if (u->n_ready || timeout_ms >= 0)
+			break;
+	}
+
+	while (n < max_fds && n < u->n_ready) {
+		int fd = u->ready[n];
+		u->fds[fd].flags &= ~URING_FD_READY;
+		uring_set_rearm(u, fd);
+		fds[n++] = fd;
+	}
+	/* Anything that didn't fit stays for the next time around */
+	u->n_ready -= n;
+	memmove(u->ready, u->ready + n, u->n_ready * sizeof(int));
+	return n;
+}
+
+/* Stage data to be sent on a socket. The data goes out with the next
+ * submission. As much is staged as the socket may have, the return is -1 with
+ * errno EAGAIN if that is nothing. */
+int httpd_uring_send(int sockfd, const char *buf, unsigned buf_len, int flags)
+{
+	struct httpd_uring *u = httpd_rt ? httpd_rt->rt_poll.ring : NULL;
+	if (! u || sockfd < 0 || sockfd >= u->nfds ||
+	    !(u->fds[sockfd].flags & URING_FD_REGISTERED) ||
+	    (u->fds[sockfd].flags & URING_FD_LISTENER))
+		return send(sockfd, buf, buf_len, flags);
+
+	struct uring_fd *f = &u->fds[sockfd];
+	unsigned want = buf_len, done = 0;
+
+	if (buf_len > HTTPD_URING_TX_SOCK_MAX - f->tx_bytes)
+		buf_len = HTTPD_URING_TX_SOCK_MAX - f->tx_bytes;
+	while (done < buf_len) {
+		struct uring_tx_blk *blk = NULL;
+		if (f->tx_last != -1 &&
+		    u->blks[f->tx_last].len < HTTPD_URING_TX_BLOCK_SZ) {
+			blk = &u->blks[f->tx_last];
+		} else {
+			if (u->blk_free == -1) {
+				/* Told about once a block is freed */
+				if (!(f->flags & URING_FD_STARVED)) {
+					f->flags |= URING_FD_STARVED;
+					u->starved[u->n_starved++] = sockfd;
+				}
+				break;
+			}
+			int b = u->blk_free;
+			blk = &u->blks[b];
+			u->blk_free = blk->next;
+			blk->next = -1;
+			blk->fd = sockfd;
+			blk->len = 0;
+			if (f->tx_last == -1)
+				f->tx_first = b;
+			else
+				u->blks[f->tx_last].next = b;
+			f->tx_last = b;
+			if (!(f->flags & URING_FD_TX_PENDING)) {
+				f->flags |= URING_FD_TX_PENDING;
+				u->tx[u->n_tx++] = sockfd;
+			}
+		}
+		unsigned len = HTTPD_URING_TX_BLOCK_SZ - blk->len;
+		if (len > buf_len - done)
+			len = buf_len - done;
+		memcpy(blk->data + blk->len, buf + done, len);
+		blk->len += len;
+		done += len;
+	}
+	f->tx_bytes += done;
+	if (! done && want) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return done;
+}
+
+/* The pieces are all staged together, so they go out in the same chain */
+int httpd_uring_sendv(int sockfd, const struct iovec *iov, int iovcnt, int flags)
+{
+	struct httpd_uring *u = httpd_rt ? httpd_rt->rt_poll.ring : NULL;
+	int i, total = 0;
+
+	if (! u || sockfd < 0 || sockfd >= u->nfds ||
+	    !(u->fds[sockfd].flags & URING_FD_REGISTERED) ||
+	    (u->fds[sockfd].flags & URING_FD_LISTENER)) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = (struct iovec *)iov;
+		msg.msg_iovlen = iovcnt;
+		return sendmsg(sockfd, &msg, flags);
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		int ret = httpd_uring_send(sockfd, iov[i].iov_base,
+					   iov[i].iov_len, flags);
+		if (ret < 0)
+			return total ? total : ret;
+		total += ret;
+		if ((size_t)ret < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+#endif /* OS_HAVE_IO_URING */
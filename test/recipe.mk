@@ -1,2 +1,13 @@
 objs-y += test/src/main.c test/src/tests.c
+# The compile time route table needs C++17
+objs-y += test/src/routes.cpp
+cflags-y += -DTEST_HAVE_FIXED_ROUTES
 exec-y := run_tests
+# The tests register more handlers than the default allows
+cflags-y += -DHTTPD_MAX_URI_HANDLERS=32
+# The assets of /static, linked in as a bundle
+objs-y += test/src/bundle.c
+cflags-y += -DTEST_HAVE_BUNDLE
+gen-y += test/src/bundle.c
+test/src/bundle.c: $(wildcard test/www/*) util/mkbundle.py
+	python3 util/mkbundle.py --prefix /static -c --name test_bundle -o $@ test/www
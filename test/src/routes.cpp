@@ -0,0 +1,66 @@
+/* Routes that are fixed at compile time, see httpd_routes.hpp */
+#include <osal.h>
+#include <httpd.h>
+#include <httpd_routes.hpp>
+
+static int fixed_get_handler(httpd_req_t *req)
+{
+#define STR "Fixed GET"
+	httpd_resp_send(req, STR, strlen(STR));
+	return OS_SUCCESS;
+#undef STR
+}
+
+static int fixed_post_handler(httpd_req_t *req)
+{
+#define STR "Fixed POST"
+	httpd_resp_send(req, STR, strlen(STR));
+	return OS_SUCCESS;
+#undef STR
+}
+
+/* Respond with the path, to tell which of the many routes it was */
+static int many_get_handler(httpd_req_t *req)
+{
+	httpd_resp_send(req, req->uri, strlen(req->uri));
+	return OS_SUCCESS;
+}
+
+/* A table about the size of a real application's, /many/00 to /many/77 */
+#define MANY(n)  { "/many/" #n, HTTPD_RQTYPE_GET, many_get_handler }
+#define MANY8(n) MANY(n##0), MANY(n##1), MANY(n##2), MANY(n##3), \
+		 MANY(n##4), MANY(n##5), MANY(n##6), MANY(n##7)
+
+static constexpr httpd::route routes[] = {
+	{ "/fixed", HTTPD_RQTYPE_GET,  fixed_get_handler },
+	{ "/fixed", HTTPD_RQTYPE_POST, fixed_post_handler },
+	{ "/fixed/other", HTTPD_RQTYPE_GET, fixed_post_handler },
+	MANY8(0), MANY8(1), MANY8(2), MANY8(3),
+	MANY8(4), MANY8(5), MANY8(6), MANY8(7),
+};
+static constexpr auto table = httpd::make_routes(routes);
+
+/* Every route is found in the table, for its own type only */
+template <size_t N>
+static constexpr bool all_found(const httpd::route (&r)[N])
+{
+	for (size_t i = 0; i < N; i++) {
+		size_t len = httpd::detail::strlen(r[i].path);
+		const struct httpd_uri *u = table.find(r[i].path, len, r[i].type);
+		if (! u || u->uri != r[i].path ||
+		    table.find(r[i].path, len, HTTPD_RQTYPE_PUT) != nullptr)
+			return false;
+	}
+	return true;
+}
+
+static_assert(all_found(routes), "All the routes are in the table");
+static_assert(table.find("/fixed", 6, HTTPD_RQTYPE_GET)->get == fixed_get_handler,
+	      "GET /fixed is in the table");
+static_assert(table.find("/many/8", 7, HTTPD_RQTYPE_GET) == nullptr,
+	      "GET /many/8 isn't in the table");
+
+extern "C" void register_fixed_routes(void)
+{
+	httpd_set_route_lookup(httpd::route_lookup<table>);
+}
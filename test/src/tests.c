@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/socket.h>
 
 int pre_start_mem, post_stop_mem, post_stop_min_mem;
 bool basic_sanity = true;
@@ -20,6 +21,8 @@ int hello_type_get_handler(httpd_req_t *req)
 {
 #define STR "Hello World!"
 	httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+	httpd_resp_set_hdr(req, "X-Flick-Test", "type");
+	httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
 	httpd_resp_send(req, STR, strlen(STR));
 	return OS_SUCCESS;
 #undef STR
@@ -130,7 +133,258 @@ int async_get_handler(httpd_req_t *req)
 	return OS_SUCCESS;
 #undef STR
 }
+void async_echo_thread(void *arg)
+{
+	httpd_req_t *req = arg;
+	char buf[100];
+	int ret;
+
+	/* Respond to the detached request from a thread of our own */
+	othread_sleep(1000);
+	ret = httpd_req_recv(req, buf, sizeof(buf) - 1);
+	if (ret < 0)
+		ret = 0;
+	buf[ret] = '\0';
+	httpd_resp_send(req, buf, strlen(buf));
+	httpd_req_async_handler_complete(req);
+	othread_delete();
+}
+
+int async_echo_post_handler(httpd_req_t *req)
+{
+	httpd_req_t *async_req;
+	othread_t thread;
+
+	if (httpd_req_async_handler_begin(req, &async_req) != OS_SUCCESS)
+		return -OS_FAIL;
+	if (othread_create(&thread, "async_echo", 4096, OS_DEFAULT_PRIORITY,
+			   async_echo_thread, async_req) != OS_SUCCESS) {
+		httpd_req_async_handler_complete(async_req);
+		return -OS_FAIL;
+	}
+	return OS_SUCCESS;
+}
+
+/* What the last detached request found in its X-Token header */
+static char async_hdr_val[32];
+
+void async_hdr_thread(void *arg)
+{
+	httpd_req_t *req = arg;
+	const char *val = "";
+	size_t len = 0;
+
+	/* By now the session is gone, and another connection may have its
+	 * buffers */
+	othread_sleep(1000);
+	httpd_req_get_hdr_value(req, "X-Token", &val, &len);
+	snprintf(async_hdr_val, sizeof(async_hdr_val), "%.*s", (int)len, val);
+	httpd_req_async_handler_complete(req);
+	othread_delete();
+}
+
+int async_hdr_get_handler(httpd_req_t *req)
+{
+	httpd_req_t *async_req;
+	othread_t thread;
+	const char *val;
+	size_t len;
+
+	if (httpd_req_get_query(req, "last", &val, &len) == OS_SUCCESS)
+		return httpd_resp_send(req, async_hdr_val, strlen(async_hdr_val));
+
+	/* Detach the request, and close its session while it is away */
+	if (httpd_req_async_handler_begin(req, &async_req) != OS_SUCCESS)
+		return -OS_FAIL;
+	if (othread_create(&thread, "async_hdr", 4096, OS_DEFAULT_PRIORITY,
+			   async_hdr_thread, async_req) != OS_SUCCESS) {
+		httpd_req_async_handler_complete(async_req);
+		return -OS_FAIL;
+	}
+	httpd_trigger_sess_close(httpd_req_to_sockfd(req));
+	return OS_SUCCESS;
+}
+
+int slow_echo_post_handler(httpd_req_t *req)
+{
+	/* Block for a while, as if waiting on something slow. This is
+	 * offloaded, so the other sessions are served meanwhile. */
+	othread_sleep(1000);
+	return echo_post_handler(req);
+}
+
+/* A send override, which the response goes out through a piece at a time */
+static int plain_send(int sockfd, const char *buf, unsigned buf_len, int flags)
+{
+	return send(sockfd, buf, buf_len, flags);
+}
+
+/* GET /chunked, and plain_send=1 for it to go out through plain_send() */
+int chunked_get_handler(httpd_req_t *req)
+{
+	const char *val;
+	size_t len;
+	char buf[16];
+	int i;
+
+	if (httpd_req_get_query(req, "plain_send", &val, &len) == OS_SUCCESS)
+		httpd_set_send_override(req, plain_send);
+	/* Lots of small pieces, these get coalesced into fewer chunks */
+	httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+	for (i = 0; i < 500; i++) {
+		snprintf(buf, sizeof(buf), "%d,", i);
+		if (httpd_resp_send_chunk(req, buf, strlen(buf)) != OS_SUCCESS)
+			return -OS_FAIL;
+	}
+	return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+int file_get_handler(httpd_req_t *req)
+{
+	FILE *f = tmpfile();
+	int i, ret;
+
+	if (! f)
+		return -OS_FAIL;
+	/* 5000 bytes of digits, out of which a part is sent */
+	for (i = 0; i < 500; i++)
+		fputs("0123456789", f);
+	fflush(f);
+	httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+	ret = httpd_resp_send_file(req, fileno(f), 100, 4000);
+	fclose(f);
+	return ret;
+}
+
+/* The digits, over and over, produced as the client takes them */
+struct stream_ctx {
+	unsigned long off;
+	unsigned long len;
+};
+
+static int stream_provide(void *ctx, char *buf, unsigned buf_len)
+{
+	struct stream_ctx *s = ctx;
+	unsigned i;
+
+	if (buf_len > s->len - s->off)
+		buf_len = s->len - s->off;
+	for (i = 0; i < buf_len; i++)
+		buf[i] = '0' + (s->off + i) % 10;
+	s->off += buf_len;
+	return buf_len;
+}
+
+/* GET /stream?len=N, and chunked=1 for a chunked response */
+int stream_get_handler(httpd_req_t *req)
+{
+	struct stream_ctx *s = calloc(1, sizeof(*s));
+	const char *val;
+	size_t len;
+	bool chunked;
+
+	if (! s)
+		return -OS_FAIL;
+	s->len = 1000;
+	if (httpd_req_get_query(req, "len", &val, &len) == OS_SUCCESS)
+		s->len = strtoul(val, NULL, 10);
+	chunked = httpd_req_get_query(req, "chunked", &val, &len) == OS_SUCCESS;
+	httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+	return httpd_resp_send_provider(req, chunked ? -1 : (long)s->len,
+					stream_provide, free, s);
+}
+
+int param_get_handler(httpd_req_t *req)
+{
+	const char *id, *post;
+	size_t id_len, post_len;
+	char outbuf[100];
+
+	if (httpd_req_get_uri_param(req, "id", &id, &id_len) != OS_SUCCESS ||
+	    httpd_req_get_uri_param(req, "post", &post, &post_len) != OS_SUCCESS)
+		return httpd_resp_send_404(req);
+	snprintf(outbuf, sizeof(outbuf), "id=%.*s post=%.*s",
+		 (int)id_len, id, (int)post_len, post);
+	httpd_resp_send(req, outbuf, strlen(outbuf));
+	return OS_SUCCESS;
+}
+
+/* Respond with all the query parameters, and then the one called "name" */
+int query_get_handler(httpd_req_t *req)
+{
+	/* Each parameter grows by a character at most, with the '=' */
+	size_t size = 2 * strlen(req->uri) + 30;
+	char *outbuf = httpd_req_alloc(req, size), name[20];
+	const char *key, *val;
+	unsigned it = 0;
+	size_t len = 0;
+
+	if (! outbuf)
+		return -OS_FAIL;
+	outbuf[0] = '\0';
+	while (httpd_req_query_next(req, &it, &key, &val) == OS_SUCCESS)
+		snprintf(outbuf + strlen(outbuf), size - strlen(outbuf),
+			 "%s=%s;", key, val);
+	if (httpd_req_get_query(req, "name", &val, &len) == OS_SUCCESS &&
+	    httpd_req_get_url_param(req, "name", name, sizeof(name)) == OS_SUCCESS &&
+	    strlen(name) == len)
+		snprintf(outbuf + strlen(outbuf), size - strlen(outbuf),
+			 "name:%s", name);
+	httpd_resp_send(req, outbuf, strlen(outbuf));
+	return OS_SUCCESS;
+}
+
+/* Respond with a few of the request's headers */
+int headers_get_handler(httpd_req_t *req)
+{
+	char outbuf[200];
+	const char *auth = "-", *custom = "-", *missing = "-";
+	size_t len;
+
+	httpd_req_get_hdr(req, HTTPD_HDR_AUTHORIZATION, &auth, &len);
+	httpd_req_get_hdr_value(req, "x-flick-custom", &custom, NULL);
+	httpd_req_get_hdr_value(req, "X-Missing", &missing, NULL);
+	snprintf(outbuf, sizeof(outbuf), "%s|%s|%s", auth, custom, missing);
+	httpd_resp_send(req, outbuf, strlen(outbuf));
+	return OS_SUCCESS;
+}
+
+int conn_stats_get_handler(httpd_req_t *req)
+{
+	struct httpd_conn_stats stats;
+	char outbuf[100];
+
+	if (httpd_get_conn_stats(&stats) != OS_SUCCESS) {
+		httpd_resp_set_status(req, HTTPD_500);
+		return httpd_resp_send(req, NULL, 0);
+	}
+	snprintf(outbuf, sizeof(outbuf), "%lu %lu %lu",
+		 stats.accepted, stats.shed, stats.rejected);
+	httpd_resp_send(req, outbuf, strlen(outbuf));
+	return OS_SUCCESS;
+}
 
+struct httpd_uri dynamic_uri = {
+	.uri = "/dynamic/hello",
+	.get = hello_get_handler,
+};
+
+/* Add or remove /dynamic/hello, while the web server is running */
+int dynamic_toggle_post_handler(httpd_req_t *req)
+{
+	char outbuf[50];
+	int ret;
+
+	ret = httpd_unregister_uri_handler(&dynamic_uri);
+	if (ret == OS_SUCCESS)
+		snprintf(outbuf, sizeof(outbuf), "removed");
+	else if (httpd_register_uri_handler(&dynamic_uri) == OS_SUCCESS)
+		snprintf(outbuf, sizeof(outbuf), "added");
+	else
+		snprintf(outbuf, sizeof(outbuf), "failed");
+	httpd_resp_send(req, outbuf, strlen(outbuf));
+	return OS_SUCCESS;
+}
 
 struct httpd_uri basic_handlers[] = {
 	{ .uri = "/hello/type_html",
@@ -154,9 +408,55 @@ struct httpd_uri basic_handlers[] = {
 	},
 	{ .uri = "/async_data",
 	  .get = async_get_handler,
+	  .post = async_echo_post_handler,
+	},
+	{ .uri = "/async_hdr",
+	  .get = async_hdr_get_handler,
+	},
+	{ .uri = "/chunked",
+	  .get = chunked_get_handler,
+	},
+	{ .uri = "/stream",
+	  .get = stream_get_handler,
+	},
+	{ .uri = "/file",
+	  .get = file_get_handler,
+	},
+	{ .uri = "/users/{id}/posts/{post}",
+	  .get = param_get_handler,
+	},
+	{ .uri = "/query",
+	  .get = query_get_handler,
+	},
+	{ .uri = "/headers",
+	  .get = headers_get_handler,
+	},
+	{ .uri = "/conn_stats",
+	  .get = conn_stats_get_handler,
+	},
+	{ .uri = "/dynamic/toggle",
+	  .post = dynamic_toggle_post_handler,
+	},
+	{ .uri = "/slow_echo",
+	  .post = slow_echo_post_handler,
+	  .offload = true,
 	},
 };
 
+/* These are built along with the tests where the toolchain allows, see
+ * test/recipe.mk */
+#ifdef TEST_HAVE_FIXED_ROUTES
+/* The routes of routes.cpp */
+void register_fixed_routes(void);
+#endif
+
+#ifdef TEST_HAVE_BUNDLE
+/* The assets of test/www, under /static */
+extern const unsigned char test_bundle[];
+extern const size_t test_bundle_len;
+struct httpd_bundle static_bundle;
+#endif
+
 int basic_handlers_no = sizeof(basic_handlers)/sizeof(struct httpd_uri);
 void register_basic_handlers(void)
 {
@@ -166,6 +466,15 @@ void register_basic_handlers(void)
 		ret = httpd_register_uri_handler(&basic_handlers[i]);
 		printf("register uri returned %d\n", ret);
 	}
+#ifdef TEST_HAVE_BUNDLE
+	ret = httpd_bundle_open(&static_bundle, test_bundle, test_bundle_len);
+	if (ret == OS_SUCCESS)
+		ret = httpd_bundle_register(&static_bundle);
+	printf("register bundle returned %d\n", ret);
+#endif
+#ifdef TEST_HAVE_FIXED_ROUTES
+	register_fixed_routes();
+#endif
 }
 /********************* Basic Handlers End *******************/
 
@@ -264,9 +573,19 @@ error_ret:
 
 int test_httpd_start()
 {
+	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+	/* Optionally, the number of reactors to start */
+	const char *reactors = getenv("TEST_REACTORS");
+
 	pre_start_mem = os_get_current_free_mem();
 	printf("HTTPD Start: Current free memory: %d\n", pre_start_mem);
-	return httpd_start();
+	config.reactors = reactors && atoi(reactors) > 1 ? atoi(reactors) : 1;
+	/* Short timeouts, so that the tests don't have to wait long for them */
+	config.idle_timeout_ms = 3000;
+	config.hdr_timeout_ms = 1000;
+	config.body_timeout_ms = 1000;
+	config.tcp_nodelay = true;
+	return httpd_start(&config);
 }
 
 void test_httpd_stop()
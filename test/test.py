@@ -60,6 +60,13 @@
 #      (should return HTTP 404) 
 #    - GET on /hello (should return 'Hello World')
 #
+# - Pipelined burst: Tests that requests received in a single read are all
+#   served
+#    - Create a session
+#    - Send 3 POSTs with data 5 on /adder and a GET on /hello in a
+#      single send()
+#    - read back 4 responses. They should be 5, 10, 15 and 'Hello World!'
+#
 # - Test HTTPd Asynchronous response
 #   - Create a session
 #   - GET on /async_data
@@ -67,16 +74,21 @@
 #   - the handler schedules an async response, which generates a second
 #     response 'Hello Double World!'
 #
+# - Timeouts
+#    - Create a session and only Send 'GE' on the same (simulates a
+#      client that left the network halfway through a request)
+#    - Create a session, GET /hello on it, and then leave it idle
+#    - Create a session and POST only part of the data on /echo
+#    - The server should close all three sockets, once their timeouts
+#      (set low in the test firmware) go off
+#    - POST part of the data on /echo, then trickle in the rest a byte at a
+#      time, each within the body timeout. The server should close the
+#      socket once the body timeout from the end of the header goes off.
+#
 
 
 ############# TODO TESTS #############
 #
-# - Timeout test
-#    - Create a session and only Send 'GE' on the same (simulates a
-#      client that left the network halfway through a request)
-#    - Wait for recv-wait-timeout
-#    - Server should automatically close the socket
-#
 # - Spillover test
 #    - Create max supported sessions with the web server
 #    - GET /hello on all the sessions (should return Hello World)
@@ -122,6 +134,8 @@ import socket
 import time
 import argparse
 import requests
+import zlib
+import os
 import sys
 
 class Session:
@@ -162,9 +176,11 @@ class Session:
         del line_hdrs[0]
         self.encoding = ''
         self.content_type = ''
+        self.headers = {}
         # Process other headers
         for h in range(len(line_hdrs)):
             line_comp = line_hdrs[h].split(':')
+            self.headers[line_comp[0]] = ':'.join(line_comp[1:]).strip()
             if line_comp[0] == 'Content-Length':
                 self.content_len = int(line_comp[1])
             if line_comp[0] == 'Content-Type':
@@ -174,7 +190,7 @@ class Session:
     def read_resp_data(self):
         read_data = ''
         while len(read_data) != self.content_len:
-            read_data += self.client.recv(self.content_len)
+            read_data += self.client.recv(self.content_len - len(read_data))
         self.content_len = 0
         return read_data
     def close(self):
@@ -294,6 +310,258 @@ def get_hello_type():
         return
     print "Success"
 
+def get_hello_hdr():
+    # GET /hello/type_html returns the additional headers set by the handler
+    print "[test] GET /hello/type_html has additional headers =>",
+    r = requests.get("http://" + dut + "/hello/type_html")
+    if not test_val("data", "Hello World!", r.text):
+        return
+    if not test_val("X-Flick-Test", "type", r.headers.get('X-Flick-Test')):
+        return
+    if not test_val("Cache-Control", "no-cache", r.headers.get('Cache-Control')):
+        return
+    print "Success"
+
+def get_chunked():
+    # GET /chunked returns the pieces as a chunked response, also through a
+    # send override that takes a piece at a time
+    print "[test] GET /chunked returns a chunked response =>",
+    for q in ("", "?plain_send=1"):
+        r = requests.get("http://" + dut + "/chunked" + q)
+        if not test_val("status_code", 200, r.status_code):
+            return
+        if not test_val("Transfer-Encoding", "chunked", r.headers.get('Transfer-Encoding')):
+            return
+        expected = ''.join(str(i) + ',' for i in xrange(500))
+        if not test_val("data", expected, r.text):
+            return
+    print "Success"
+
+def get_file():
+    # GET /file returns a part of a file
+    print "[test] GET /file returns a part of a file =>",
+    r = requests.get("http://" + dut + "/file")
+    if not test_val("status_code", 200, r.status_code):
+        return
+    if not test_val("data", ("0123456789" * 500)[100:4100], r.text):
+        return
+    print "Success"
+
+def get_stream():
+    # GET /stream has its body produced as the client takes it
+    print "[test] GET /stream produces the body on demand =>",
+    expected = "0123456789" * 10000
+    for q in ("", "&chunked=1"):
+        r = requests.get("http://" + dut + "/stream?len=100000" + q)
+        if not test_val("status_code", 200, r.status_code):
+            return
+        if q and not test_val("Transfer-Encoding", "chunked", r.headers.get('Transfer-Encoding')):
+            return
+        if not test_val("data", expected, r.text):
+            return
+    print "Success"
+
+def get_static():
+    # GET /static/ returns the index of the bundle, anything else under
+    # /static that isn't in the bundle returns 404
+    print "[test] GET /static/ returns the bundled index =>",
+    r = requests.get("http://" + dut + "/static/")
+    if not test_val("status_code", 200, r.status_code):
+        return
+    if not test_val("data", open(os.path.join(www_dir, "index.html")).read(), r.text):
+        return
+    if not test_val("Content-Type", "text/html", r.headers.get('Content-Type')):
+        return
+    r = requests.get("http://" + dut + "/static/missing.html")
+    if not test_val("status_code", 404, r.status_code):
+        return
+    print "Success"
+
+def get_static_cached():
+    # A bundled asset is gzipped for clients that accept it, and is not sent
+    # again for an If-None-Match that matches the variant that would be sent.
+    # The two variants have ETags of their own.
+    print "[test] GET /static/style.css with gzip and If-None-Match =>",
+    css = open(os.path.join(www_dir, "style.css")).read()
+    s = Session(dut, 80)
+    s.client.send("GET /static/style.css HTTP/1.1\r\nHost: " + dut +
+                  "\r\nAccept-Encoding: gzip, deflate\r\n\r\n")
+    s.read_resp_hdr()
+    if not test_val("Content-Encoding", "gzip", s.headers.get('Content-Encoding')):
+        return
+    data = zlib.decompress(s.read_resp_data(), 16 + zlib.MAX_WBITS)
+    if not test_val("data", css, data):
+        return
+    gz_etag = s.headers.get('ETag')
+
+    s.client.send("GET /static/style.css HTTP/1.1\r\nHost: " + dut +
+                  "\r\nAccept-Encoding: gzip\r\nIf-None-Match: " + gz_etag +
+                  "\r\n\r\n")
+    s.read_resp_hdr()
+    if not test_val("status", "304", s.status):
+        return
+    if not test_val("304 ETag", gz_etag, s.headers.get('ETag')):
+        return
+    # The plain variant is sent, whatever the gzipped one's ETag
+    s.client.send("GET /static/style.css HTTP/1.1\r\nHost: " + dut +
+                  "\r\nIf-None-Match: " + gz_etag + "\r\n\r\n")
+    s.read_resp_hdr()
+    if not test_val("status", "200", s.status):
+        return
+    if not test_val("data", css, s.read_resp_data()):
+        return
+    etag = s.headers.get('ETag')
+    if not test_val("ETags differ", True, etag != gz_etag):
+        return
+
+    s.client.send("GET /static/style.css HTTP/1.1\r\nHost: " + dut +
+                  "\r\nIf-None-Match: " + etag + "\r\n\r\n")
+    s.read_resp_hdr()
+    if not test_val("status", "304", s.status):
+        return
+    s.close()
+    print "Success"
+
+def get_uri_params():
+    # GET /users/{id}/posts/{post} returns the parameters, the query string
+    # doesn't take part in matching
+    print "[test] GET /users/42/posts/7?a=/b returns the URI parameters =>",
+    r = requests.get("http://" + dut + "/users/42/posts/7?a=/b")
+    if not test_val("status_code", 200, r.status_code):
+        return
+    if not test_val("data", "id=42 post=7", r.text):
+        return
+    r = requests.get("http://" + dut + "/users/42/comments")
+    if not test_val("status_code", 404, r.status_code):
+        return
+    r = requests.get("http://" + dut + "/hello?/type_html")
+    if not test_val("data", "Hello World!", r.text):
+        return
+    # Served by /hello, not /hello/type_html
+    if not test_val("X-Flick-Test", None, r.headers.get('X-Flick-Test')):
+        return
+    print "Success"
+
+def fixed_routes():
+    # The compile time routes are served, and everything else falls back to
+    # the registered handlers
+    print "[test] Routes fixed at compile time =>",
+    r = requests.get("http://" + dut + "/fixed")
+    if not test_val("data", "Fixed GET", r.text):
+        return
+    r = requests.post("http://" + dut + "/fixed", data="")
+    if not test_val("data", "Fixed POST", r.text):
+        return
+    r = requests.get("http://" + dut + "/fixed?x=1")
+    if not test_val("data", "Fixed GET", r.text):
+        return
+    r = requests.put("http://" + dut + "/fixed", data="")
+    if not test_val("status_code", 404, r.status_code):
+        return
+    r = requests.get("http://" + dut + "/fixed/more")
+    if not test_val("status_code", 404, r.status_code):
+        return
+    for i in ['00', '35', '77']:
+        r = requests.get("http://" + dut + "/many/" + i)
+        if not test_val("data", "/many/" + i, r.text):
+            return
+    r = requests.get("http://" + dut + "/hello")
+    if not test_val("data", "Hello World!", r.text):
+        return
+    print "Success"
+
+def dynamic_handler():
+    # Handlers are added and removed while the web server is running
+    print "[test] Register and unregister a handler at runtime =>",
+    r = requests.get("http://" + dut + "/dynamic/hello")
+    if not test_val("status_code", 404, r.status_code):
+        return
+    for i in xrange(3):
+        r = requests.post("http://" + dut + "/dynamic/toggle", data="")
+        if not test_val("toggle", "added", r.text):
+            return
+        r = requests.get("http://" + dut + "/dynamic/hello")
+        if not test_val("data", "Hello World!", r.text):
+            return
+        r = requests.post("http://" + dut + "/dynamic/toggle", data="")
+        if not test_val("toggle", "removed", r.text):
+            return
+        r = requests.get("http://" + dut + "/dynamic/hello")
+        if not test_val("status_code", 404, r.status_code):
+            return
+    print "Success"
+
+def get_query():
+    # The query parameters are decoded, and matched exactly
+    print "[test] GET /query returns the decoded query parameters =>",
+    r = requests.get("http://" + dut + "/query?names=x&flag&name=a+b%2Fc&=e")
+    if not test_val("data", "names=x;flag=;name=a b/c;=e;name:a b/c", r.text):
+        return
+    r = requests.get("http://" + dut + "/query")
+    if not test_val("data", "", r.text):
+        return
+    # Neither the URI nor the response is cut short, however long
+    r = requests.get("http://" + dut + "/query?long=" + "x" * 600)
+    if not test_val("data", "long=" + "x" * 600 + ";", r.text):
+        return
+    print "Success"
+
+def get_headers():
+    # Request headers are available to the handlers, looked up regardless of
+    # case
+    print "[test] GET /headers returns the request's headers =>",
+    s = Session(dut, 80)
+    s.client.send("GET /headers HTTP/1.1\r\nHost: " + dut +
+                  "\r\nauthorization:   Basic Zmxp  \r\nX-Flick-Custom: a: b\r\n\r\n")
+    s.read_resp_hdr()
+    if not test_val("data", "Basic Zmxp|a: b|-", s.read_resp_data()):
+        return
+    s.close()
+    print "Success"
+
+def trickled_request():
+    # A request that arrives a few bytes at a time, with long header lines,
+    # is parsed the same
+    print "[test] Request header that trickles in is parsed =>",
+    s = Session(dut, 80)
+    req = ("GET /headers?" + "q" * 100 + " HTTP/1.1\r\nHost: " + dut +
+           "\r\nX-Long: " + "v" * 200 + "\r\nAuthorization: " + "a" * 40 +
+           "\r\n\r\n")
+    for i in xrange(0, len(req), 3):
+        s.client.send(req[i:i + 3])
+        time.sleep(0.001)
+    s.read_resp_hdr()
+    if not test_val("data", "a" * 40 + "|-|-", s.read_resp_data()):
+        return
+    s.close()
+    print "Success"
+
+def stalled_request():
+    # A client that stops halfway through a request header doesn't hold up
+    # the others, and its request is served once the rest of it comes in
+    print "[test] Stalled request header doesn't block other sessions =>",
+    s1 = Session(dut, 80)
+    s1.client.send("GE")
+    time.sleep(0.1)
+    s2 = Session(dut, 80)
+    s2.client.settimeout(5)
+    s2.send_get("/hello")
+    try:
+        s2.read_resp_hdr()
+        data = s2.read_resp_data()
+    except socket.timeout:
+        data = None
+    s2.close()
+    if not test_val("data", "Hello World!", data):
+        s1.close()
+        return
+    s1.client.send("T /hello HTTP/1.1\r\nHost: " + dut + "\r\n\r\n")
+    s1.read_resp_hdr()
+    if not test_val("data", "Hello World!", s1.read_resp_data()):
+        return
+    s1.close()
+    print "Success"
+
 def get_hello_status():
     # GET /hello/status_500 returns status 500'
     print "[test] GET /hello/status_500 returns status 500 =>",
@@ -379,25 +647,283 @@ def leftover_data_test():
     s.close()
     print "Success"
 
+def pipelined_burst_test():
+    # All requests received in a single burst are served
+    print "[test] Pipelined burst of requests in a single send =>",
+    s = Session(dut, 80)
+
+    burst = ''
+    for i in xrange(3):
+        burst += "POST /adder HTTP/1.1\r\nHost: " + dut + "\r\nContent-Length: 1\r\n\r\n5"
+    burst += "GET /hello HTTP/1.1\r\nHost: " + dut + "\r\n\r\n"
+    s.client.send(burst)
+
+    for i in xrange(3):
+        s.read_resp_hdr()
+        if not test_val("Adder response " + str(i), str(5 * (i + 1)), s.read_resp_data()):
+            return
+    s.read_resp_hdr()
+    if not test_val("Hello World Data", "Hello World!", s.read_resp_data()):
+        return
+
+    s.close()
+    print "Success"
+
+def pipelined_mixed_test():
+    # The responses to a burst of pipelined requests go out in order, whatever
+    # they are made of, and with more of them than are held back at once
+    print "[test] Pipelined burst of mixed responses =>",
+    s = Session(dut, 80)
+    paths = []
+    for i in xrange(100):
+        paths += ['/hello', '/file', '/stream?len=' + str(i * 100 + 1)]
+    s.client.send(''.join("GET " + p + " HTTP/1.1\r\nHost: " + dut + "\r\n\r\n"
+                          for p in paths))
+
+    for p in paths:
+        s.read_resp_hdr()
+        if p == '/hello':
+            expected = "Hello World!"
+        elif p == '/file':
+            expected = ("0123456789" * 500)[100:4100]
+        else:
+            n = int(p.split('=')[1])
+            expected = ("0123456789" * (n / 10 + 1))[:n]
+        if not test_val(p, expected, s.read_resp_data()):
+            s.close()
+            return
+    s.close()
+    print "Success"
+
+def offload_test():
+    # An offloaded handler doesn't hold up the other sessions, and the
+    # requests pipelined behind it are responded to in order
+    print "[test] Offloaded handler doesn't block the web server =>",
+    s = Session(dut, 80)
+    burst = "POST /slow_echo HTTP/1.1\r\nHost: " + dut + "\r\nContent-Length: 4\r\n\r\nslow"
+    burst += ("GET /hello HTTP/1.1\r\nHost: " + dut + "\r\n\r\n") * 2
+    s.client.send(burst)
+    time.sleep(0.1)
+
+    start = time.time()
+    r = requests.get("http://" + dut + "/hello")
+    if not test_val("Other session's data", "Hello World!", r.text):
+        return
+    if not test_val("Other session served meanwhile", True, time.time() - start < 0.5):
+        return
+
+    s.read_resp_hdr()
+    if not test_val("Slow Echo Data", "slow", s.read_resp_data()):
+        return
+    for i in xrange(2):
+        s.read_resp_hdr()
+        if not test_val("Hello World Data", "Hello World!", s.read_resp_data()):
+            return
+
+    # The session goes on as usual once the pipeline is served
+    s.send_get('/hello/type_html')
+    s.read_resp_hdr()
+    if not test_val("Content-Type after the pipeline", "text/html", s.content_type.strip()):
+        return
+    if not test_val("Data after the pipeline", "Hello World!", s.read_resp_data()):
+        return
+
+    s.close()
+    print "Success"
+
+def offload_slow_body_test():
+    # The body of a request for an offloaded handler is gathered as it
+    # arrives, the other sessions are served meanwhile
+    print "[test] Offloaded request's body doesn't block the web server =>",
+    s = Session(dut, 80)
+    s.client.send("POST /slow_echo HTTP/1.1\r\nHost: " + dut + "\r\nContent-Length: 8\r\n\r\nsl")
+    time.sleep(0.1)
+
+    start = time.time()
+    r = requests.get("http://" + dut + "/hello")
+    if not test_val("Other session's data", "Hello World!", r.text):
+        return
+    if not test_val("Other session served meanwhile", True, time.time() - start < 0.5):
+        return
+
+    s.client.send("ow")
+    time.sleep(0.1)
+    s.client.send("body")
+    s.read_resp_hdr()
+    if not test_val("Slow Echo Data", "slowbody", s.read_resp_data()):
+        return
+    s.close()
+    print "Success"
+
+def async_handler_test():
+    # A detached request doesn't hold up the other sessions, and the
+    # requests pipelined behind it are responded to in order
+    print "[test] Detached request is completed later =>",
+    s = Session(dut, 80)
+    burst = "POST /async_data HTTP/1.1\r\nHost: " + dut + "\r\nContent-Length: 5\r\n\r\nlater"
+    burst += "GET /hello HTTP/1.1\r\nHost: " + dut + "\r\n\r\n"
+    s.client.send(burst)
+    time.sleep(0.1)
+
+    start = time.time()
+    r = requests.get("http://" + dut + "/hello")
+    if not test_val("Other session's data", "Hello World!", r.text):
+        return
+    if not test_val("Other session served meanwhile", True, time.time() - start < 0.5):
+        return
+
+    s.read_resp_hdr()
+    if not test_val("Async Echo Data", "later", s.read_resp_data()):
+        return
+    s.read_resp_hdr()
+    if not test_val("Hello World Data", "Hello World!", s.read_resp_data()):
+        return
+
+    s.close()
+    print "Success"
+
+def detached_closed_test():
+    # A detached request keeps its own header once its session is closed,
+    # and the next connection gets the session's buffers. The requests are
+    # laid out alike, so that their headers land at the same offsets.
+    print "[test] Detached request outlives its session =>",
+    s = Session(dut, 80)
+    s.client.send("GET /async_hdr HTTP/1.1\r\nX-Token: first\r\n\r\n")
+    time.sleep(0.2)
+    t = Session(dut, 80)
+    t.client.send("GET /async_xxx HTTP/1.1\r\nX-Token: other\r\n\r\n")
+    time.sleep(1.5)
+    r = requests.get("http://" + dut + "/async_hdr?last")
+    t.close()
+    s.close()
+    if not test_val("Detached request's header", "first", r.text):
+        return
+    print "Success"
+
+def slow_reader_test():
+    # A client that doesn't take its response holds up neither the server
+    # nor the other sessions, and gets all of it once it reads
+    print "[test] A slow reader doesn't hold up the others =>",
+    n = 16000000
+    s = Session(dut, 80)
+    s.send_get('/stream?len=' + str(n))
+    time.sleep(0.5)
+    start = time.time()
+    r = requests.get("http://" + dut + "/hello")
+    if not test_val("status_code", 200, r.status_code):
+        s.close()
+        return
+    if not test_val("served meanwhile", True, time.time() - start < 1):
+        s.close()
+        return
+    s.read_resp_hdr()
+    data = []
+    left = s.content_len
+    while left:
+        d = s.client.recv(min(left, 65536))
+        if not d:
+            break
+        data.append(d)
+        left -= len(d)
+    s.close()
+    if not test_val("data", "0123456789" * (n / 10), ''.join(data)):
+        return
+    print "Success"
+
+def session_timeouts():
+    # Sessions that stall halfway through a request header or body, or that
+    # are left idle, are closed
+    print "[test] Stalled and idle sessions are closed =>",
+    hdr = Session(dut, 80)
+    hdr.client.send("GE")
+    idle = Session(dut, 80)
+    idle.send_get("/hello")
+    idle.read_resp_hdr()
+    idle.read_resp_data()
+    body = Session(dut, 80)
+    body.client.send("POST /echo HTTP/1.1\r\nHost: " + dut +
+                     "\r\nContent-Length: 10\r\n\r\nab")
+    # The handler reads what is there, the rest is waited for after that
+    body.read_resp_hdr()
+    body.read_resp_data()
+
+    for name, s in (("header", hdr), ("idle", idle), ("body", body)):
+        s.client.settimeout(10)
+        try:
+            data = s.client.recv(1)
+        except socket.timeout:
+            data = None
+        except socket.error:
+            data = ''
+        s.close()
+        if not test_val(name + " session closed", '', data):
+            return
+    print "Success"
+
+def trickled_body_test():
+    # A body that trickles in, a byte at a time, each well within the body
+    # timeout, still has to be all in by the one deadline
+    print "[test] Trickled body is cut off at its deadline =>",
+    s = Session(dut, 80)
+    s.client.send("POST /echo HTTP/1.1\r\nHost: " + dut +
+                  "\r\nContent-Length: 10\r\n\r\nab")
+    try:
+        for c in "cdefghij":
+            time.sleep(0.3)
+            s.client.send(c)
+    except socket.error:
+        pass
+    # Whatever of the response made it out, the session is closed after it,
+    # well before its idle timeout
+    s.client.settimeout(1)
+    closed = False
+    try:
+        while s.client.recv(100):
+            pass
+        closed = True
+    except socket.timeout:
+        pass
+    except socket.error:
+        closed = True
+    s.close()
+    if not test_val("Trickled session closed", True, closed):
+        return
+    print "Success"
+
 def spillover_session(max):
-    # Session max_sessions + 1 is rejected
+    # Once all the sessions are in use, a new connection is turned away with
+    # a 503. The reactors have max sessions each, and the connections are
+    # spread across them, so there is a 503 by (max * reactors + 1).
     print "[test] Session max_sessions + 1 is rejected =>",
+    shed = requests.get("http://" + dut + "/conn_stats").text.split()[1]
     s = []
-    for i in xrange(max + 1):
-        print "Executing " + str(i)
+    status = None
+    for i in xrange(max * 4 + 1):
         a = Session(dut, 80)
-        a.send_get('/hello')
         s.append(a)
-#        time.sleep(3)
-
-#    if not test_val("status_code", 404, r.status_code):
-#        return
+        a.send_get('/hello')
+        a.read_resp_hdr()
+        a.read_resp_data()
+        if a.status != "200":
+            status = a.status
+            break
+    for a in s:
+        a.close()
+    if not test_val("status", "503", status):
+        return
+    if not test_val("Retry-After", "1", a.headers.get('Retry-After')):
+        return
+    r = requests.get("http://" + dut + "/conn_stats")
+    if not test_val("shed", True, int(r.text.split()[1]) > int(shed)):
+        return
     print "Success"
 
 ########### Execution begins here...
 # Configuration
 # Max number of threads/sessions
 max_sessions = 8
+# The assets that are bundled under /static
+www_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), "www")
 
 parser = argparse.ArgumentParser(description='Run HTTPd Test')
 parser.add_argument('-4','--ipv4', help='IPv4 address') # required=True)
@@ -416,13 +942,35 @@ post_echo()
 get_echo()
 put_echo()
 get_hello_type()
+get_hello_hdr()
+get_chunked()
+get_file()
+get_stream()
+get_static()
+get_static_cached()
+get_uri_params()
+fixed_routes()
+dynamic_handler()
+get_query()
+get_headers()
+trickled_request()
+stalled_request()
 get_hello_status()
 get_false_uri()
 print "### Sessions and Context Tests"
 parallel_sessions_adder()
 leftover_data_test()
+pipelined_burst_test()
+pipelined_mixed_test()
 async_response_test()
-# XXX spillover_session(max_sessions)
+offload_test()
+offload_slow_body_test()
+async_handler_test()
+detached_closed_test()
+slow_reader_test()
+session_timeouts()
+trickled_body_test()
+spillover_session(max_sessions)
 
 sys.exit()
 
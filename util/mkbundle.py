@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+#
+# Pack a directory of web assets into a bundle, that the web server can serve
+# straight out of memory (see httpd_bundle_open() in include/httpd.h).
+#
+# Everything that can be worked out ahead of time is: the complete response
+# headers (200, and 304 for a matching If-None-Match), a gzipped variant where
+# that is smaller, a strong ETag for each variant, and a hash table for looking
+# up the assets.
+#
+# The bundle is written out as a binary image (to be loaded with
+# httpd_bundle_map()), or as a C file that links the image into the program.
+#
+# Usage: mkbundle.py [--prefix /ui] [--name sym] [--no-gzip] [-c] -o out dir
+
+import argparse
+import gzip
+import hashlib
+import mimetypes
+import os
+import struct
+import sys
+
+MAGIC = b'FLKB'
+VERSION = 2
+HDR_FMT = '<4s7I'
+ENTRY_FMT = '<19I'
+
+COMPRESSIBLE = ('text/', 'application/javascript', 'application/json',
+                'application/xml', 'image/svg+xml')
+
+TYPES = {
+    '.html': 'text/html',
+    '.htm': 'text/html',
+    '.css': 'text/css',
+    '.js': 'application/javascript',
+    '.json': 'application/json',
+    '.svg': 'image/svg+xml',
+    '.png': 'image/png',
+    '.jpg': 'image/jpeg',
+    '.ico': 'image/x-icon',
+    '.txt': 'text/plain',
+}
+
+
+def fnv1a(data):
+    h = 0x811c9dc5
+    for c in bytearray(data):
+        h ^= c
+        h = (h * 0x01000193) & 0xffffffff
+    return h
+
+
+def content_type(path):
+    ext = os.path.splitext(path)[1].lower()
+    if ext in TYPES:
+        return TYPES[ext]
+    return mimetypes.guess_type(path)[0] or 'application/octet-stream'
+
+
+class Image:
+    def __init__(self):
+        # Room for the header, so that all offsets are from the start
+        self.data = bytearray(struct.calcsize(HDR_FMT))
+
+    def add(self, blob):
+        while len(self.data) % 4:
+            self.data.append(0)
+        off = len(self.data)
+        self.data += blob
+        return off, len(blob)
+
+    def add_str(self, s):
+        # NUL terminated, which isn't counted in the length
+        off, length = self.add(s.encode('utf-8') + b'\0')
+        return off, length - 1
+
+
+def header(status, fields):
+    lines = ['HTTP/1.1 ' + status] + [k + ': ' + v for k, v in fields]
+    return ('\r\n'.join(lines) + '\r\n\r\n').encode('ascii')
+
+
+def collect(root, prefix):
+    assets = []
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames.sort()
+        for name in sorted(filenames):
+            full = os.path.join(dirpath, name)
+            rel = os.path.relpath(full, root).replace(os.sep, '/')
+            assets.append((prefix + '/' + rel, full))
+    return assets
+
+
+def build(root, prefix, use_gzip):
+    img = Image()
+    entries = []
+    assets = collect(root, prefix)
+    paths = [p for p, _ in assets]
+
+    for path, full in assets:
+        with open(full, 'rb') as f:
+            body = f.read()
+        ctype = content_type(path)
+        etag = '"' + hashlib.sha1(body).hexdigest()[:16] + '"'
+
+        gz = None
+        if use_gzip and ctype.startswith(COMPRESSIBLE):
+            gz = gzip.compress(body, 9, mtime=0)
+            if len(gz) >= len(body):
+                gz = None
+
+        fields = [('Content-Type', ctype), ('Content-Length', str(len(body))),
+                  ('ETag', etag)]
+        if gz:
+            fields.append(('Vary', 'Accept-Encoding'))
+        hdr = img.add(header('200 OK', fields))
+        body_ref = img.add(body)
+        nm_fields = [('ETag', etag)]
+        if gz:
+            nm_fields.append(('Vary', 'Accept-Encoding'))
+        nm_hdr = img.add(header('304 Not Modified', nm_fields))
+        etag_ref = img.add_str(etag)
+        if gz:
+            # Not the same bytes, so not the same strong ETag
+            gz_etag = etag[:-1] + '-gz"'
+            gz_hdr = img.add(header('200 OK', [
+                ('Content-Type', ctype), ('Content-Length', str(len(gz))),
+                ('Content-Encoding', 'gzip'), ('ETag', gz_etag),
+                ('Vary', 'Accept-Encoding')]))
+            gz_body = img.add(gz)
+            gz_nm_hdr = img.add(header('304 Not Modified', [
+                ('ETag', gz_etag), ('Vary', 'Accept-Encoding')]))
+            gz_etag_ref = img.add_str(gz_etag)
+        else:
+            gz_hdr = gz_body = (0, 0)
+            gz_nm_hdr, gz_etag_ref = nm_hdr, etag_ref
+
+        refs = (hdr + body_ref + gz_hdr + gz_body + nm_hdr + etag_ref +
+                gz_nm_hdr + gz_etag_ref)
+        names = [path]
+        # Directories are served with their index
+        if path.endswith('/index.html'):
+            d = path[:-len('index.html')]
+            names += [d] + ([d[:-1]] if len(d) > 1 else [])
+        for name in names:
+            if name != path and name in paths:
+                continue
+            entries.append((name, refs))
+
+    # Open addressing with linear probing, at most half full
+    n_slots = 1
+    while n_slots < 2 * len(entries):
+        n_slots *= 2
+    slots = [0] * n_slots
+    entry_blobs = []
+    for i, (name, refs) in enumerate(entries):
+        h = fnv1a(name.encode('utf-8'))
+        s = h & (n_slots - 1)
+        while slots[s]:
+            s = (s + 1) & (n_slots - 1)
+        slots[s] = i + 1
+        name_ref = img.add_str(name)
+        entry_blobs.append(struct.pack(ENTRY_FMT, h, *(name_ref + refs)))
+
+    prefix_ref = img.add_str(prefix or '/')
+    entries_off, _ = img.add(b''.join(entry_blobs))
+    slots_off, _ = img.add(struct.pack('<%dI' % n_slots, *slots))
+
+    struct.pack_into(HDR_FMT, img.data, 0, MAGIC, VERSION, len(entries),
+                     n_slots, prefix_ref[0], prefix_ref[1], entries_off,
+                     slots_off)
+    return bytes(img.data)
+
+
+def write_c(image, name, out):
+    with open(out, 'w') as f:
+        f.write('/* Generated by util/mkbundle.py, do not edit */\n')
+        f.write('#include <stddef.h>\n\n')
+        f.write('const unsigned char %s[] __attribute__((aligned(4))) = {\n' % name)
+        for i in range(0, len(image), 12):
+            f.write('\t' + ' '.join('0x%02x,' % b for b in bytearray(image[i:i + 12])) + '\n')
+        f.write('};\n')
+        f.write('const size_t %s_len = %d;\n' % (name, len(image)))
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Pack web assets into a bundle')
+    ap.add_argument('dir', help='Directory with the assets')
+    ap.add_argument('-o', '--output', required=True, help='Output file')
+    ap.add_argument('--prefix', default='', help='URI prefix of the assets')
+    ap.add_argument('-c', action='store_true', help='Write a C file')
+    ap.add_argument('--name', default='httpd_bundle_image',
+                    help='Symbol name of the image, with -c')
+    ap.add_argument('--no-gzip', action='store_true',
+                    help="Don't add gzipped variants")
+    args = ap.parse_args()
+
+    prefix = args.prefix.rstrip('/')
+    if prefix and not prefix.startswith('/'):
+        sys.exit('The prefix must start with /')
+    image = build(args.dir, prefix, not args.no_gzip)
+    if args.c:
+        write_c(image, args.name, args.output)
+    else:
+        with open(args.output, 'wb') as f:
+            f.write(image)
+
+
+if __name__ == '__main__':
+    main()